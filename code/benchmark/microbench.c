@@ -0,0 +1,350 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include "../block.h"
+#include "../librufs.h"
+
+/*
+ * In-process microbenchmarks of the RUFS engine through librufs, on a fresh image and without
+ * a mount. Each benchmark prints one JSON line: ops/s over its whole run (including the final
+ * fsync of the write benchmarks), p50/p99/p999 latency of a single operation in ns, and the
+ * block reads and writes issued per operation.
+ *
+ * usage: microbench [-r] [-f] [image]    -r keeps the image in memory (DEV_RAM), -f lets
+ * the benchmark overwrite an existing image, which it otherwise refuses to touch
+ */
+
+#define IMAGE "/tmp/rufs_bench.img"
+#define N_FILES 200 /* a directory holds at most 226 entries */
+#define N_LOOKUPS 20000
+#define N_READDIRS 200
+#define IO_SIZE 4096
+#define SEQ_BYTES (8 * 1024 * 1024)
+#define N_RANDOM 4096
+#define ALLOC_CHUNK (64 * 1024)
+#define N_ALLOCS 128
+#define N_FREES 200 /* files unlinked by the free benchmark, one directory's worth */
+#define FREE_BLKS 4 /* blocks per freed file, at most RECLAIM_SYNC_BLKS so unlink frees them inline */
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+struct bench {
+	const char *name;
+	uint64_t *lat;				/* ns taken by each operation */
+	int n;
+	uint64_t start_ns;
+	uint64_t op_ns;
+	struct dev_stats dev;		/* block layer counters when the benchmark began */
+};
+
+static struct rufs_fs *fs;
+static char image[4096] = IMAGE;
+static char buf[IO_SIZE];
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Fixed seed so every run, and every build, does the same operations */
+static uint64_t next_rand() {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_begin(struct bench *b, const char *name, int max_ops) {
+	b->name = name;
+	b->lat = (uint64_t*)malloc(max_ops * sizeof(uint64_t));
+	b->n = 0;
+	rufs_dev_stats(fs, &b->dev);
+	b->start_ns = now();
+}
+
+static void op_begin(struct bench *b) {
+	b->op_ns = now();
+}
+
+static void op_end(struct bench *b) {
+	b->lat[b->n++] = now() - b->op_ns;
+}
+
+static void bench_end(struct bench *b) {
+	uint64_t wall = now() - b->start_ns;
+	struct dev_stats d;
+	rufs_dev_stats(fs, &d);
+	qsort(b->lat, b->n, sizeof(uint64_t), cmp_u64);
+	int n = b->n > 0 ? b->n : 1;
+	printf("{\"bench\":\"%s\",\"ops\":%d,\"ops_per_s\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+		"\"blk_reads_per_op\":%.3f,\"blk_writes_per_op\":%.3f}\n",
+		b->name, b->n, b->n * 1e9 / (wall > 0 ? wall : 1),
+		(unsigned long long)b->lat[(n - 1) * 50 / 100],
+		(unsigned long long)b->lat[(n - 1) * 99 / 100],
+		(unsigned long long)b->lat[(n - 1) * 999 / 1000],
+		(double)(d.reads - b->dev.reads) / n, (double)(d.writes - b->dev.writes) / n);
+	fflush(stdout);
+	free(b->lat);
+}
+
+static void fail(const char *what, int err) {
+	fprintf(stderr, "%s failed: %s\n", what, strerror(-err));
+	exit(1);
+}
+
+/* Remount so the next benchmark starts with cold engine caches */
+static void remount() {
+	rufs_unmount(fs);
+	if ((fs = rufs_mount(image)) == NULL) {
+		fail("rufs_mount", -EIO);
+	}
+}
+
+static void bench_create() {
+	struct bench b;
+	char path[64];
+	int ret;
+	if ((ret = rufs_mkdir(fs, "/c", DIRPERM)) < 0) {
+		fail("mkdir", ret);
+	}
+	bench_begin(&b, "create", N_FILES);
+	for (int i = 0; i < N_FILES; i++) {
+		struct rufs_file f = {O_RDWR, 0, 0};
+		sprintf(path, "/c/f%d", i);
+		op_begin(&b);
+		ret = rufs_create(fs, path, FILEPERM, &f);
+		op_end(&b);
+		if (ret < 0) {
+			fail("create", ret);
+		}
+		rufs_release(fs, path, &f);
+	}
+	bench_end(&b);
+}
+
+static void bench_lookup() {
+	struct bench b;
+	struct stat st;
+	char path[64];
+	bench_begin(&b, "lookup", N_LOOKUPS);
+	for (int i = 0; i < N_LOOKUPS; i++) {
+		sprintf(path, "/c/f%d", (int)(next_rand() % N_FILES));
+		op_begin(&b);
+		int ret = rufs_getattr(fs, path, &st);
+		op_end(&b);
+		if (ret < 0) {
+			fail("getattr", ret);
+		}
+	}
+	bench_end(&b);
+}
+
+static int count_entry(void *arg, const char *name, const struct stat *st, off_t off) {
+	(*(int*)arg)++;
+	return 0;
+}
+
+static void bench_readdir() {
+	struct bench b;
+	bench_begin(&b, "readdir", N_READDIRS);
+	for (int i = 0; i < N_READDIRS; i++) {
+		int entries = 0;
+		op_begin(&b);
+		int ret = rufs_readdir(fs, "/c", &entries, count_entry, 0, NULL);
+		op_end(&b);
+		if (ret < 0 || entries != N_FILES + 2) {
+			fail("readdir", ret < 0 ? ret : -EIO);
+		}
+	}
+	bench_end(&b);
+}
+
+static void bench_seq_write() {
+	struct bench b;
+	struct rufs_file f = {O_RDWR, 0, 0};
+	int ret;
+	if ((ret = rufs_create(fs, "/seq", FILEPERM, &f)) < 0) {
+		fail("create", ret);
+	}
+	bench_begin(&b, "seq_write", SEQ_BYTES / IO_SIZE);
+	for (off_t off = 0; off < SEQ_BYTES; off += IO_SIZE) {
+		memset(buf, 'a' + off / IO_SIZE % 26, IO_SIZE);
+		op_begin(&b);
+		ret = rufs_write(fs, "/seq", buf, IO_SIZE, off, &f);
+		op_end(&b);
+		if (ret != IO_SIZE) {
+			fail("write", ret < 0 ? ret : -EIO);
+		}
+	}
+	rufs_fsync(fs, "/seq", 0, &f);
+	bench_end(&b);
+	rufs_release(fs, "/seq", &f);
+}
+
+static void bench_seq_read() {
+	struct bench b;
+	struct rufs_file f = {O_RDONLY, 0, 0};
+	rufs_open(fs, "/seq", &f);
+	bench_begin(&b, "seq_read", SEQ_BYTES / IO_SIZE);
+	for (off_t off = 0; off < SEQ_BYTES; off += IO_SIZE) {
+		op_begin(&b);
+		int ret = rufs_read(fs, "/seq", buf, IO_SIZE, off, &f);
+		op_end(&b);
+		if (ret != IO_SIZE || buf[0] != 'a' + off / IO_SIZE % 26) {
+			fail("read", ret < 0 ? ret : -EIO);
+		}
+	}
+	bench_end(&b);
+	rufs_release(fs, "/seq", &f);
+}
+
+static void bench_rand_read() {
+	struct bench b;
+	struct rufs_file f = {O_RDONLY, 0, 0};
+	rufs_open(fs, "/seq", &f);
+	bench_begin(&b, "rand_read", N_RANDOM);
+	for (int i = 0; i < N_RANDOM; i++) {
+		off_t off = (off_t)(next_rand() % (SEQ_BYTES / IO_SIZE)) * IO_SIZE;
+		op_begin(&b);
+		int ret = rufs_read(fs, "/seq", buf, IO_SIZE, off, &f);
+		op_end(&b);
+		if (ret != IO_SIZE) {
+			fail("read", ret < 0 ? ret : -EIO);
+		}
+	}
+	bench_end(&b);
+	rufs_release(fs, "/seq", &f);
+}
+
+static void bench_rand_write() {
+	struct bench b;
+	struct rufs_file f = {O_RDWR, 0, 0};
+	rufs_open(fs, "/seq", &f);
+	memset(buf, 'z', IO_SIZE);
+	bench_begin(&b, "rand_write", N_RANDOM);
+	for (int i = 0; i < N_RANDOM; i++) {
+		off_t off = (off_t)(next_rand() % (SEQ_BYTES / IO_SIZE)) * IO_SIZE;
+		op_begin(&b);
+		int ret = rufs_write(fs, "/seq", buf, IO_SIZE, off, &f);
+		op_end(&b);
+		if (ret != IO_SIZE) {
+			fail("write", ret < 0 ? ret : -EIO);
+		}
+	}
+	rufs_fsync(fs, "/seq", 0, &f);
+	bench_end(&b);
+	rufs_release(fs, "/seq", &f);
+}
+
+/* Block allocation on its own: reserve fresh extents with fallocate */
+static void bench_alloc() {
+	struct bench b;
+	struct rufs_file f = {O_RDWR, 0, 0};
+	int ret;
+	if ((ret = rufs_create(fs, "/alloc", FILEPERM, &f)) < 0) {
+		fail("create", ret);
+	}
+	bench_begin(&b, "alloc", N_ALLOCS);
+	for (int i = 0; i < N_ALLOCS; i++) {
+		op_begin(&b);
+		ret = rufs_fallocate(fs, "/alloc", 0, (off_t)i * ALLOC_CHUNK, ALLOC_CHUNK, &f);
+		op_end(&b);
+		if (ret < 0) {
+			fail("fallocate", ret);
+		}
+	}
+	bench_end(&b);
+	rufs_release(fs, "/alloc", &f);
+	if ((ret = rufs_unlink(fs, "/alloc")) < 0) {
+		fail("unlink", ret);
+	}
+}
+
+/* Freeing blocks: unlink files small enough to be freed inline rather than by the reclaim thread */
+static void bench_free() {
+	struct bench b;
+	char path[64];
+	int ret;
+	if ((ret = rufs_mkdir(fs, "/f", DIRPERM)) < 0) {
+		fail("mkdir", ret);
+	}
+	for (int i = 0; i < N_FREES; i++) {
+		struct rufs_file f = {O_RDWR, 0, 0};
+		sprintf(path, "/f/f%d", i);
+		if ((ret = rufs_create(fs, path, FILEPERM, &f)) < 0) {
+			fail("create", ret);
+		}
+		if ((ret = rufs_fallocate(fs, path, 0, 0, FREE_BLKS * IO_SIZE, &f)) < 0) {
+			fail("fallocate", ret);
+		}
+		rufs_release(fs, path, &f);
+	}
+	bench_begin(&b, "free", N_FREES);
+	for (int i = 0; i < N_FREES; i++) {
+		sprintf(path, "/f/f%d", i);
+		op_begin(&b);
+		ret = rufs_unlink(fs, path);
+		op_end(&b);
+		if (ret < 0) {
+			fail("unlink", ret);
+		}
+	}
+	bench_end(&b);
+}
+
+int main(int argc, char **argv) {
+	int force = 0, named = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0) {
+			dev_set_backend(DEV_RAM);
+		}
+		else if (strcmp(argv[i], "-f") == 0) {
+			force = 1;
+		}
+		else {
+			snprintf(image, sizeof(image), "%s", argv[i]);
+			named = 1;
+		}
+	}
+	/* The default image is the benchmark's own; one the user names may hold a real file system */
+	if (named && !force && access(image, F_OK) == 0) {
+		fprintf(stderr, "%s exists, pass -f to overwrite it\n", image);
+		return 1;
+	}
+	unlink(image);
+	if ((fs = rufs_mount(image)) == NULL) {
+		fail("rufs_mount", -EIO);
+	}
+
+	bench_create();
+	remount();
+	bench_lookup();
+	bench_readdir();
+	remount();
+	bench_seq_write();
+	remount();
+	bench_seq_read();
+	remount();
+	bench_rand_read();
+	bench_rand_write();
+	bench_alloc();
+	bench_free();
+
+	rufs_unmount(fs);
+	unlink(image);
+	return 0;
+}
@@ -14,66 +14,607 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
 
 #include "block.h"
+#include "crc32c.h"
 
 //Disk size set to 32MB
 #define DISK_SIZE	32*1024*1024
 
-int diskfile = -1;
+/*
+ * The tail of the disk holds one CRC32C per block: a header block followed by
+ * CSUM_BLKS blocks of checksums. dev_blocks() only reports the space in front of it.
+ * Checksums change in memory and are written back by dev_sync() and dev_close(); the
+ * header is marked dirty before the first block write after that, so an image that was
+ * not closed cleanly gets its checksums rebuilt on open instead of failing verification.
+ */
+#define DEV_BLOCKS (DISK_SIZE / BLOCK_SIZE)
+#define CSUM_PER_BLK (BLOCK_SIZE / sizeof(uint32_t))
+#define CSUM_BLKS ((DEV_BLOCKS + CSUM_PER_BLK - 1) / CSUM_PER_BLK)
+#define CSUM_HDR_BLK (DEV_BLOCKS - CSUM_BLKS - 1)
+#define CSUM_MAGIC 0x43524333
+#define CSUM_CLEAN 0 //Header state: the checksum blocks match the data
+#define CSUM_DIRTY 1 //Header state: blocks were written since the last write-back
+#define BLK_LOCKS 64 //Stripes of the per-block locks pairing a checksum with its data
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
-    if (diskfile >= 0) {
-		return;
+/*
+ * DEV_STRIPE and DEV_TIER spread the image over member_cnt member files. Member 0 is the
+ * disk file given to dev_init() or dev_open(), the rest come from dev_set_stripe() or
+ * dev_set_tier(). Striped, stripe unit u of stripe_unit blocks lives on member u % member_cnt
+ * as that member's unit u / member_cnt. Tiered, member 0 is the fast tier and holds the
+ * first tier_blks blocks followed by the checksum blocks; member 1 holds the rest.
+ */
+struct dev_layout {
+	int backend;
+	int member_cnt;
+	int stripe_unit;
+	int tier_blks;
+	char member_path[MAX_STRIPES][PATH_MAX];
+};
+
+/* Layout the dev_set_*() calls chose for the next dev_init() or dev_open(), which copies it */
+static struct dev_layout next_layout = {DEV_FILE, 1, STRIPE_UNIT, 0};
+
+/*
+ * An open image. DEV_RAM keeps the whole image in an anonymous mapping. Block I/O only
+ * touches memory; the image is loaded from the disk file when opened and written back to it
+ * whole, by a snapshot thread every DEV_SNAP_SECS while there are changes and on dev_close().
+ */
+struct dev {
+	int diskfile;
+	struct dev_layout lay;
+	int member_fd[MAX_STRIPES];
+	uint32_t *csum_table;				/* in-memory copy of the checksum blocks */
+	char csum_dirty[CSUM_BLKS];			/* checksum blocks changed since the last write-back */
+	int csum_state;						/* state last written to the header */
+	pthread_mutex_t csum_lock;			/* guards csum_dirty and csum_state */
+	pthread_rwlock_t blk_locks[BLK_LOCKS];	/* block writes exclusive, reads shared */
+	pthread_rwlock_t flush_lock;		/* block writes shared, write-back exclusive */
+	struct dev_stats stats;
+	char *ram;
+	char ram_path[PATH_MAX];			/* disk file the image is loaded from and saved to */
+	int ram_dirty;						/* written since the last snapshot */
+	pthread_mutex_t snap_lock;
+	pthread_cond_t snap_cond;
+	pthread_t snap_thread;
+	int snap_running;
+	int snap_stop;
+};
+
+//Member holding byte off of the image, and where in that member it is
+static int stripe_map(struct dev *dev, off_t off, off_t *moff) {
+	off_t blk = off / BLOCK_SIZE;
+	off_t unit = blk / dev->lay.stripe_unit;
+	*moff = ((unit / dev->lay.member_cnt) * dev->lay.stripe_unit + blk % dev->lay.stripe_unit) * BLOCK_SIZE + off % BLOCK_SIZE;
+	return unit % dev->lay.member_cnt;
+}
+
+//Member holding byte off of a tiered image, where in it, and the bytes left in that piece
+static int tier_map(struct dev *dev, off_t off, off_t *moff, off_t *left) {
+	off_t blk = off / BLOCK_SIZE;
+	if (blk < dev->lay.tier_blks) {
+		*moff = off;
+		*left = (off_t)dev->lay.tier_blks * BLOCK_SIZE - off;
+		return 0;
+	}
+	if (blk >= CSUM_HDR_BLK) {
+		*moff = off - ((off_t)CSUM_HDR_BLK - dev->lay.tier_blks) * BLOCK_SIZE;
+		*left = (off_t)DEV_BLOCKS * BLOCK_SIZE - off;
+		return 0;
+	}
+	*moff = off - (off_t)dev->lay.tier_blks * BLOCK_SIZE;
+	*left = (off_t)CSUM_HDR_BLK * BLOCK_SIZE - off;
+	return 1;
+}
+
+//Bytes member m holds
+static off_t member_size(struct dev *dev, int m) {
+	if (dev->lay.tier_blks > 0) {
+		return (off_t)(m == 0 ? dev->lay.tier_blks + DEV_BLOCKS - CSUM_HDR_BLK : CSUM_HDR_BLK - dev->lay.tier_blks) * BLOCK_SIZE;
+	}
+	off_t units = (DEV_BLOCKS + dev->lay.stripe_unit - 1) / dev->lay.stripe_unit;
+	return (units + dev->lay.member_cnt - 1) / dev->lay.member_cnt * dev->lay.stripe_unit * BLOCK_SIZE;
+}
+
+//Split an image transfer where it crosses from one member to another and issue each piece
+static ssize_t member_io(struct dev *dev, void *buf, size_t len, off_t off, int write) {
+	size_t unit_bytes = (size_t)dev->lay.stripe_unit * BLOCK_SIZE;
+	size_t done = 0;
+	while (done < len) {
+		off_t moff, left;
+		int m;
+		if (dev->lay.tier_blks > 0) {
+			m = tier_map(dev, off + done, &moff, &left);
+		}
+		else {
+			m = stripe_map(dev, off + done, &moff);
+			left = unit_bytes - (off + done) % unit_bytes;
+		}
+		size_t chunk = (size_t)left < len - done ? (size_t)left : len - done;
+		ssize_t n = write ? pwrite(dev->member_fd[m], (char*)buf + done, chunk, moff)
+			: pread(dev->member_fd[m], (char*)buf + done, chunk, moff);
+		if (n <= 0) {
+			return done > 0 ? (ssize_t)done : n;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* 
+ * Read or write len bytes of the image at off, in the disk file or the RAM image
+ */
+static ssize_t raw_read(struct dev *dev, void *buf, size_t len, off_t off) {
+	if (dev->ram != NULL) {
+		memcpy(buf, dev->ram + off, len);
+		return len;
+	}
+	if (dev->lay.member_cnt > 1) {
+		return member_io(dev, buf, len, off, 0);
+	}
+	return pread(dev->diskfile, buf, len, off);
+}
+
+static ssize_t raw_write(struct dev *dev, const void *buf, size_t len, off_t off) {
+	if (dev->ram != NULL) {
+		memcpy(dev->ram + off, buf, len);
+		dev->ram_dirty = 1;
+		return len;
+	}
+	if (dev->lay.member_cnt > 1) {
+		return member_io(dev, (void*)buf, len, off, 1);
+	}
+	return pwrite(dev->diskfile, buf, len, off);
+}
+
+static uint32_t block_csum(struct dev *dev, const void *buf) {
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	__atomic_fetch_add(&dev->stats.csum_ns, (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dev->stats.csum_bytes, BLOCK_SIZE, __ATOMIC_RELAXED);
+	return crc;
+}
+
+//Write the checksum header with the given state
+static void csum_header(struct dev *dev, int state) {
+	uint32_t hdr[BLOCK_SIZE / sizeof(uint32_t)] = {CSUM_MAGIC, state};
+	raw_write(dev, hdr, BLOCK_SIZE, (off_t)CSUM_HDR_BLK * BLOCK_SIZE);
+	dev->csum_state = state;
+}
+
+/* 
+ * Write the changed checksum blocks back and mark the header clean. The caller holds
+ * flush_lock exclusively, so no block write is between its checksum and its data.
+ */
+static void csum_flush(struct dev *dev) {
+	pthread_mutex_lock(&dev->csum_lock);
+	for (int c = 0; c < CSUM_BLKS; c++) {
+		if (dev->csum_dirty[c]) {
+			raw_write(dev, dev->csum_table + c * CSUM_PER_BLK, BLOCK_SIZE, (off_t)(CSUM_HDR_BLK + 1 + c) * BLOCK_SIZE);
+			dev->csum_dirty[c] = 0;
+		}
+	}
+	if (dev->csum_state != CSUM_CLEAN) {
+		csum_header(dev, CSUM_CLEAN);
+	}
+	pthread_mutex_unlock(&dev->csum_lock);
+}
+
+/* 
+ * Load the checksum blocks, or checksum the current contents if the disk has none yet
+ * or was not closed cleanly. In that case blocks whose data no longer matches were
+ * written after the last write-back; they are counted, not treated as corrupt.
+ */
+static void csum_load(struct dev *dev) {
+	dev->csum_table = (uint32_t*)calloc(CSUM_BLKS, BLOCK_SIZE);
+	uint32_t hdr[2] = {0, 0};
+	raw_read(dev, hdr, sizeof(hdr), (off_t)CSUM_HDR_BLK * BLOCK_SIZE);
+	memset(dev->csum_dirty, 0, sizeof(dev->csum_dirty));
+	dev->csum_state = hdr[1];
+	if (hdr[0] == CSUM_MAGIC) {
+		raw_read(dev, dev->csum_table, CSUM_BLKS * BLOCK_SIZE, (off_t)(CSUM_HDR_BLK + 1) * BLOCK_SIZE);
+		if (hdr[1] == CSUM_CLEAN) {
+			return;
+		}
+	}
+
+	char *buf = (char*)malloc(BLOCK_SIZE);
+	int rebuilt = 0;
+	for (int i = 0; i < CSUM_HDR_BLK; i++) {
+		if (raw_read(dev, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) <= 0) {
+			memset(buf, 0, BLOCK_SIZE);
+		}
+		uint32_t crc = block_csum(dev, buf);
+		if (hdr[0] == CSUM_MAGIC && dev->csum_table[i] != crc) {
+			rebuilt++;
+		}
+		dev->csum_table[i] = crc;
+	}
+	free(buf);
+	if (rebuilt > 0) {
+		__atomic_fetch_add(&dev->stats.csum_rebuilt, rebuilt, __ATOMIC_RELAXED);
+		fprintf(stderr, "block layer: image was not closed cleanly, %d block checksums rebuilt\n", rebuilt);
+	}
+	memset(dev->csum_dirty, 1, sizeof(dev->csum_dirty));
+	dev->csum_state = CSUM_DIRTY;
+	csum_flush(dev);
+}
+
+/* 
+ * Record block_num's new checksum in memory. The first change after a write-back marks
+ * the header dirty before any data goes out.
+ */
+static void csum_update(struct dev *dev, const int block_num, uint32_t crc) {
+	pthread_mutex_lock(&dev->csum_lock);
+	if (dev->csum_table[block_num] != crc) {
+		dev->csum_table[block_num] = crc;
+		dev->csum_dirty[block_num / CSUM_PER_BLK] = 1;
+		if (dev->csum_state != CSUM_DIRTY) {
+			csum_header(dev, CSUM_DIRTY);
+		}
+	}
+	pthread_mutex_unlock(&dev->csum_lock);
+}
+
+/* 
+ * Write the RAM image back to its disk file. The image is copied under the exclusive lock,
+ * with its checksums written back, so no block write is caught half done, then saved to a
+ * temporary file renamed over the old one, so a crash part way leaves the previous
+ * snapshot intact.
+ */
+static int ram_snapshot(struct dev *dev) {
+	char *copy = (char*)malloc(DISK_SIZE);
+	pthread_rwlock_wrlock(&dev->flush_lock);
+	if (dev->csum_table != NULL) {
+		csum_flush(dev);
+	}
+	memcpy(copy, dev->ram, DISK_SIZE);
+	dev->ram_dirty = 0;
+	pthread_rwlock_unlock(&dev->flush_lock);
+
+	char tmp[PATH_MAX + 8];
+	snprintf(tmp, sizeof(tmp), "%s.snap", dev->ram_path);
+	int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	size_t done = 0;
+	while (fd >= 0 && done < DISK_SIZE) {
+		ssize_t n = pwrite(fd, copy + done, DISK_SIZE - done, done);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	int retstat = (fd >= 0 && done == DISK_SIZE && fsync(fd) == 0) ? 0 : -1;
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (retstat == 0 && rename(tmp, dev->ram_path) != 0) {
+		retstat = -1;
+	}
+	if (retstat < 0) {
+		perror("ram snapshot failed");
+		unlink(tmp);
+		dev->ram_dirty = 1;
+	} else {
+		__atomic_fetch_add(&dev->stats.ram_saves, 1, __ATOMIC_RELAXED);
+	}
+	free(copy);
+	return retstat;
+}
+
+static void *snap_worker(void *arg) {
+	struct dev *dev = (struct dev*)arg;
+	pthread_mutex_lock(&dev->snap_lock);
+	while (!dev->snap_stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += DEV_SNAP_SECS;
+		pthread_cond_timedwait(&dev->snap_cond, &dev->snap_lock, &ts);
+		if (!dev->snap_stop && dev->ram_dirty) {
+			ram_snapshot(dev);
+		}
+	}
+	pthread_mutex_unlock(&dev->snap_lock);
+	return NULL;
+}
+
+/* 
+ * Map the RAM image, on huge pages when the system has them reserved, and load the open
+ * disk file into it
+ */
+static int ram_open(struct dev *dev, const char* diskfile_path) {
+	dev->ram = (char*)mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (dev->ram == MAP_FAILED) {
+		dev->ram = (char*)mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (dev->ram == MAP_FAILED) {
+			perror("ram image mmap failed");
+			dev->ram = NULL;
+			return -1;
+		}
+		madvise(dev->ram, DISK_SIZE, MADV_HUGEPAGE);
+	}
+	size_t done = 0;
+	while (done < DISK_SIZE) {
+		ssize_t n = pread(dev->diskfile, dev->ram + done, DISK_SIZE - done, done);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	strncpy(dev->ram_path, diskfile_path, PATH_MAX - 1);
+	dev->ram_dirty = 0;
+	dev->snap_stop = 0;
+	dev->snap_running = pthread_create(&dev->snap_thread, NULL, snap_worker, dev) == 0;
+	return 0;
+}
+
+static void ram_close(struct dev *dev) {
+	if (dev->snap_running) {
+		pthread_mutex_lock(&dev->snap_lock);
+		dev->snap_stop = 1;
+		pthread_cond_signal(&dev->snap_cond);
+		pthread_mutex_unlock(&dev->snap_lock);
+		pthread_join(dev->snap_thread, NULL);
+		dev->snap_running = 0;
+	}
+	if (dev->ram_dirty) {
+		ram_snapshot(dev);
+	}
+	munmap(dev->ram, DISK_SIZE);
+	dev->ram = NULL;
+}
+
+/* 
+ * Open members 1 and up next to the disk file already open as member 0. A new image sizes
+ * them; an existing one must have been made with the same members and layout.
+ */
+static int members_open(struct dev *dev, int create) {
+	dev->member_fd[0] = dev->diskfile;
+	for (int m = 0; m < dev->lay.member_cnt; m++) {
+		if (m > 0) {
+			dev->member_fd[m] = open(dev->lay.member_path[m], create ? O_CREAT | O_RDWR : O_RDWR, S_IRUSR | S_IWUSR);
+		}
+		struct stat st;
+		int bad = dev->member_fd[m] < 0;
+		if (!bad && create) {
+			bad = ftruncate(dev->member_fd[m], member_size(dev, m)) != 0;
+		}
+		else if (!bad) {
+			bad = fstat(dev->member_fd[m], &st) != 0 || st.st_size != member_size(dev, m);
+		}
+		if (bad) {
+			fprintf(stderr, "member %d of the disk image: cannot open, or not made with this layout\n", m);
+			for (int k = 1; k <= m; k++) {
+				if (dev->member_fd[k] >= 0) {
+					close(dev->member_fd[k]);
+				}
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//Select the backing store used by the next dev_init() or dev_open()
+void dev_set_backend(int dev_backend) {
+	next_layout.backend = dev_backend;
+}
+
+/* 
+ * Stripe the image over the disk file and n more member files, unit_blks blocks at a time.
+ * Takes effect at the next dev_init() or dev_open().
+ */
+int dev_set_stripe(const char **members, int n, int unit_blks) {
+	if (n < 1 || n >= MAX_STRIPES || unit_blks < 1) {
+		return -1;
+	}
+	for (int m = 0; m < n; m++) {
+		strncpy(next_layout.member_path[m + 1], members[m], PATH_MAX - 1);
+	}
+	next_layout.stripe_unit = unit_blks;
+	next_layout.tier_blks = 0;
+	next_layout.member_cnt = n + 1;
+	next_layout.backend = DEV_STRIPE;
+	return 0;
+}
+
+/* 
+ * Keep the first fast_blks blocks and the checksum blocks in the disk file, the fast tier,
+ * and the rest of the image in slow_path. Takes effect at the next dev_init() or dev_open().
+ */
+int dev_set_tier(const char *slow_path, int fast_blks) {
+	if (fast_blks < 1 || fast_blks >= CSUM_HDR_BLK) {
+		return -1;
+	}
+	strncpy(next_layout.member_path[1], slow_path, PATH_MAX - 1);
+	next_layout.tier_blks = fast_blks;
+	next_layout.member_cnt = 2;
+	next_layout.backend = DEV_TIER;
+	return 0;
+}
+
+//Blocks at the start of the image that live on the fast tier, all of them unless tiered
+int dev_fast_blocks(struct dev *dev) {
+	return dev->lay.tier_blks > 0 ? dev->lay.tier_blks : dev_blocks();
+}
+
+int dev_members(struct dev *dev) {
+	return dev->lay.member_cnt;
+}
+
+//Member file a block lives on, 0 unless striped or tiered
+int dev_member(struct dev *dev, int block_num) {
+	off_t moff, left;
+	if (dev->lay.tier_blks > 0) {
+		return tier_map(dev, (off_t)block_num * BLOCK_SIZE, &moff, &left);
+	}
+	return dev->lay.member_cnt > 1 ? stripe_map(dev, (off_t)block_num * BLOCK_SIZE, &moff) : 0;
+}
+
+/* 
+ * Open the disk file, creating and sizing a new image if create is set, with the layout
+ * the dev_set_*() calls chose. Returns NULL if the image or one of its members cannot be
+ * opened.
+ */
+static struct dev* dev_start(const char* diskfile_path, int create) {
+    struct dev *dev = (struct dev*)calloc(1, sizeof(struct dev));
+    if (dev == NULL) {
+		return NULL;
+    }
+    dev->lay = next_layout;
+    if (dev->lay.backend != DEV_STRIPE && dev->lay.backend != DEV_TIER) {
+		dev->lay.member_cnt = 1;
+		dev->lay.tier_blks = 0;
+    }
+    pthread_mutex_init(&dev->csum_lock, NULL);
+    for (int i = 0; i < BLK_LOCKS; i++) {
+		pthread_rwlock_init(&dev->blk_locks[i], NULL);
     }
-    
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
+    pthread_rwlock_init(&dev->flush_lock, NULL);
+    pthread_mutex_init(&dev->snap_lock, NULL);
+    pthread_cond_init(&dev->snap_cond, NULL);
+
+    dev->diskfile = open(diskfile_path, create ? O_CREAT | O_RDWR : O_RDWR, S_IRUSR | S_IWUSR);
+    if (dev->diskfile < 0) {
 		perror("disk_open failed");
-		exit(EXIT_FAILURE);
+		free(dev);
+		return NULL;
+    }
+    if (dev->lay.member_cnt == 1 && create) {
+		ftruncate(dev->diskfile, DISK_SIZE);
+    }
+    if ((dev->lay.member_cnt > 1 && members_open(dev, create) < 0) || (dev->lay.backend == DEV_RAM && ram_open(dev, diskfile_path) < 0)) {
+		close(dev->diskfile);
+		free(dev);
+		return NULL;
+    }
+    if (BLOCK_CSUM) {
+		csum_load(dev);
     }
-	
-    ftruncate(diskfile, DISK_SIZE);
+    return dev;
+}
+
+//Creates a file which is your new emulated disk
+struct dev* dev_init(const char* diskfile_path) {
+	return dev_start(diskfile_path, 1);
 }
 
 //Function to open the disk file
-int dev_open(const char* diskfile_path) {
-    if (diskfile >= 0) {
-		return 0;
-    }
-    
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
-		return -1;
+struct dev* dev_open(const char* diskfile_path) {
+	return dev_start(diskfile_path, 0);
+}
+
+/* 
+ * Write the checksums changed since the last write-back to the image
+ */
+void dev_sync(struct dev *dev) {
+    if (dev->csum_table == NULL) {
+		return;
     }
-	return 0;
+    pthread_rwlock_wrlock(&dev->flush_lock);
+    csum_flush(dev);
+    pthread_rwlock_unlock(&dev->flush_lock);
 }
 
-void dev_close() {
-    if (diskfile >= 0) {
-		close(diskfile);
+void dev_close(struct dev *dev) {
+    if (dev->ram != NULL) {
+		ram_close(dev);
+    }
+    else {
+		dev_sync(dev);
+    }
+    for (int m = 1; m < dev->lay.member_cnt; m++) {
+		close(dev->member_fd[m]);
     }
+    close(dev->diskfile);
+    free(dev->csum_table);
+    pthread_mutex_destroy(&dev->csum_lock);
+    for (int i = 0; i < BLK_LOCKS; i++) {
+		pthread_rwlock_destroy(&dev->blk_locks[i]);
+    }
+    pthread_rwlock_destroy(&dev->flush_lock);
+    pthread_mutex_destroy(&dev->snap_lock);
+    pthread_cond_destroy(&dev->snap_cond);
+    free(dev);
+}
+
+//Number of blocks available to the file system
+int dev_blocks() {
+	return BLOCK_CSUM ? CSUM_HDR_BLK : DEV_BLOCKS;
+}
+
+void dev_get_stats(struct dev *dev, struct dev_stats *out) {
+	out->reads = __atomic_load_n(&dev->stats.reads, __ATOMIC_RELAXED);
+	out->writes = __atomic_load_n(&dev->stats.writes, __ATOMIC_RELAXED);
+	out->csum_bytes = __atomic_load_n(&dev->stats.csum_bytes, __ATOMIC_RELAXED);
+	out->csum_ns = __atomic_load_n(&dev->stats.csum_ns, __ATOMIC_RELAXED);
+	out->csum_errors = __atomic_load_n(&dev->stats.csum_errors, __ATOMIC_RELAXED);
+	out->ram_saves = __atomic_load_n(&dev->stats.ram_saves, __ATOMIC_RELAXED);
+	out->csum_rebuilt = __atomic_load_n(&dev->stats.csum_rebuilt, __ATOMIC_RELAXED);
 }
 
 //Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+int bio_read(struct dev *dev, const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (block_num < 0 || block_num >= dev_blocks()) {
+		fprintf(stderr, "block_read: block %d out of range\n", block_num);
+		memset(buf, 0, BLOCK_SIZE);
+		return -1;
+    }
+    /*Shared with other readers, never overlapping a write of the block*/
+    uint32_t expect = 0;
+    if (dev->csum_table != NULL) {
+		pthread_rwlock_rdlock(&dev->blk_locks[block_num % BLK_LOCKS]);
+    }
+    retstat = raw_read(dev, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (dev->csum_table != NULL) {
+		expect = dev->csum_table[block_num];
+		pthread_rwlock_unlock(&dev->blk_locks[block_num % BLK_LOCKS]);
+    }
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
 			perror("block_read failed");
     }
+    __atomic_fetch_add(&dev->stats.reads, 1, __ATOMIC_RELAXED);
+
+    if (retstat >= 0 && dev->csum_table != NULL && block_csum(dev, buf) != expect) {
+		__atomic_fetch_add(&dev->stats.csum_errors, 1, __ATOMIC_RELAXED);
+		fprintf(stderr, "block_read: checksum mismatch on block %d\n", block_num);
+		errno = EIO;
+		return -1;
+    }
 
     return retstat;
 }
 
 //Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
+int bio_write(struct dev *dev, const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (block_num < 0 || block_num >= dev_blocks()) {
+		fprintf(stderr, "block_write: block %d out of range\n", block_num);
+		return -1;
+    }
+    /*A write-back or RAM snapshot must not land between the checksum and the data, nor
+      another write or a read of the same block*/
+    uint32_t crc = dev->csum_table != NULL ? block_csum(dev, buf) : 0;
+    pthread_rwlock_rdlock(&dev->flush_lock);
+    if (dev->csum_table != NULL) {
+		pthread_rwlock_wrlock(&dev->blk_locks[block_num % BLK_LOCKS]);
+		csum_update(dev, block_num, crc);
+    }
+    __atomic_fetch_add(&dev->stats.writes, 1, __ATOMIC_RELAXED);
+    retstat = raw_write(dev, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (dev->csum_table != NULL) {
+		pthread_rwlock_unlock(&dev->blk_locks[block_num % BLK_LOCKS]);
+    }
+    pthread_rwlock_unlock(&dev->flush_lock);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
@@ -8,12 +8,53 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096 //4096 //8192 //16384
 
-void dev_init(const char* diskfile_path);
-int dev_open(const char* diskfile_path);
-void dev_close();
-int bio_read(const int block_num, void *buf);
-int bio_write(const int block_num, const void *buf);
+#define BLOCK_CSUM 1 //Verify a CRC32C per block on every read
+
+/* Backing stores, see dev_set_backend() */
+#define DEV_FILE 0 //Every block I/O goes to the disk file
+#define DEV_RAM 1 //Image kept in memory, loaded from the disk file and snapshotted back to it
+#define DEV_STRIPE 2 //Image striped over the disk file and the member files of dev_set_stripe()
+#define DEV_TIER 3 //Image split over a fast disk file and the slow file of dev_set_tier()
+#define TIER_FAST_BLKS 2048 //Default blocks kept on the fast tier
+#define MAX_STRIPES 8 //Max files an image is striped over
+#define STRIPE_UNIT 16 //Default blocks per stripe unit, one I/O pool task's worth
+#define DEV_SNAP_SECS 30 //How often a changed RAM image is written back
+
+/* Block layer counters, see dev_get_stats() */
+struct dev_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t csum_bytes;	/* bytes run through crc32c */
+	uint64_t csum_ns;		/* time spent computing checksums */
+	uint64_t csum_errors;	/* reads that failed verification */
+	uint64_t ram_saves;		/* DEV_RAM snapshots written back to the disk file */
+	uint64_t csum_rebuilt;	/* checksums recomputed after an unclean shutdown */
+};
+
+#ifndef RUFS_API
+#define RUFS_API __attribute__((visibility("default"))) //Exported from librufs, which hides the rest
+#endif
+
+/* An open disk image, from dev_init() or dev_open() */
+struct dev;
+
+RUFS_API void dev_set_backend(int dev_backend);
+RUFS_API int dev_set_stripe(const char **members, int n, int unit_blks);
+RUFS_API int dev_set_tier(const char *slow_path, int fast_blks);
+int dev_fast_blocks(struct dev *dev);
+int dev_members(struct dev *dev);
+int dev_member(struct dev *dev, int block_num);
+struct dev* dev_init(const char* diskfile_path);
+struct dev* dev_open(const char* diskfile_path);
+void dev_sync(struct dev *dev);
+void dev_close(struct dev *dev);
+int dev_blocks();
+void dev_get_stats(struct dev *dev, struct dev_stats *stats);
+int bio_read(struct dev *dev, const int block_num, void *buf);
+int bio_write(struct dev *dev, const int block_num, const void *buf);
 
 #endif
@@ -0,0 +1,146 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	crc32c.c
+ *
+ *	CRC32C for block checksums. On x86-64 with SSE4.2 the crc32 instruction runs
+ *	three independent lanes at once and PCLMUL folds the lanes back together;
+ *	everywhere else a slicing-by-8 table is used.
+ *
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#define POLY 0x82F63B78 //CRC32C polynomial, bit-reflected
+#define LANE 1360 //Bytes per lane in the three-way loop (4096 = 3 * 1360 + 16)
+
+static uint32_t table[8][256];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int use_hw = 0;
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+static uint64_t shift_lane;		/* x^(8*LANE - 33) mod P, shifts a crc past one lane */
+static uint64_t shift_2lane;	/* x^(16*LANE - 33) mod P, shifts past two lanes */
+
+/* 
+ * x^n mod P in the bit-reflected representation the crc32 instruction uses
+ */
+static uint32_t xpow_mod(uint32_t n) {
+	uint32_t k = 0x80000000; /* x^0 */
+	while(n--){
+		k = (k >> 1) ^ ((k & 1) ? POLY : 0);
+	}
+	return k;
+}
+
+/* 
+ * crc * x^(8 * bytes) mod P given k = x^(8 * bytes - 33): one carry-less multiply,
+ * reduced back to 32 bits by the crc32 instruction
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc_shift(uint32_t crc, uint64_t k) {
+	__m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi64_si128(k), 0x00);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+	const unsigned char* p = buf;
+	uint64_t c0 = crc;
+
+	// Three lanes in flight hide the crc32 instruction's latency
+	while(len >= 3 * LANE){
+		uint64_t c1 = 0, c2 = 0;
+		for(int i = 0; i < LANE; i += 8){
+			uint64_t a, b, c;
+			memcpy(&a, p + i, 8);
+			memcpy(&b, p + LANE + i, 8);
+			memcpy(&c, p + 2 * LANE + i, 8);
+			c0 = _mm_crc32_u64(c0, a);
+			c1 = _mm_crc32_u64(c1, b);
+			c2 = _mm_crc32_u64(c2, c);
+		}
+		c0 = crc_shift(c0, shift_2lane) ^ crc_shift(c1, shift_lane) ^ c2;
+		p += 3 * LANE;
+		len -= 3 * LANE;
+	}
+	while(len >= 8){
+		uint64_t a;
+		memcpy(&a, p, 8);
+		c0 = _mm_crc32_u64(c0, a);
+		p += 8;
+		len -= 8;
+	}
+	while(len--){
+		c0 = _mm_crc32_u8(c0, *p++);
+	}
+	return c0;
+}
+#endif
+
+static void crc32c_init() {
+	for(int n = 0; n < 256; n++){
+		uint32_t c = n;
+		for(int k = 0; k < 8; k++){
+			c = (c >> 1) ^ ((c & 1) ? POLY : 0);
+		}
+		table[0][n] = c;
+	}
+	for(int n = 0; n < 256; n++){
+		for(int k = 1; k < 8; k++){
+			table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+		}
+	}
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")){
+		shift_lane = xpow_mod(8 * LANE - 33);
+		shift_2lane = xpow_mod(16 * LANE - 33);
+		use_hw = 1;
+	}
+#endif
+}
+
+/* 
+ * Raw (non-inverted) table update, slicing eight bytes per step
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+	while(len >= 8){
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^ table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+		      table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^ table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while(len--){
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	}
+	return crc;
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+	pthread_once(&init_once, crc32c_init);
+	return ~crc32c_table(~crc, buf, len);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	pthread_once(&init_once, crc32c_init);
+#if defined(__x86_64__)
+	if(use_hw){
+		return ~crc32c_hw(~crc, buf, len);
+	}
+#endif
+	return ~crc32c_table(~crc, buf, len);
+}
+
+const char *crc32c_impl() {
+	pthread_once(&init_once, crc32c_init);
+	return use_hw ? "sse4.2+pclmul" : "table";
+}
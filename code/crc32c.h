@@ -0,0 +1,23 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	crc32c.h
+ *
+ */
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli) of len bytes, continuing from crc (start with 0) */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Portable table-driven CRC32C, always available */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/* Name of the implementation crc32c() dispatches to */
+const char *crc32c_impl();
+
+#endif
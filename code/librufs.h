@@ -0,0 +1,73 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	librufs.h
+ *
+ */
+
+#ifndef _LIBRUFS_H
+#define _LIBRUFS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * In-process interface to the file system engine. Every operation takes the handle returned
+ * by rufs_mount() and returns 0 or a byte count on success and a negative errno on failure,
+ * the same contract as the FUSE operation of the same name. Choose the block device backend
+ * with the dev_set_*() calls of block.h before mounting. These are the only symbols librufs
+ * exports.
+ */
+
+#ifndef RUFS_API
+#define RUFS_API __attribute__((visibility("default"))) //Exported from librufs, which hides the rest
+#endif
+
+/* A mounted image; several can be mounted at once, each keeps its own state */
+struct rufs_fs;
+struct dev_stats;
+
+/* An open file or directory */
+struct rufs_file {
+	int flags;						/* open(2) flags */
+	int direct_io;					/* set by rufs_open() if the kernel must not cache the file */
+	uint64_t fh;					/* state from rufs_open() or rufs_create(), freed by rufs_release() */
+};
+
+/* Called by rufs_readdir() once per entry, returns nonzero to stop */
+typedef int (*rufs_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
+/* Mount the image at path, creating a new file system there if it does not exist. Returns
+ * NULL if the image or one of its member files cannot be opened or has an unsupported format. */
+RUFS_API struct rufs_fs* rufs_mount(const char *image);
+RUFS_API void rufs_unmount(struct rufs_fs *fs);
+
+RUFS_API int rufs_getattr(struct rufs_fs *fs, const char *path, struct stat *stbuf);
+RUFS_API int rufs_opendir(struct rufs_fs *fs, const char *path, struct rufs_file *fi);
+RUFS_API int rufs_readdir(struct rufs_fs *fs, const char *path, void *buffer, rufs_fill_dir_t filler, off_t offset, struct rufs_file *fi);
+RUFS_API int rufs_releasedir(struct rufs_fs *fs, const char *path, struct rufs_file *fi);
+RUFS_API int rufs_mkdir(struct rufs_fs *fs, const char *path, mode_t mode);
+RUFS_API int rufs_rmdir(struct rufs_fs *fs, const char *path);
+RUFS_API int rufs_create(struct rufs_fs *fs, const char *path, mode_t mode, struct rufs_file *fi);
+RUFS_API int rufs_symlink(struct rufs_fs *fs, const char *target, const char *path);
+RUFS_API int rufs_readlink(struct rufs_fs *fs, const char *path, char *buf, size_t size);
+RUFS_API int rufs_open(struct rufs_fs *fs, const char *path, struct rufs_file *fi);
+RUFS_API int rufs_read(struct rufs_fs *fs, const char *path, char *buffer, size_t size, off_t offset, struct rufs_file *fi);
+RUFS_API int rufs_write(struct rufs_fs *fs, const char *path, const char *buffer, size_t size, off_t offset, struct rufs_file *fi);
+RUFS_API int rufs_unlink(struct rufs_fs *fs, const char *path);
+RUFS_API int rufs_rename(struct rufs_fs *fs, const char *from, const char *to);
+RUFS_API int rufs_truncate(struct rufs_fs *fs, const char *path, off_t size);
+RUFS_API int rufs_release(struct rufs_fs *fs, const char *path, struct rufs_file *fi);
+RUFS_API int rufs_flush(struct rufs_fs *fs, const char *path, struct rufs_file *fi);
+RUFS_API int rufs_fsync(struct rufs_fs *fs, const char *path, int datasync, struct rufs_file *fi);
+RUFS_API int rufs_utimens(struct rufs_fs *fs, const char *path, const struct timespec tv[2]);
+RUFS_API int rufs_fallocate(struct rufs_fs *fs, const char *path, int mode, off_t offset, off_t len, struct rufs_file *fi);
+/* RUFS_IOC_* and FS_IOC_*FLAGS commands of rufs.h; data is the argument in and the result out */
+RUFS_API int rufs_ioctl(struct rufs_fs *fs, const char *path, int cmd, void *data);
+/* Block layer counters of the image's device, struct dev_stats of block.h */
+RUFS_API void rufs_dev_stats(struct rufs_fs *fs, struct dev_stats *stats);
+
+#endif
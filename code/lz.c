@@ -0,0 +1,184 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	lz.c
+ *
+ *	Single-pass LZ77 in the LZ4 block format: a token byte holds the literal and
+ *	match lengths, followed by the literals, a 2-byte offset and length extensions.
+ *	Greedy matching through one hash table keeps it fast enough for the write path.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_LOG 12
+#define MINMATCH 4
+#define LASTLITERALS 5	//The format requires the last 5 bytes to be literals
+#define MFLIMIT 12		//No match may start in the last 12 bytes
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* 
+ * Append the 255-run extension of a length field, NULL if it does not fit
+ */
+static unsigned char *put_len(unsigned char *op, unsigned char *oend, int len) {
+	while(len >= 255){
+		if(op >= oend){
+			return NULL;
+		}
+		*op++ = 255;
+		len -= 255;
+	}
+	if(op >= oend){
+		return NULL;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* 
+ * Emit one sequence: literals [anchor, anchor + lit) then a match (mlen 0 for the last one)
+ */
+static unsigned char *put_seq(unsigned char *op, unsigned char *oend, const unsigned char *anchor, int lit, int off, int mlen) {
+	if(op >= oend){
+		return NULL;
+	}
+	unsigned char* token = op++;
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if(lit >= 15 && (op = put_len(op, oend, lit - 15)) == NULL){
+		return NULL;
+	}
+	if(lit > oend - op){
+		return NULL;
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+	if(mlen == 0){
+		return op;
+	}
+
+	if(oend - op < 2){
+		return NULL;
+	}
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+	mlen -= MINMATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if(mlen >= 15 && (op = put_len(op, oend, mlen - 15)) == NULL){
+		return NULL;
+	}
+	return op;
+}
+
+int lz_compress(const void *src, int srclen, void *dst, int dstcap) {
+	const unsigned char* base = src;
+	const unsigned char* ip = base;
+	const unsigned char* anchor = base;
+	const unsigned char* iend = base + srclen;
+	unsigned char* op = dst;
+	unsigned char* oend = op + dstcap;
+	uint16_t table[1 << HASH_LOG];
+
+	if(srclen > MAX_OFFSET + 1){
+		return 0;
+	}
+	memset(table, 0, sizeof(table));
+	while(srclen > MFLIMIT && ip < iend - MFLIMIT){
+		uint32_t seq = read32(ip);
+		uint32_t h = hash4(seq);
+		const unsigned char* ref = base + table[h];
+		table[h] = ip - base;
+		if(ref >= ip || read32(ref) != seq){
+			ip++;
+			continue;
+		}
+
+		// Extend the match as far as the last-literals rule allows
+		int mlen = MINMATCH;
+		while(ip + mlen < iend - LASTLITERALS && ip[mlen] == ref[mlen]){
+			mlen++;
+		}
+		op = put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen);
+		if(op == NULL){
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, anchor, iend - anchor, 0, 0);
+	return op == NULL ? 0 : op - (unsigned char*)dst;
+}
+
+int lz_decompress(const void *src, int srclen, void *dst, int dstlen) {
+	const unsigned char* ip = src;
+	const unsigned char* iend = ip + srclen;
+	unsigned char* op = dst;
+	unsigned char* oend = op + dstlen;
+
+	while(ip < iend){
+		int token = *ip++;
+		int lit = token >> 4;
+		if(lit == 15){
+			int b;
+			do{
+				if(ip >= iend){
+					return -1;
+				}
+				b = *ip++;
+				lit += b;
+			} while(b == 255);
+		}
+		if(lit > iend - ip || lit > oend - op){
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if(ip == iend){
+			break; /* the last sequence has no match */
+		}
+
+		if(iend - ip < 2){
+			return -1;
+		}
+		int off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(off == 0 || off > op - (unsigned char*)dst){
+			return -1;
+		}
+		int mlen = token & 15;
+		if(mlen == 15){
+			int b;
+			do{
+				if(ip >= iend){
+					return -1;
+				}
+				b = *ip++;
+				mlen += b;
+			} while(b == 255);
+		}
+		mlen += MINMATCH;
+		if(mlen > oend - op){
+			return -1;
+		}
+		// An overlapping match repeats the last off bytes, so copy at most off at a time
+		for(int i = 0; i < mlen; i += off){
+			memcpy(op + i, op + i - off, mlen - i < off ? mlen - i : off);
+		}
+		op += mlen;
+	}
+	return op - (unsigned char*)dst;
+}
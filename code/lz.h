@@ -0,0 +1,19 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	lz.h
+ *
+ */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/* Compress srclen bytes (at most 64 KiB) in LZ4 block format. Returns the compressed
+ * size, or 0 if it does not fit in dstcap bytes */
+int lz_compress(const void *src, int srclen, void *dst, int dstcap);
+
+/* Expand srclen bytes of compressed data into dst. Returns the number of bytes produced,
+ * or -1 if the input is malformed or would overrun dstlen */
+int lz_decompress(const void *src, int srclen, void *dst, int dstlen);
+
+#endif
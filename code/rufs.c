@@ -5,9 +5,8 @@
  *
  */
 
-#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
 
-#include <fuse.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,174 +15,3990 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/falloc.h>
 
 #include "block.h"
+#include "crc32c.h"
+#include "lz.h"
 #include "rufs.h"
+#include "librufs.h"
 
 #define SUPER_IDX 0
 #define IBM_IDX 1
-#define DBM_IDX 2
-#define IREG_IDX 3
+#define RC_IDX 2
+#define RC_BLKS ((MAX_DNUM * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define FP_BLKS ((MAX_DNUM * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
 #define ROOT_INO 0
+#define BLK_SECTORS (BLOCK_SIZE / 512) //st_blocks units per block
+#define STATS_PATH "/.rufs_stats" //Read-only virtual file with runtime counters, not listed by readdir
+#define STATS_MAX 4096
+#define BMAP_LOOKUP 0 //bmap_slot(): only find the slot
+#define BMAP_CREATE 1 //allocate missing indirect blocks, copy shared ones
+#define BMAP_MODIFY 2 //copy shared indirect blocks, leave missing ones missing
+#define SNAP_DIR "/.snapshots" //Read-only snapshot trees, one directory per snapshot, not listed by readdir
 
-// Declare your in-memory data structures here
-char diskfile_path[PATH_MAX];
-struct superblock* s_block_mem;
+_Static_assert(sizeof(struct superblock) <= BLOCK_SIZE, "superblock must fit in one block");
+_Static_assert(ITABLE_BLKS <= 32, "snapshot copied mask has one bit per inode table block");
+
+/* Delayed-allocation page cache: dirty file blocks that have no physical block yet */
+struct page {
+	uint16_t ino;
+	uint32_t lblk;
+	int reserved;				/* counts against dalloc_reserved until written back */
+	int hole;					/* over a hole, so the file gains a block at writeback */
+	int written;				/* written back, evicted once the inode with its new mapping is */
+	struct page* hash_next;
+	struct page* ino_next;
+	char data[BLOCK_SIZE];
+};
+
+/* Sharded table behind the caches: slot i belongs to shard i % CT_SHARDS, whose mutex
+   serializes writers and whose sequence count is odd while one is inside. Readers take no
+   lock, they copy what they need and retry if the count moved. Hits and misses are counted
+   per shard so lookups on different shards share no cache line. */
+struct ct_shard {
+	pthread_mutex_t lock;
+	uint32_t seq;
+	uint64_t hits;
+	uint64_t misses;
+} __attribute__((aligned(64)));
+struct ctable {
+	struct ct_shard shards[CT_SHARDS];
+};
+
+/* Block cache: decompressed cluster blocks keyed by the physical block that heads the cluster
+   and the slot in it, and prefetched plain blocks keyed by their own block and BCACHE_RAW;
+   direct mapped. Files sharing a cluster or block (clones, snapshots) share entries. */
+struct cblock {
+	int blkno;
+	uint32_t slot;
+	int valid;
+	char data[BLOCK_SIZE];
+};
+
+/* Dentry cache: (parent inode, name) -> inode of live directory entries, direct mapped */
+struct dcentry {
+	uint16_t parent;
+	uint16_t ino;
+	int valid;
+	char name[208];
+};
+
+/* Readahead: per-open-file state in fi->fh, and a queue of prefetches for the readahead thread */
+struct ra_state {
+	pthread_mutex_t lock;
+	uint32_t next;				/* block a sequential reader asks for next */
+	uint32_t window;			/* blocks kept prefetched ahead of the reader, 0 = none */
+	uint32_t ahead;				/* prefetch has been requested up to this block */
+	struct ra_state* free_next;	/* in fs->ra_free while no file has it */
+};
+struct ra_job {
+	struct inode inode;			/* copy of the inode as the reader saw it */
+	uint32_t lblk;
+	uint32_t n;
+	uint32_t itab;				/* nonzero: stat-ahead, load these inode table blocks (bit per block) instead */
+};
+
+/* I/O pool: workers with bounded deques, each taking its own newest task and, when idle,
+   stealing the oldest task of another; each subsystem has at most io_depth[] tasks queued
+   or running, beyond that its caller runs the task itself */
+enum io_class { IO_READ, IO_WRITE, IO_DEFRAG, IO_RECLAIM, IO_TIER, IO_CLASSES };
+static const int io_depth[IO_CLASSES] = {IO_QUEUE, IO_QUEUE, IO_WORKERS * 2, IO_WORKERS, IO_WORKERS};
+struct io_group {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;				/* tasks submitted and not yet finished */
+};
+struct io_task {
+	void (*fn)(void *arg);
+	void *arg;
+	struct io_group *grp;
+	int cls;
+};
+struct io_worker {
+	pthread_mutex_t lock;		/* guards q */
+	struct io_task q[IO_QUEUE];
+	int head, count;
+	pthread_t thread;
+	struct rufs_fs *fs;			/* file system whose pool this is */
+	int id;
+};
+static __thread int io_self = -1;                    /* pool worker this thread is, -1 if none */
+
+/* Running totals of a defragmentation pass */
+struct defrag_tally {
+	int64_t steps;				/* pairs of consecutive mapped blocks looked at */
+	int64_t before;				/* of those, pairs not adjacent on disk before the pass */
+	int64_t after;				/* and after it */
+	int64_t files;				/* files rewritten into one extent */
+	int64_t blocks;				/* blocks moved */
+};
+
+/* File system counters reported through STATS_PATH */
+struct fs_stats {
+	uint64_t clusters_compressed;
+	uint64_t clusters_raw;			/* clusters that did not compress and were stored as is */
+	uint64_t compress_in;			/* bytes handed to the compressor */
+	uint64_t compress_out;			/* bytes it produced for the clusters it kept */
+	uint64_t dedup_hits;			/* blocks written as a reference to an identical block */
+	uint64_t cow_copies;			/* shared blocks copied before being written */
+	uint64_t log_appends;			/* blocks written at the log head */
+	uint64_t log_moved;				/* live blocks the segment cleaner moved */
+	uint64_t log_cleaned;			/* segments the cleaner emptied */
+	uint64_t ra_blocks;				/* blocks read into the block cache ahead of a reader */
+	uint64_t itable_reads;			/* inode table blocks read into the inode cache */
+	uint64_t defrag_blocks;			/* blocks the defragmenter moved */
+	uint64_t io_tasks;				/* tasks run by the I/O pool */
+	uint64_t io_steals;				/* of those, taken from another worker's deque */
+	uint64_t tier_demoted;			/* cold blocks the migrator moved to the slow tier */
+	uint64_t tier_promoted;			/* hot blocks it moved back to the fast tier */
+};
+
+/*
+ * A mounted image: everything the engine knows about it. Made by rufs_mount(), passed to
+ * every function that touches the image, and freed by rufs_unmount(); images mounted side
+ * by side share nothing but the per-thread request memory.
+ */
+struct rufs_fs {
+	char diskfile_path[PATH_MAX];
+	struct dev* dev;
+	struct superblock* s_block_mem;
+
+	pthread_mutex_t alloc_lock;		/* guards bitmaps and s_block_mem */
+	pthread_mutex_t itable_lock;	/* guards read-modify-write of inode table blocks */
+	pthread_mutex_t rename_lock;	/* serializes namespace changes made by rename */
+	pthread_mutex_t dalloc_lock;	/* guards the delayed-allocation page cache */
+	pthread_cond_t dalloc_cond;		/* signalled when a writeback has evicted its pages */
+	pthread_cond_t reclaim_cond;	/* signalled when the orphan list grows */
+	pthread_t reclaim_thread;
+	int reclaim_running;
+	int reclaim_stop;
+	pthread_cond_t cleaner_cond;	/* signalled when the log runs short of clean segments */
+	pthread_t cleaner_thread;
+	int cleaner_running;
+	int cleaner_stop;
+	int cleaner_kick;
+	pthread_cond_t tier_cond;		/* signalled to stop the tier migrator */
+	pthread_t tier_thread;
+	int tier_running;
+	int tier_stop;
+	/* per-inode locks, striped by inode number; held across a read-modify-write of a file's
+	   block map so the segment cleaner can move its blocks. Recursive, an op may free the inode. */
+	pthread_mutex_t ilocks[ILOCKS];
+	/* held shared by rufs_read(), which maps blocks without the inode lock; a block move takes
+	   it exclusively before freeing the old blocks. Writers first, so a move is not starved. */
+	pthread_rwlock_t move_lock;
+	int orlov_next;					/* group the next top-level directory starts its search at */
+
+	/* Delayed-allocation page cache */
+	struct page* dalloc_hash[DALLOC_HASH];
+	struct page* dalloc_ino_list[MAX_INUM];
+	uint32_t dalloc_pages[MAX_INUM];	/* dirty pages per inode */
+	uint32_t dalloc_holes[MAX_INUM];	/* of those, pages over holes */
+	uint32_t dalloc_total;
+	uint32_t dalloc_reserved;		/* blocks promised to dirty pages over holes */
+	struct page* dalloc_free;		/* evicted pages kept for reuse, chained by hash_next */
+	uint32_t dalloc_nfree;
+	uint8_t dalloc_busy[MAX_INUM];	/* pages being written back outside dalloc_lock */
+	uint32_t dalloc_next;			/* inode the next writeback under pressure starts at */
+
+	/* Data block reference counts and the dedup fingerprint index, loaded at mount, guarded by alloc_lock */
+	uint16_t* refcnt;				/* indexed by data block, 0 = free */
+	uint32_t* fpidx;				/* crc32c of an indexed block, 0 = not indexed */
+	int* fp_head;					/* FP_HASH chains through fp_next, -1 terminated */
+	int* fp_next;
+	char rc_dirty[RC_BLKS];
+	char fp_dirty[FP_BLKS];
+
+	/* Tiered device: data blocks below tier_dnum are on the fast tier. A block's heat is bumped by
+	   block cache lookups of it up to TIER_HEAT_MAX and starts at TIER_HOT when allocated; the
+	   migrator halves it each pass. Updates are relaxed atomics, a lost bump only makes a block
+	   look a little colder. */
+	int tier_dnum;					/* data blocks on the fast tier, 0 if the device is not tiered */
+	uint8_t blk_heat[MAX_DNUM];
+
+	struct cblock bcache[BCACHE_SLOTS];
+	struct ctable bcache_ct;
+	uint64_t bcache_gen;			/* bumped by every bcache_forget(), see bcache_fill() */
+
+	/* Inode cache: inode table blocks read so far, kept in step with the disk by writei();
+	   changed under itable_lock and the block's shard of itable_ct, read by readi() without a lock */
+	char* itcache;					/* ITABLE_BLKS blocks */
+	uint32_t itcached;				/* bit b set once block b is in itcache */
+	struct ctable itable_ct;
+
+	struct dcentry dcache[DCACHE_SLOTS];
+	struct ctable dcache_ct;
+	uint64_t dcache_gen;			/* bumped by every dcache_forget(), see dcache_add() */
+
+	struct ra_job ra_queue[RA_QUEUE];
+	int ra_head, ra_count;
+	pthread_mutex_t ra_lock;		/* guards ra_queue and ra_free */
+	struct ra_state ra_states[RA_STATES];
+	struct ra_state* ra_free;		/* states no open file has, chained by free_next */
+	pthread_cond_t ra_cond;			/* signalled when a prefetch is queued */
+	pthread_t ra_thread;
+	int ra_running;
+	int ra_stop;
+
+	struct io_worker io_workers[IO_WORKERS];
+	int io_inflight[IO_CLASSES];
+	int io_queued;					/* tasks in all deques, only changed atomically */
+	uint32_t io_next;				/* deque the next task from outside the pool goes to */
+	pthread_mutex_t io_lock;		/* orders io_queued increments with sleeping workers */
+	pthread_cond_t io_cond;			/* signalled when a task is queued */
+	int io_running;
+	int io_stop;
+
+	struct fs_stats stats;
+};
+
+/* Per-thread request memory: a bump arena of chained chunks and a pool of block buffers */
+struct arena_chunk {
+	struct arena_chunk *prev;
+	size_t start;				/* arena offset of data[0] */
+	size_t size;
+	char data[];
+};
+static __thread struct arena_chunk *arena_top = NULL;  /* newest chunk, the first one is kept */
+static __thread size_t arena_used = 0;                 /* arena offset of the next free byte */
+static __thread struct arena_chunk *arena_spare = NULL; /* largest dropped overflow chunk, reused */
+static __thread char *blk_pool[BLK_POOL];
+static __thread int blk_pooled = 0;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/* 
+ * Current time in nanoseconds, the unit of on-disk inode timestamps
+ */
+int64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct timespec ns_to_timespec(int64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
+	return ts;
+}
+
+/* 
+ * request-scoped memory
+ */
+
+/* 
+ * Free a thread's arena chunks and pooled block buffers when it exits
+ */
+static void arena_exit(void *unused) {
+	while(arena_top != NULL){
+		struct arena_chunk* prev = arena_top->prev;
+		free(arena_top);
+		arena_top = prev;
+	}
+	free(arena_spare);
+	arena_spare = NULL;
+	while(blk_pooled > 0){
+		free(blk_pool[--blk_pooled]);
+	}
+}
+
+static void arena_key_init() {
+	pthread_key_create(&arena_key, arena_exit);
+}
+
+/* 
+ * Take size bytes from the calling thread's arena. They stay valid until the function
+ * holding the enclosing ARENA_SCOPE returns; there is no free.
+ */
+void* arena_alloc(size_t size) {
+	size = (size + 15) & ~(size_t)15;
+	if(arena_top == NULL || arena_used + size > arena_top->start + arena_top->size){
+		// Start a chunk; the first one is made once per thread and registered for cleanup
+		if(arena_top == NULL){
+			pthread_once(&arena_once, arena_key_init);
+			pthread_setspecific(arena_key, &arena_once);
+		}
+		size_t csize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		struct arena_chunk* c = arena_spare;
+		if(c != NULL && c->size >= csize){
+			arena_spare = NULL;
+			csize = c->size;
+		}
+		else{
+			c = (struct arena_chunk*)malloc(sizeof(struct arena_chunk) + csize);
+		}
+		c->prev = arena_top;
+		c->start = arena_used;
+		c->size = csize;
+		arena_top = c;
+	}
+	void* p = arena_top->data + (arena_used - arena_top->start);
+	arena_used += size;
+	return p;
+}
+
+void* arena_zalloc(size_t size) {
+	void* p = arena_alloc(size);
+	memset(p, 0, size);
+	return p;
+}
+
+/* 
+ * Hand back everything taken since *mark, dropping overflow chunks (ARENA_SCOPE cleanup).
+ * The largest one is kept for the thread's next large request.
+ */
+void arena_release(size_t *mark) {
+	while(arena_top != NULL && arena_top->prev != NULL && arena_top->start >= *mark){
+		struct arena_chunk* prev = arena_top->prev;
+		if(arena_spare == NULL || arena_top->size > arena_spare->size){
+			free(arena_spare);
+			arena_spare = arena_top;
+		}
+		else{
+			free(arena_top);
+		}
+		arena_top = prev;
+	}
+	arena_used = *mark;
+}
+
+/* 
+ * Get a BLOCK_SIZE aligned block buffer, from the thread's pool when it has one
+ */
+void* blk_get() {
+	if(blk_pooled > 0){
+		return blk_pool[--blk_pooled];
+	}
+	if(arena_top == NULL){
+		pthread_once(&arena_once, arena_key_init);
+		pthread_setspecific(arena_key, &arena_once);
+	}
+	return aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+}
+
+void* blk_zget() {
+	void* b = blk_get();
+	memset(b, 0, BLOCK_SIZE);
+	return b;
+}
+
+/* 
+ * Return a buffer from blk_get() to the pool, or free it once the pool is full
+ */
+void blk_put(void *b) {
+	if(b == NULL){
+		return;
+	}
+	if(blk_pooled < BLK_POOL){
+		blk_pool[blk_pooled++] = (char*)b;
+	}
+	else{
+		free(b);
+	}
+}
+
+
+/* 
+ * concurrent tables
+ */
+static inline struct ct_shard* ct_shard(struct ctable *t, uint32_t slot) {
+	return &t->shards[slot % CT_SHARDS];
+}
+
+/* 
+ * Start a lock-free read of slot, returns the sequence to hand to ct_read_retry()
+ */
+uint32_t ct_read_begin(struct ctable *t, uint32_t slot) {
+	struct ct_shard* sh = ct_shard(t, slot);
+	uint32_t seq;
+	while((seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE)) & 1){
+		/*A writer is in the shard*/
+		sched_yield();
+	}
+	return seq;
+}
+
+/* 
+ * Whether a writer got into slot's shard since ct_read_begin(), so what was read is torn
+ */
+int ct_read_retry(struct ctable *t, uint32_t slot, uint32_t seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&ct_shard(t, slot)->seq, __ATOMIC_RELAXED) != seq;
+}
+
+void ct_write_lock(struct ctable *t, uint32_t slot) {
+	struct ct_shard* sh = ct_shard(t, slot);
+	pthread_mutex_lock(&sh->lock);
+	__atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void ct_write_unlock(struct ctable *t, uint32_t slot) {
+	struct ct_shard* sh = ct_shard(t, slot);
+	__atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+static inline void ct_count(struct ctable *t, uint32_t slot, int hit) {
+	struct ct_shard* sh = ct_shard(t, slot);
+	__atomic_fetch_add(hit ? &sh->hits : &sh->misses, 1, __ATOMIC_RELAXED);
+}
+
+/* 
+ * Sum the hit and miss counts of all shards
+ */
+void ct_totals(struct ctable *t, uint64_t *hits, uint64_t *misses) {
+	*hits = *misses = 0;
+	for(int i = 0; i < CT_SHARDS; i++){
+		*hits += __atomic_load_n(&t->shards[i].hits, __ATOMIC_RELAXED);
+		*misses += __atomic_load_n(&t->shards[i].misses, __ATOMIC_RELAXED);
+	}
+}
+
+
+/* 
+ * block cache
+ */
+static inline uint32_t bcache_slot(int blkno, uint32_t slot) {
+	return ((uint32_t)blkno * (CLUSTER_BLKS + 1) + slot) % BCACHE_SLOTS;
+}
+
+/* 
+ * Copy from the cached block (blkno, slot) if present, returns 1 on a hit
+ */
+int bcache_read(struct rufs_fs *fs, int blkno, uint32_t slot, char *dst, uint32_t off, size_t len) {
+	uint32_t i = bcache_slot(blkno, slot);
+	uint32_t d = blkno - fs->s_block_mem->d_start_blk;
+	/*Only on a tiered device, and a saturated block is read but no longer written*/
+	if(fs->tier_dnum > 0 && d < fs->s_block_mem->max_dnum && __atomic_load_n(&fs->blk_heat[d], __ATOMIC_RELAXED) < TIER_HEAT_MAX){
+		__atomic_fetch_add(&fs->blk_heat[d], 1, __ATOMIC_RELAXED);
+	}
+	struct cblock* cb = &fs->bcache[i];
+	int hit;
+	uint32_t seq;
+	do{
+		seq = ct_read_begin(&fs->bcache_ct, i);
+		hit = cb->valid && cb->blkno == blkno && cb->slot == slot;
+		if(hit){
+			memcpy(dst, cb->data + off, len);
+		}
+	}while(ct_read_retry(&fs->bcache_ct, i, seq));
+	ct_count(&fs->bcache_ct, i, hit);
+	return hit;
+}
+
+/* 
+ * Whether (blkno, slot) is cached, without counting a hit or miss
+ */
+int bcache_has(struct rufs_fs *fs, int blkno, uint32_t slot) {
+	uint32_t i = bcache_slot(blkno, slot);
+	struct cblock* cb = &fs->bcache[i];
+	int hit;
+	uint32_t seq;
+	do{
+		seq = ct_read_begin(&fs->bcache_ct, i);
+		hit = cb->valid && cb->blkno == blkno && cb->slot == slot;
+	}while(ct_read_retry(&fs->bcache_ct, i, seq));
+	return hit;
+}
+
+/* 
+ * Cache block (blkno, slot). gen is bcache_gen from before the data was read; if anything was
+ * invalidated since, the data may be stale and is not cached.
+ */
+void bcache_fill(struct rufs_fs *fs, int blkno, uint32_t slot, const char *src, uint64_t gen) {
+	uint32_t i = bcache_slot(blkno, slot);
+	ct_write_lock(&fs->bcache_ct, i);
+	if(gen == __atomic_load_n(&fs->bcache_gen, __ATOMIC_ACQUIRE)){
+		struct cblock* cb = &fs->bcache[i];
+		cb->blkno = blkno;
+		cb->slot = slot;
+		cb->valid = 1;
+		memcpy(cb->data, src, BLOCK_SIZE);
+	}
+	ct_write_unlock(&fs->bcache_ct, i);
+}
+
+uint64_t bcache_snapshot(struct rufs_fs *fs) {
+	return __atomic_load_n(&fs->bcache_gen, __ATOMIC_ACQUIRE);
+}
+
+/* 
+ * Drop cached blocks derived from the n blocks from blkno, which were freed, allocated or
+ * overwritten in place. The generation moves first, so a fill racing with this either
+ * sees it and backs off or lands before the entry is dropped.
+ */
+void bcache_forget(struct rufs_fs *fs, int blkno, int n) {
+	__atomic_fetch_add(&fs->bcache_gen, 1, __ATOMIC_ACQ_REL);
+	for(int b = blkno; b < blkno + n; b++){
+		for(uint32_t s = 0; s <= BCACHE_RAW; s++){
+			uint32_t i = bcache_slot(b, s);
+			ct_write_lock(&fs->bcache_ct, i);
+			if(fs->bcache[i].valid && fs->bcache[i].blkno == b){
+				fs->bcache[i].valid = 0;
+			}
+			ct_write_unlock(&fs->bcache_ct, i);
+		}
+	}
+}
+
+/* 
+ * Placement group of inode ino
+ */
+static inline int ino_group(struct rufs_fs *fs, uint16_t ino) {
+	return ino / fs->s_block_mem->inodes_per_blk;
+}
+
+/* 
+ * First block of group g's slice of the data region, or of the fast tier if the device is tiered
+ */
+int group_goal(struct rufs_fs *fs, int g) {
+	int span = fs->tier_dnum > 0 ? fs->tier_dnum : fs->s_block_mem->max_dnum;
+	return fs->s_block_mem->d_start_blk + (int)((int64_t)span * g / GROUPS);
+}
+
+/* 
+ * Allocation goal for the first data block of inode: the start of its group's data
+ */
+int inode_goal(struct rufs_fs *fs, struct inode *inode) {
+	return group_goal(fs, ino_group(fs, inode->ino));
+}
+
+/* 
+ * Free data blocks in group g's slice (caller holds alloc_lock)
+ */
+static int group_free_blks(struct rufs_fs *fs, int g) {
+	int n = 0;
+	for(int i = group_goal(fs, g) - fs->s_block_mem->d_start_blk; i < group_goal(fs, g + 1) - fs->s_block_mem->d_start_blk; i++){
+		n += fs->refcnt[i] == 0;
+	}
+	return n;
+}
+
+/* 
+ * Get available inode number from bitmap, placed Orlov style: a new top-level directory
+ * goes to the group with the most free data blocks among those with at least the average
+ * number of free inodes, spreading unrelated trees out. Everything else stays in its
+ * parent's group, or the next one with a free inode.
+ */
+int get_avail_ino(struct rufs_fs *fs, uint16_t parent, int is_dir) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	char* block_buffer = (char*)blk_zget();
+	// Step 1: Read inode bitmap from disk into a pooled buffer and work on it there
+	bio_read(fs->dev, fs->s_block_mem->i_bitmap_blk, block_buffer);
+	bitmap_t i_bm = (bitmap_t)block_buffer;
+
+	// Step 2: Pick the group to start from
+	int per = fs->s_block_mem->inodes_per_blk;
+	int start = ino_group(fs, parent);
+	if(is_dir && parent == ROOT_INO){
+		int free_inos[GROUPS], total = 0;
+		for(int g = 0; g < GROUPS; g++){
+			free_inos[g] = 0;
+			for(int i = g * per; i < (g + 1) * per; i++){
+				free_inos[g] += get_bitmap(i_bm, i) == 0;
+			}
+			total += free_inos[g];
+		}
+		int best = -1, best_blks = -1;
+		for(int k = 0; k < GROUPS; k++){
+			/*Search from where the last one was placed so ties rotate through the groups*/
+			int g = (fs->orlov_next + k) % GROUPS;
+			if(free_inos[g] == 0 || free_inos[g] < total / GROUPS){
+				continue;
+			}
+			int blks = group_free_blks(fs, g);
+			if(blks > best_blks){
+				best = g;
+				best_blks = blks;
+			}
+		}
+		if(best != -1){
+			start = best;
+			fs->orlov_next = (best + 1) % GROUPS;
+		}
+	}
+
+	// Step 3: Traverse inode bitmap from the group to find an available slot
+	for(int n = 0; n < fs->s_block_mem->max_inum; n++){
+		int i = (start * per + n) % fs->s_block_mem->max_inum;
+		if(get_bitmap(i_bm, i) == 0){
+			// Step 4: Update inode bitmap and write to disk 
+			set_bitmap(i_bm, i);
+			bio_write(fs->dev, fs->s_block_mem->i_bitmap_blk, block_buffer);
+			blk_put(block_buffer);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			return i;
+		}
+	}
+
+	blk_put(block_buffer);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return -1;
+}
+
+/* 
+ * Set the reference count of data block index i (caller holds alloc_lock)
+ */
+static inline void set_ref(struct rufs_fs *fs, int i, uint16_t count) {
+	fs->refcnt[i] = count;
+	fs->rc_dirty[i * sizeof(uint16_t) / BLOCK_SIZE] = 1;
+}
+
+/* 
+ * Write back the reference count blocks changed since the last call (caller holds alloc_lock)
+ */
+void refcnt_flush(struct rufs_fs *fs) {
+	for(uint32_t b = 0; b < fs->s_block_mem->d_refcnt_blks; b++){
+		if(fs->rc_dirty[b]){
+			bio_write(fs->dev, fs->s_block_mem->d_refcnt_blk + b, (char*)fs->refcnt + b * BLOCK_SIZE);
+			fs->rc_dirty[b] = 0;
+		}
+	}
+}
+
+/* 
+ * Get available data block number from the reference counts
+ */
+int get_avail_blkno(struct rufs_fs *fs) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	// Step 1: Traverse the reference counts to find a free block
+	for(int i = 0; i < fs->s_block_mem->max_dnum; i++){ 
+		if(fs->refcnt[i] == 0){
+			// Step 2: Take the first reference and write it to disk
+			set_ref(fs, i, 1);
+			fs->blk_heat[i] = TIER_HOT;
+			refcnt_flush(fs);
+			bcache_forget(fs, fs->s_block_mem->d_start_blk + i, 1);
+			fs->s_block_mem->total_blocks_alloc++;
+			pthread_mutex_unlock(&fs->alloc_lock);
+			return fs->s_block_mem->d_start_blk + i;
+		}
+	}
+
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return -1;
+}
+
+/* 
+ * Get a run of up to want contiguous free data blocks, preferring one that starts at goal.
+ * Returns the first block number and sets *got to the run length, or -1 if the disk is full.
+ */
+int get_avail_blkrange(struct rufs_fs *fs, int goal, int want, int *got) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	// Step 1: Scan from the goal, wrapping once, for the first run long enough or else the longest
+	// one. A goal on the fast tier of a tiered device is looked for there before anywhere else.
+	int max = fs->s_block_mem->max_dnum;
+	int start = (goal > fs->s_block_mem->d_start_blk && goal - fs->s_block_mem->d_start_blk < max) ? goal - fs->s_block_mem->d_start_blk : 0;
+	int span = start < fs->tier_dnum ? fs->tier_dnum : max;
+	int best = -1, best_len = 0;
+	while(1){
+		int run = -1, run_len = 0;
+		for(int n = 0; n < span && best_len < want; n++){
+			int i = (start + n) % span;
+			if(i == 0){
+				run_len = 0;
+			}
+			if(fs->refcnt[i] == 0){
+				if(run_len == 0){
+					run = i;
+				}
+				if(++run_len > best_len){
+					best = run;
+					best_len = run_len;
+				}
+			}
+			else{
+				run_len = 0;
+			}
+		}
+		if(best != -1 || span == max){
+			break;
+		}
+		span = max;
+	}
+	if(best == -1){
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return -1;
+	}
+	if(best_len > want){
+		best_len = want;
+	}
+
+	// Step 2: Take the run and write the reference counts to disk
+	for(int i = best; i < best + best_len; i++){
+		set_ref(fs, i, 1);
+		fs->blk_heat[i] = TIER_HOT;
+	}
+	refcnt_flush(fs);
+	bcache_forget(fs, fs->s_block_mem->d_start_blk + best, best_len);
+	fs->s_block_mem->total_blocks_alloc += best_len;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	*got = best_len;
+	return fs->s_block_mem->d_start_blk + best;
+}
+
+/* 
+ * Number of data blocks still free
+ */
+int free_blk_count(struct rufs_fs *fs) {
+	return fs->s_block_mem->max_dnum - 1 - (fs->s_block_mem->total_blocks_alloc - fs->s_block_mem->d_start_blk);
+}
+
+/* 
+ * Take one more reference to a data block that is already in use. Fails once the
+ * count saturates.
+ */
+int blk_ref(struct rufs_fs *fs, int blkno) {
+	int i = blkno - fs->s_block_mem->d_start_blk;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int ok = fs->refcnt[i] > 0 && fs->refcnt[i] < UINT16_MAX;
+	if(ok){
+		set_ref(fs, i, fs->refcnt[i] + 1);
+		refcnt_flush(fs);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return ok ? 0 : -1;
+}
+
+/* 
+ * Take one more reference to each of a batch of in-use blocks with a single write of the
+ * counts. Blocks whose count is saturated are set to 0 in blks. Returns how many were taken.
+ */
+int ref_blocks(struct rufs_fs *fs, int *blks, int n) {
+	int taken = 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(int k = 0; k < n; k++){
+		int i = blks[k] - fs->s_block_mem->d_start_blk;
+		if(fs->refcnt[i] == 0 || fs->refcnt[i] == UINT16_MAX){
+			blks[k] = 0;
+			continue;
+		}
+		set_ref(fs, i, fs->refcnt[i] + 1);
+		taken++;
+	}
+	refcnt_flush(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return taken;
+}
+
+/* 
+ * Whether more than one block pointer refers to blkno
+ */
+int blk_shared(struct rufs_fs *fs, int blkno) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	int shared = fs->refcnt[blkno - fs->s_block_mem->d_start_blk] > 1;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return shared;
+}
+
+/* 
+ * fingerprint index
+ */
+static void fp_remove(struct rufs_fs *fs, int i) {
+	if(fs->fpidx[i] == 0){
+		return;
+	}
+	int* pp = &fs->fp_head[fs->fpidx[i] % FP_HASH];
+	while(*pp != i){
+		pp = &fs->fp_next[*pp];
+	}
+	*pp = fs->fp_next[i];
+	fs->fpidx[i] = 0;
+	fs->fp_dirty[i * sizeof(uint32_t) / BLOCK_SIZE] = 1;
+}
+
+static void fp_insert(struct rufs_fs *fs, int i, uint32_t fp) {
+	if(fs->fpidx[i] == fp){
+		return;
+	}
+	fp_remove(fs, i);
+	fs->fpidx[i] = fp;
+	fs->fp_next[i] = fs->fp_head[fp % FP_HASH];
+	fs->fp_head[fp % FP_HASH] = i;
+	fs->fp_dirty[i * sizeof(uint32_t) / BLOCK_SIZE] = 1;
+}
+
+/* 
+ * Write back changed fingerprint blocks. The index is only a hint (every match is
+ * compared byte for byte), so it is written lazily.
+ */
+void fp_sync(struct rufs_fs *fs) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(uint32_t b = 0; b < fs->s_block_mem->fp_blks; b++){
+		if(fs->fp_dirty[b]){
+			bio_write(fs->dev, fs->s_block_mem->fp_blk + b, (char*)fs->fpidx + b * BLOCK_SIZE);
+			fs->fp_dirty[b] = 0;
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/* 
+ * Record data as the contents of blkno in the fingerprint index
+ */
+void dedup_index(struct rufs_fs *fs, int blkno, const char *data) {
+	uint32_t fp = crc32c(0, data, BLOCK_SIZE);
+	pthread_mutex_lock(&fs->alloc_lock);
+	if(fp != 0){
+		fp_insert(fs, blkno - fs->s_block_mem->d_start_blk, fp);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/* 
+ * Drop blkno from the fingerprint index before it is overwritten in place
+ */
+void dedup_forget(struct rufs_fs *fs, int blkno) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	fp_remove(fs, blkno - fs->s_block_mem->d_start_blk);
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/* 
+ * Find an indexed block other than exclude holding exactly data and take a reference
+ * to it. Returns its block number, or 0 if there is none.
+ */
+int dedup_lookup(struct rufs_fs *fs, const char *data, int exclude) {
+	uint32_t fp = crc32c(0, data, BLOCK_SIZE);
+	if(fp == 0){
+		return 0;
+	}
+	char* block_buffer = (char*)blk_get();
+	int found = 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(int i = fs->fp_head[fp % FP_HASH]; i != -1 && found == 0; i = fs->fp_next[i]){
+		int blkno = fs->s_block_mem->d_start_blk + i;
+		if(fs->fpidx[i] != fp || blkno == exclude || fs->refcnt[i] == 0 || fs->refcnt[i] == UINT16_MAX){
+			continue;
+		}
+		// Same hash is only a candidate, the contents decide
+		if(bio_read(fs->dev, blkno, block_buffer) >= 0 && memcmp(block_buffer, data, BLOCK_SIZE) == 0){
+			set_ref(fs, i, fs->refcnt[i] + 1);
+			refcnt_flush(fs);
+			found = blkno;
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	blk_put(block_buffer);
+	if(found){
+		__atomic_fetch_add(&fs->stats.dedup_hits, 1, __ATOMIC_RELAXED);
+	}
+	return found;
+}
+
+/* 
+ * Load the reference counts and fingerprint index and recount allocated blocks. The
+ * in-memory counter is not written back on every allocation, so it is rebuilt at mount.
+ */
+void recount_blocks(struct rufs_fs *fs) {
+	free(fs->refcnt);
+	free(fs->fpidx);
+	free(fs->fp_head);
+	free(fs->fp_next);
+	fs->refcnt = (uint16_t*)calloc(fs->s_block_mem->d_refcnt_blks, BLOCK_SIZE);
+	fs->fpidx = (uint32_t*)calloc(fs->s_block_mem->fp_blks, BLOCK_SIZE);
+	fs->fp_head = (int*)malloc(FP_HASH * sizeof(int));
+	fs->fp_next = (int*)malloc(fs->s_block_mem->max_dnum * sizeof(int));
+	for(uint32_t b = 0; b < fs->s_block_mem->d_refcnt_blks; b++){
+		bio_read(fs->dev, fs->s_block_mem->d_refcnt_blk + b, (char*)fs->refcnt + b * BLOCK_SIZE);
+	}
+	for(uint32_t b = 0; b < fs->s_block_mem->fp_blks; b++){
+		bio_read(fs->dev, fs->s_block_mem->fp_blk + b, (char*)fs->fpidx + b * BLOCK_SIZE);
+	}
+	memset(fs->fp_head, -1, FP_HASH * sizeof(int));
+
+	fs->s_block_mem->total_blocks_alloc = fs->s_block_mem->d_start_blk;
+	for(int i = 0; i < fs->s_block_mem->max_dnum; i++){
+		if(fs->refcnt[i] > 0 && i > 0){
+			fs->s_block_mem->total_blocks_alloc++;
+		}
+		if(fs->fpidx[i] != 0){
+			fs->fp_next[i] = fs->fp_head[fs->fpidx[i] % FP_HASH];
+			fs->fp_head[fs->fpidx[i] % FP_HASH] = i;
+		}
+	}
+}
+
+/* 
+ * Drop one reference to blkno, freeing it at zero (caller holds alloc_lock and flushes the
+ * counts). Returns 1 if the block was freed.
+ */
+static int unref_block(struct rufs_fs *fs, int blkno) {
+	int d = blkno - fs->s_block_mem->d_start_blk;
+	if(fs->refcnt[d] == 0){
+		return 0;
+	}
+	set_ref(fs, d, fs->refcnt[d] - 1);
+	if(fs->refcnt[d] == 0){
+		fp_remove(fs, d);
+		bcache_forget(fs, blkno, 1);
+		fs->s_block_mem->total_blocks_alloc--;
+		return 1;
+	}
+	return 0;
+}
+
+/* 
+ * Drop one reference to each of a batch of data blocks; blocks nobody refers to any
+ * more become free. The changed counts are written back together.
+ */
+void release_blocks(struct rufs_fs *fs, int *blks, int n) {
+	if(n == 0){
+		return;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(int i = 0; i < n; i++){
+		unref_block(fs, blks[i]);
+	}
+	refcnt_flush(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/* 
+ * Release blocks a move has just unmapped, once every read that may have mapped them
+ * before the switch has finished
+ */
+void release_moved(struct rufs_fs *fs, int *blks, int n) {
+	if(n == 0){
+		return;
+	}
+	pthread_rwlock_wrlock(&fs->move_lock);
+	pthread_rwlock_unlock(&fs->move_lock);
+	release_blocks(fs, blks, n);
+}
+
+/* 
+ * Drop one reference to blkno, returns 1 if it was the last one and the block is now free
+ */
+int release_last(struct rufs_fs *fs, int blkno) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	int last = unref_block(fs, blkno);
+	refcnt_flush(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return last;
+}
+
+/* 
+ * Write in-memory superblock back to disk (caller holds alloc_lock)
+ */
+void write_superblock(struct rufs_fs *fs) {
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	memcpy(block_buffer, fs->s_block_mem, sizeof(struct superblock));
+	bio_write(fs->dev, SUPER_IDX, block_buffer);
+	blk_put(block_buffer);
+}
+
+/* 
+ * log-structured allocation
+ *
+ * Only the file data of INODE_LOG files is appended at the log head. Metadata (the inode
+ * table, indirect blocks, reference counts and directories) is still updated in place and
+ * there is no inode map: each inode's block map is the index, and log_head is the only log
+ * state checkpointed in the superblock. Other allocators may put blocks in a log segment,
+ * so the cleaner only picks segments whose live blocks are all log-file data it can move.
+ */
+
+/* 
+ * Live blocks in log segment seg, setting *len to its length (caller holds alloc_lock)
+ */
+static int seg_live(struct rufs_fs *fs, int seg, int *len) {
+	int start = seg * SEG_BLKS;
+	int end = start + SEG_BLKS < fs->s_block_mem->max_dnum ? start + SEG_BLKS : fs->s_block_mem->max_dnum;
+	int live = 0;
+	for(int i = start; i < end; i++){
+		live += fs->refcnt[i] != 0;
+	}
+	if(len != NULL){
+		*len = end - start;
+	}
+	return live;
+}
+
+/* 
+ * Get a run of up to want free blocks at the log head. The head fills a clean segment front
+ * to back, skipping blocks other allocators took, then moves to the next clean segment. With
+ * none left the normal allocator is used. Returns the first block number and sets *got to
+ * the run length, or -1 if the disk is full.
+ */
+int log_alloc(struct rufs_fs *fs, int want, int *got) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	int max = fs->s_block_mem->max_dnum;
+	int nseg = (max + SEG_BLKS - 1) / SEG_BLKS;
+	int h = fs->s_block_mem->log_head;
+	// Step 1: Skip used blocks up to the end of the current segment
+	while(h < max && h % SEG_BLKS != 0 && fs->refcnt[h] != 0){
+		h++;
+	}
+
+	// Step 2: At a segment boundary move on to the next clean segment, waking the cleaner
+	// when few are left
+	int moved = 0;
+	if(h >= max || h % SEG_BLKS == 0){
+		int cur = h == 0 ? 0 : (h - 1) / SEG_BLKS;
+		int next = -1, clean = 0;
+		for(int k = 1; k <= nseg; k++){
+			int seg = (cur + k) % nseg;
+			if(seg_live(fs, seg, NULL) == 0){
+				clean++;
+				if(next == -1){
+					next = seg;
+				}
+			}
+		}
+		if(clean <= LOG_MIN_CLEAN){
+			fs->cleaner_kick = 1;
+			pthread_cond_signal(&fs->cleaner_cond);
+		}
+		if(next == -1){
+			pthread_mutex_unlock(&fs->alloc_lock);
+			return get_avail_blkrange(fs, 0, want, got);
+		}
+		h = next * SEG_BLKS;
+		moved = 1;
+	}
+
+	// Step 3: Take the free run at the head and write the reference counts to disk
+	int len = 0;
+	while(len < want && h + len < max && (len == 0 || (h + len) % SEG_BLKS != 0) && fs->refcnt[h + len] == 0){
+		set_ref(fs, h + len, 1);
+		fs->blk_heat[h + len] = TIER_HOT;
+		len++;
+	}
+	refcnt_flush(fs);
+	bcache_forget(fs, fs->s_block_mem->d_start_blk + h, len);
+	fs->s_block_mem->total_blocks_alloc += len;
+	fs->s_block_mem->log_head = h + len;
+	if(moved){
+		write_superblock(fs);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	__atomic_fetch_add(&fs->stats.log_appends, len, __ATOMIC_RELAXED);
+	*got = len;
+	return fs->s_block_mem->d_start_blk + h;
+}
+
+/* 
+ * inode and dentry caches
+ */
+
+/* 
+ * Inode table block b in the inode cache, read from disk on first use. Changes made through
+ * the returned pointer are written back with itable_write(). Returns NULL on a read error
+ * (caller holds itable_lock).
+ */
+char* itable_get(struct rufs_fs *fs, uint32_t b) {
+	if(!(fs->itcached & (1u << b))){
+		if(bio_read(fs->dev, fs->s_block_mem->i_start_blk + b, fs->itcache + b * BLOCK_SIZE) < 0){
+			return NULL;
+		}
+		__atomic_fetch_or(&fs->itcached, 1u << b, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&fs->stats.itable_reads, 1, __ATOMIC_RELAXED);
+	}
+	return fs->itcache + b * BLOCK_SIZE;
+}
+
+/* 
+ * Write cached inode table block b back to disk (caller holds itable_lock)
+ */
+void itable_write(struct rufs_fs *fs, uint32_t b) {
+	bio_write(fs->dev, fs->s_block_mem->i_start_blk + b, fs->itcache + b * BLOCK_SIZE);
+}
+
+/* 
+ * Load the inode table blocks set in mask into the inode cache, stat-ahead for readdir
+ */
+void itable_fetch(struct rufs_fs *fs, uint32_t mask) {
+	for(uint32_t b = 0; b < ITABLE_BLKS; b++){
+		if((mask & (1u << b)) && !(fs->itcached & (1u << b))){
+			pthread_mutex_lock(&fs->itable_lock);
+			if(!(fs->itcached & (1u << b)) && bio_read(fs->dev, fs->s_block_mem->i_start_blk + b, fs->itcache + b * BLOCK_SIZE) >= 0){
+				__atomic_fetch_or(&fs->itcached, 1u << b, __ATOMIC_RELEASE);
+				__atomic_fetch_add(&fs->stats.itable_reads, 1, __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock(&fs->itable_lock);
+		}
+	}
+}
+
+static inline uint32_t dcache_slot(uint16_t parent, const char *name) {
+	uint32_t h = 2166136261u ^ parent;
+	for(; *name != '\0'; name++){
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	}
+	return h % DCACHE_SLOTS;
+}
+
+/* 
+ * Look (parent, name) up in the dentry cache, returns 1 and sets *ino on a hit
+ */
+int dcache_lookup(struct rufs_fs *fs, uint16_t parent, const char *name, uint16_t *ino) {
+	uint32_t i = dcache_slot(parent, name);
+	struct dcentry* de = &fs->dcache[i];
+	int hit;
+	uint32_t seq;
+	do{
+		/*The name may be half rewritten, so the compare stays inside it*/
+		seq = ct_read_begin(&fs->dcache_ct, i);
+		hit = de->valid && de->parent == parent && strncmp(de->name, name, sizeof(de->name)) == 0;
+		if(hit){
+			*ino = de->ino;
+		}
+	}while(ct_read_retry(&fs->dcache_ct, i, seq));
+	ct_count(&fs->dcache_ct, i, hit);
+	return hit;
+}
+
+uint64_t dcache_snapshot(struct rufs_fs *fs) {
+	return __atomic_load_n(&fs->dcache_gen, __ATOMIC_ACQUIRE);
+}
+
+/* 
+ * Cache the entry (parent, name) -> ino. gen is dcache_gen from before the directory was
+ * read; if an entry was removed or changed since, it may be stale and is not cached.
+ */
+void dcache_add(struct rufs_fs *fs, uint16_t parent, const char *name, uint16_t ino, uint64_t gen) {
+	if(strlen(name) >= sizeof(fs->dcache[0].name)){
+		return;
+	}
+	uint32_t i = dcache_slot(parent, name);
+	ct_write_lock(&fs->dcache_ct, i);
+	if(gen == __atomic_load_n(&fs->dcache_gen, __ATOMIC_ACQUIRE)){
+		struct dcentry* de = &fs->dcache[i];
+		de->parent = parent;
+		de->ino = ino;
+		de->valid = 1;
+		strcpy(de->name, name);
+	}
+	ct_write_unlock(&fs->dcache_ct, i);
+}
+
+/* 
+ * Drop the cached entry (parent, name), or with name NULL every entry of directory parent,
+ * after it changed on disk
+ */
+void dcache_forget(struct rufs_fs *fs, uint16_t parent, const char *name) {
+	__atomic_fetch_add(&fs->dcache_gen, 1, __ATOMIC_ACQ_REL);
+	if(name != NULL){
+		uint32_t i = dcache_slot(parent, name);
+		ct_write_lock(&fs->dcache_ct, i);
+		if(fs->dcache[i].valid && fs->dcache[i].parent == parent && strcmp(fs->dcache[i].name, name) == 0){
+			fs->dcache[i].valid = 0;
+		}
+		ct_write_unlock(&fs->dcache_ct, i);
+	}
+	else{
+		// Every slot of one shard under a single lock
+		for(uint32_t sh = 0; sh < CT_SHARDS; sh++){
+			ct_write_lock(&fs->dcache_ct, sh);
+			for(uint32_t i = sh; i < DCACHE_SLOTS; i += CT_SHARDS){
+				if(fs->dcache[i].parent == parent){
+					fs->dcache[i].valid = 0;
+				}
+			}
+			ct_write_unlock(&fs->dcache_ct, sh);
+		}
+	}
+}
+
+/* 
+ * snapshots
+ */
+
+/* 
+ * Save inode table block b (contents cur) into every snapshot still reading it from the live
+ * table, before it is overwritten (caller holds itable_lock)
+ */
+void itable_preserve(struct rufs_fs *fs, uint32_t b, const char *cur) {
+	int saved = 0;
+	for(uint32_t k = 0; k < fs->s_block_mem->snap_cnt; k++){
+		struct snapshot* snap = &fs->s_block_mem->snaps[k];
+		if(!(snap->copied & (1u << b))){
+			bio_write(fs->dev, snap->itab[b], cur);
+			snap->copied |= 1u << b;
+			saved = 1;
+		}
+	}
+	if(saved){
+		pthread_mutex_lock(&fs->alloc_lock);
+		write_superblock(fs);
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+}
+
+/* 
+ * Charge the snapshots taken since inode ino was last read for their references to its
+ * blocks: each holds a copy of the inode and so shares what it points at directly. Deeper
+ * blocks are shared through those and charged when an indirect block is copied.
+ */
+void snap_charge(struct rufs_fs *fs, uint16_t ino, struct inode *inode) {
+	uint32_t b = (ino * sizeof(struct inode)) / BLOCK_SIZE;
+	uint16_t idx = ino % fs->s_block_mem->inodes_per_blk;
+	pthread_mutex_lock(&fs->itable_lock);
+	char* block_buffer = itable_get(fs, b);
+	if(block_buffer == NULL){
+		pthread_mutex_unlock(&fs->itable_lock);
+		return;
+	}
+	memcpy((void*)inode, (void*)block_buffer + (idx*sizeof(struct inode)), sizeof(struct inode));
+	if(inode->valid && inode->snap_gen < fs->s_block_mem->snap_gen){
+		// Step 1: One reference per snapshot newer than the last charge
+		int owed = 0;
+		for(uint32_t k = 0; k < fs->s_block_mem->snap_cnt; k++){
+			owed += fs->s_block_mem->snaps[k].gen > inode->snap_gen;
+		}
+		int top[NUM_DPTRS + NUM_IPTRS + 1], blks[NUM_DPTRS + NUM_IPTRS + 1];
+		int n = 0;
+		if(!(inode->flags & INODE_INLINE)){
+			for(int i = 0; i < NUM_DPTRS; i++){
+				if(PTR_BLKNO(inode->direct_ptr[i]) != 0){
+					top[n++] = PTR_BLKNO(inode->direct_ptr[i]);
+				}
+			}
+			for(int i = 0; i < NUM_IPTRS; i++){
+				if(inode->indirect_ptr[i] != 0){
+					top[n++] = inode->indirect_ptr[i];
+				}
+			}
+			if(inode->dindirect_ptr != 0){
+				top[n++] = inode->dindirect_ptr;
+			}
+		}
+		for(int k = 0; k < owed && n > 0; k++){
+			memcpy(blks, top, n * sizeof(int));
+			ref_blocks(fs, blks, n);
+		}
+
+		// Step 2: Record the charge; the snapshots keep the inode as it was
+		inode->snap_gen = fs->s_block_mem->snap_gen;
+		itable_preserve(fs, b, block_buffer);
+		ct_write_lock(&fs->itable_ct, b);
+		memcpy((void*)block_buffer + (idx*sizeof(struct inode)), (void*)inode, sizeof(struct inode));
+		ct_write_unlock(&fs->itable_ct, b);
+		itable_write(fs, b);
+	}
+	pthread_mutex_unlock(&fs->itable_lock);
+}
+
+/* 
+ * inode operations
+ */
+
+/* 
+ * Lock inode ino against block moves by the segment cleaner and defragmenter. Recursive, so a holder may
+ * lock it again, or another inode in the same stripe.
+ */
+void ilock(struct rufs_fs *fs, uint16_t ino) {
+	pthread_mutex_lock(&fs->ilocks[ino % ILOCKS]);
+}
+
+void iunlock(struct rufs_fs *fs, uint16_t ino) {
+	pthread_mutex_unlock(&fs->ilocks[ino % ILOCKS]);
+}
+
+/* 
+ * Lock ino as well while holding held's lock, keeping the stripes in ascending order.
+ * Returns 1 if held's lock had to be dropped and retaken, in which case the caller rereads
+ * its inode.
+ */
+int ilock_also(struct rufs_fs *fs, uint16_t held, uint16_t ino) {
+	if(ino % ILOCKS >= held % ILOCKS){
+		ilock(fs, ino);
+		return 0;
+	}
+	iunlock(fs, held);
+	ilock(fs, ino);
+	ilock(fs, held);
+	return 1;
+}
+
+/* 
+ * Lock the n inodes in inos, which may repeat, stripe by stripe in ascending order;
+ * iunlock_all() drops them again
+ */
+void ilock_all(struct rufs_fs *fs, const uint16_t *inos, int n) {
+	for(int s = 0; s < ILOCKS; s++){
+		for(int k = 0; k < n; k++){
+			if(inos[k] % ILOCKS == s){
+				ilock(fs, inos[k]);
+			}
+		}
+	}
+}
+
+void iunlock_all(struct rufs_fs *fs, const uint16_t *inos, int n) {
+	for(int k = 0; k < n; k++){
+		iunlock(fs, inos[k]);
+	}
+}
+
+int readi(struct rufs_fs *fs, uint16_t ino, struct inode *inode) {
+  // Step 1: Get the inode's block of the inode table
+  	uint32_t b = (ino * sizeof(struct inode)) / BLOCK_SIZE;
+  // Step 2: Get offset of the inode in the inode on-disk block
+  	uint16_t idx = ino % fs->s_block_mem->inodes_per_blk;
+
+  // Step 3: Copy the inode out of the inode cache, without a lock once its block is cached
+	if(__atomic_load_n(&fs->itcached, __ATOMIC_ACQUIRE) & (1u << b)){
+		uint32_t seq;
+		do{
+			seq = ct_read_begin(&fs->itable_ct, b);
+			memcpy((void*)inode, (void*)fs->itcache + b * BLOCK_SIZE + (idx*sizeof(struct inode)), sizeof(struct inode));
+		}while(ct_read_retry(&fs->itable_ct, b, seq));
+	}
+	else{
+		pthread_mutex_lock(&fs->itable_lock);
+		char* block_buffer = itable_get(fs, b);
+		if(block_buffer == NULL){
+			memset(inode, 0, sizeof(struct inode));
+		}
+		else{
+			memcpy((void*)inode, (void*)block_buffer + (idx*sizeof(struct inode)), sizeof(struct inode));
+		}
+		pthread_mutex_unlock(&fs->itable_lock);
+	}
+
+  // Step 4: Snapshots taken since the inode was last read now share its blocks
+	if(fs->s_block_mem->snap_cnt > 0 && inode->valid && inode->snap_gen < fs->s_block_mem->snap_gen){
+		snap_charge(fs, ino, inode);
+	}
+	return 0;
+}
+
+int writei(struct rufs_fs *fs, uint16_t ino, struct inode *inode) {
+	// Step 1: Get the block of the inode table where this inode resides
+	uint32_t b = (ino * sizeof(struct inode)) / BLOCK_SIZE;
+	
+	// Step 2: Get the offset in the block where this inode resides on disk
+	uint16_t idx = ino % fs->s_block_mem->inodes_per_blk;
+
+	// Step 3: Write inode to disk through the inode cache; a block that can't be read is
+	// not rewritten around the inode
+	inode->version = INODE_VERSION;
+	pthread_mutex_lock(&fs->itable_lock);
+	char* block_buffer = itable_get(fs, b);
+	if(block_buffer == NULL){
+		pthread_mutex_unlock(&fs->itable_lock);
+		return -1;
+	}
+	if(fs->s_block_mem->snap_cnt > 0){
+		itable_preserve(fs, b, block_buffer);
+	}
+	ct_write_lock(&fs->itable_ct, b);
+	memcpy((void*)block_buffer + (idx*sizeof(struct inode)), (void*)inode, sizeof(struct inode));
+	ct_write_unlock(&fs->itable_ct, b);
+	itable_write(fs, b);
+	pthread_mutex_unlock(&fs->itable_lock);
+	return 0;
+}
+
+/* 
+ * block mapping
+ */
+
+/* 
+ * Allocate a zeroed indirect block for inode, returns 0 if the disk is full
+ */
+int alloc_indirect(struct rufs_fs *fs, struct inode *inode) {
+	int got = 0;
+	int blkno = get_avail_blkrange(fs, inode_goal(fs, inode), 1, &got);
+	if(blkno == -1){
+		return 0;
+	}
+	char* block_buffer = (char*)blk_zget();
+	bio_write(fs->dev, blkno, block_buffer);
+	blk_put(block_buffer);
+	inode->blocks++;
+	return blkno;
+}
+
+/* 
+ * Replace an indirect block shared with a snapshot or clone by a private copy. The copy
+ * takes its own reference to everything the block points at. Returns the copy, 0 if the
+ * disk is full.
+ */
+int cow_indirect(struct rufs_fs *fs, int blkno) {
+	int fresh = get_avail_blkno(fs);
+	if(fresh == -1){
+		return 0;
+	}
+	int* ptrs = (int*)blk_get();
+	bio_read(fs->dev, blkno, ptrs);
+	bio_write(fs->dev, fresh, ptrs);
+	int n = 0;
+	for(int i = 0; i < PTRS_PER_BLK; i++){
+		if(PTR_BLKNO(ptrs[i]) != 0){
+			ptrs[n++] = PTR_BLKNO(ptrs[i]);
+		}
+	}
+	ref_blocks(fs, ptrs, n);
+	release_blocks(fs, &blkno, 1);
+	blk_put(ptrs);
+	__atomic_fetch_add(&fs->stats.cow_copies, 1, __ATOMIC_RELAXED);
+	return fresh;
+}
+
+/* 
+ * Locate the pointer for logical block lblk: *iblk is the indirect block holding it
+ * (0 if it sits in the inode) and *idx its slot. Returns 1 when an indirect block on
+ * the way is missing, with *idx set to the number of logical blocks from lblk that the
+ * missing subtree covers; with create set it is allocated instead. Unless create is
+ * BMAP_LOOKUP, shared indirect blocks on the way are copied so the slot may be written.
+ * Returns -1 past the end of the block map or when the disk is full.
+ */
+int bmap_slot(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, int create, int *iblk, int *idx) {
+	if(lblk < NUM_DPTRS){
+		*iblk = 0;
+		*idx = lblk;
+		return 0;
+	}
+
+	// Single indirect
+	lblk -= NUM_DPTRS;
+	if(lblk < NUM_IPTRS * PTRS_PER_BLK){
+		int* parent = &inode->indirect_ptr[lblk / PTRS_PER_BLK];
+		if(*parent == 0){
+			if(create != BMAP_CREATE){
+				*idx = PTRS_PER_BLK - lblk % PTRS_PER_BLK;
+				return 1;
+			}
+			if((*parent = alloc_indirect(fs, inode)) == 0){
+				return -1;
+			}
+		}
+		else if(create != BMAP_LOOKUP && blk_shared(fs, *parent)){
+			int fresh = cow_indirect(fs, *parent);
+			if(fresh == 0){
+				return -1;
+			}
+			*parent = fresh;
+		}
+		*iblk = *parent;
+		*idx = lblk % PTRS_PER_BLK;
+		return 0;
+	}
+
+	// Double indirect
+	lblk -= NUM_IPTRS * PTRS_PER_BLK;
+	if(lblk >= PTRS_PER_BLK * PTRS_PER_BLK){
+		return -1;
+	}
+	if(inode->dindirect_ptr == 0){
+		if(create != BMAP_CREATE){
+			*idx = PTRS_PER_BLK * PTRS_PER_BLK - lblk;
+			return 1;
+		}
+		if((inode->dindirect_ptr = alloc_indirect(fs, inode)) == 0){
+			return -1;
+		}
+	}
+	else if(create != BMAP_LOOKUP && blk_shared(fs, inode->dindirect_ptr)){
+		int fresh = cow_indirect(fs, inode->dindirect_ptr);
+		if(fresh == 0){
+			return -1;
+		}
+		inode->dindirect_ptr = fresh;
+	}
+	int* l1 = (int*)blk_get();
+	bio_read(fs->dev, inode->dindirect_ptr, l1);
+	int l2 = l1[lblk / PTRS_PER_BLK];
+	if(l2 == 0){
+		if(create != BMAP_CREATE){
+			blk_put(l1);
+			*idx = PTRS_PER_BLK - lblk % PTRS_PER_BLK;
+			return 1;
+		}
+		if((l2 = alloc_indirect(fs, inode)) == 0){
+			blk_put(l1);
+			return -1;
+		}
+		l1[lblk / PTRS_PER_BLK] = l2;
+		bio_write(fs->dev, inode->dindirect_ptr, l1);
+	}
+	else if(create != BMAP_LOOKUP && blk_shared(fs, l2)){
+		if((l2 = cow_indirect(fs, l2)) == 0){
+			blk_put(l1);
+			return -1;
+		}
+		l1[lblk / PTRS_PER_BLK] = l2;
+		bio_write(fs->dev, inode->dindirect_ptr, l1);
+	}
+	blk_put(l1);
+	*iblk = l2;
+	*idx = lblk % PTRS_PER_BLK;
+	return 0;
+}
+
+/* 
+ * Point logical block lblk of inode at blkno (0 punches a hole). Indirect blocks are
+ * allocated on demand when a nonzero pointer lands in an unmapped range.
+ */
+int bmap_set(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, int blkno) {
+	int iblk, idx;
+	int r = bmap_slot(fs, inode, lblk, blkno != 0 ? BMAP_CREATE : BMAP_MODIFY, &iblk, &idx);
+	if(r != 0){
+		return r == 1 ? 0 : -1;
+	}
+	if(iblk == 0){
+		inode->direct_ptr[idx] = blkno;
+		return 0;
+	}
+	int* ptrs = (int*)blk_get();
+	bio_read(fs->dev, iblk, ptrs);
+	ptrs[idx] = blkno;
+	bio_write(fs->dev, iblk, ptrs);
+	blk_put(ptrs);
+	return 0;
+}
+
+/* 
+ * Map logical block lblk of inode to its on-disk block. Returns 0 for a hole, or
+ * allocates the block when alloc is set (-1 if the disk is full).
+ */
+int bmap(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, int alloc) {
+	int blkno = 0;
+	if(inode->flags & INODE_INLINE){
+		return 0;
+	}
+	int iblk, idx;
+	int r = bmap_slot(fs, inode, lblk, BMAP_LOOKUP, &iblk, &idx);
+	if(r == -1){
+		return -1;
+	}
+	if(r == 0 && iblk == 0){
+		blkno = inode->direct_ptr[idx];
+	}
+	else if(r == 0){
+		int* ptrs = (int*)blk_get();
+		bio_read(fs->dev, iblk, ptrs);
+		blkno = ptrs[idx];
+		blk_put(ptrs);
+	}
+	if(blkno != 0 || !alloc){
+		return blkno;
+	}
+
+	int got = 0;
+	blkno = get_avail_blkrange(fs, inode_goal(fs, inode), 1, &got);
+	if(blkno == -1){
+		return -1;
+	}
+	if(bmap_set(fs, inode, lblk, blkno) == -1){
+		release_blocks(fs, &blkno, 1);
+		return -1;
+	}
+	inode->blocks++;
+	return blkno;
+}
+
+/* 
+ * Map the hole [lblk, lblk + n) to contiguous blocks where possible, starting next to the
+ * block before it. flag is 0 or PTR_UNWRITTEN. Returns the number of blocks mapped
+ * from lblk on, or -1 if nothing could be allocated.
+ */
+int bmap_alloc_range(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, uint32_t n, int flag) {
+	uint32_t done = 0;
+	int prev = lblk > 0 ? bmap(fs, inode, lblk - 1, 0) : 0;
+	int goal = prev > 0 && PTR_BLKNO(prev) != 0 ? PTR_BLKNO(prev) + 1 : inode_goal(fs, inode);
+	while(done < n){
+		int got = 0;
+		int start = get_avail_blkrange(fs, goal, n - done, &got);
+		if(start == -1){
+			break;
+		}
+		for(int k = 0; k < got; k++){
+			if(bmap_set(fs, inode, lblk + done + k, (start + k) | flag) == -1){
+				int unused = got - k;
+				int* rest = (int*)malloc(unused * sizeof(int));
+				for(int r = 0; r < unused; r++){
+					rest[r] = start + k + r;
+				}
+				release_blocks(fs, rest, unused);
+				free(rest);
+				return done + k > 0 ? done + k : -1;
+			}
+			inode->blocks++;
+		}
+		done += got;
+		goal = start + got;
+	}
+	return done > 0 ? done : -1;
+}
+
+/* 
+ * Read up to n consecutive block pointers from lblk into ptrs, stopping at the end of the
+ * inode's pointer area or indirect block holding lblk (unmapped ranges read as 0).
+ * Returns the number read, at most PTRS_PER_BLK, or -1 past the end of the block map.
+ */
+int bmap_get_run(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, uint32_t n, int *ptrs) {
+	int iblk, idx;
+	int r = bmap_slot(fs, inode, lblk, BMAP_LOOKUP, &iblk, &idx);
+	if(r == -1){
+		return -1;
+	}
+	uint32_t span = r == 1 ? (uint32_t)idx : (iblk == 0 ? NUM_DPTRS : PTRS_PER_BLK) - idx;
+	if(span > n){
+		span = n;
+	}
+	if(span > PTRS_PER_BLK){
+		span = PTRS_PER_BLK;
+	}
+	if(r == 1){
+		memset(ptrs, 0, span * sizeof(int));
+	}
+	else if(iblk == 0){
+		memcpy(ptrs, &inode->direct_ptr[idx], span * sizeof(int));
+	}
+	else{
+		int* blk = (int*)blk_get();
+		bio_read(fs->dev, iblk, blk);
+		memcpy(ptrs, blk + idx, span * sizeof(int));
+		blk_put(blk);
+	}
+	return span;
+}
+
+/* 
+ * Set n consecutive block pointers from lblk, with one read-modify-write per indirect
+ * block. Indirect blocks are only allocated for groups that map something.
+ */
+int bmap_set_run(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, uint32_t n, const int *ptrs) {
+	int* blk = (int*)blk_get();
+	uint32_t done = 0;
+	while(done < n){
+		int iblk, idx;
+		int r = bmap_slot(fs, inode, lblk + done, BMAP_MODIFY, &iblk, &idx);
+		uint32_t span = r == 1 ? (uint32_t)idx : (r == 0 && iblk == 0 ? NUM_DPTRS : PTRS_PER_BLK) - idx;
+		if(span > n - done){
+			span = n - done;
+		}
+		int any = 0;
+		for(uint32_t k = 0; k < span && !any; k++){
+			any = ptrs[done + k] != 0;
+		}
+		if(r == 1 && any){
+			r = bmap_slot(fs, inode, lblk + done, BMAP_CREATE, &iblk, &idx);
+			span = PTRS_PER_BLK - idx < n - done ? PTRS_PER_BLK - idx : n - done;
+		}
+		if(r == -1){
+			blk_put(blk);
+			return -1;
+		}
+		if(r == 0 && iblk == 0){
+			memcpy(&inode->direct_ptr[idx], ptrs + done, span * sizeof(int));
+		}
+		else if(r == 0){
+			bio_read(fs->dev, iblk, blk);
+			memcpy(blk + idx, ptrs + done, span * sizeof(int));
+			bio_write(fs->dev, iblk, blk);
+		}
+		done += span;
+	}
+	blk_put(blk);
+	return 0;
+}
+
+/* 
+ * Prepare the block behind logical block lblk (pointer ptr) for an in-place write. A
+ * block other files also refer to is first copied (copy set) or just replaced with a
+ * fresh one, and lblk remapped to it. Returns the block to write, -1 on failure.
+ */
+int cow_block(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, int ptr, int copy) {
+	int blkno = PTR_BLKNO(ptr);
+	// A block under a shared indirect block is shared as well; once the path is copied its
+	// own count tells
+	int iblk, idx;
+	if(bmap_slot(fs, inode, lblk, BMAP_MODIFY, &iblk, &idx) == -1){
+		return -1;
+	}
+	if(!blk_shared(fs, blkno)){
+		dedup_forget(fs, blkno);
+		return blkno;
+	}
+	int got = 0;
+	int fresh = get_avail_blkrange(fs, blkno + 1, 1, &got);
+	if(fresh == -1){
+		return -1;
+	}
+	if(copy){
+		char* block_buffer = (char*)blk_get();
+		if(bio_read(fs->dev, blkno, block_buffer) < 0){
+			blk_put(block_buffer);
+			release_blocks(fs, &fresh, 1);
+			return -1;
+		}
+		bio_write(fs->dev, fresh, block_buffer);
+		blk_put(block_buffer);
+	}
+	if(bmap_set(fs, inode, lblk, fresh | (ptr & PTR_UNWRITTEN)) == -1){
+		release_blocks(fs, &fresh, 1);
+		return -1;
+	}
+	release_blocks(fs, &blkno, 1);
+	__atomic_fetch_add(&fs->stats.cow_copies, 1, __ATOMIC_RELAXED);
+	return fresh;
+}
+
+/* 
+ * Offline dedup: point every data block of inode that matches an indexed block elsewhere
+ * at that block and index the rest. Returns the number of blocks merged. Caller writes
+ * the inode.
+ */
+int64_t dedup_inode(struct rufs_fs *fs, struct inode *inode) {
+	if(inode->flags & INODE_INLINE || inode->size == 0){
+		return 0;
+	}
+	char* block_buffer = (char*)blk_get();
+	int64_t merged = 0;
+	uint32_t last = (inode->size - 1) / BLOCK_SIZE;
+	for(uint32_t lblk = 0; lblk <= last; lblk++){
+		int iblk, idx;
+		if(bmap_slot(fs, inode, lblk, BMAP_LOOKUP, &iblk, &idx) == 1){
+			lblk += idx - 1;
+			continue;
+		}
+		int ptr = bmap(fs, inode, lblk, 0);
+		if(ptr <= 0 || (ptr & (PTR_UNWRITTEN | PTR_COMPRESSED)) || bio_read(fs->dev, ptr, block_buffer) < 0){
+			continue;
+		}
+		int hit = dedup_lookup(fs, block_buffer, ptr);
+		if(hit == 0){
+			dedup_index(fs, ptr, block_buffer);
+		}
+		else if(bmap_set(fs, inode, lblk, hit) == 0){
+			release_blocks(fs, &ptr, 1);
+			merged++;
+		}
+		else{
+			release_blocks(fs, &hit, 1);
+		}
+	}
+	blk_put(block_buffer);
+	fp_sync(fs);
+	return merged;
+}
+
+/* 
+ * Drop a reference to indirect block iblk (level 2 for the double indirect block). Its
+ * pointers are only followed once that was the last reference; until then they still
+ * belong to whoever else shares the block.
+ */
+void release_indirect(struct rufs_fs *fs, int iblk, int level) {
+	int* ptrs = (int*)blk_get();
+	bio_read(fs->dev, iblk, ptrs);
+	if(release_last(fs, iblk)){
+		int n = 0;
+		for(int i = 0; i < PTRS_PER_BLK; i++){
+			if(PTR_BLKNO(ptrs[i]) == 0){
+				continue;
+			}
+			if(level > 1){
+				release_indirect(fs, ptrs[i], level - 1);
+			}
+			else{
+				ptrs[n++] = PTR_BLKNO(ptrs[i]);
+			}
+		}
+		release_blocks(fs, ptrs, n);
+	}
+	blk_put(ptrs);
+}
+
+/* 
+ * Drop every block reference held by inode (data and indirect)
+ */
+void release_tree(struct rufs_fs *fs, struct inode *inode) {
+	if(inode->flags & INODE_INLINE){
+		return;
+	}
+	int blks[NUM_DPTRS];
+	int n = 0;
+	for(int i = 0; i < NUM_DPTRS; i++){
+		if(PTR_BLKNO(inode->direct_ptr[i]) != 0){
+			blks[n++] = PTR_BLKNO(inode->direct_ptr[i]);
+		}
+	}
+	release_blocks(fs, blks, n);
+	for(int i = 0; i < NUM_IPTRS; i++){
+		if(inode->indirect_ptr[i] != 0){
+			release_indirect(fs, inode->indirect_ptr[i], 1);
+		}
+	}
+	if(inode->dindirect_ptr != 0){
+		release_indirect(fs, inode->dindirect_ptr, 2);
+	}
+}
+
+/* 
+ * Check whether block blkno holds only zeros, using buf as scratch
+ */
+int block_is_zero(struct rufs_fs *fs, int blkno, char *buf) {
+	bio_read(fs->dev, blkno, buf);
+	for(int i = 0; i < BLOCK_SIZE; i++){
+		if(buf[i] != 0){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* 
+ * compressed clusters
+ */
+
+/* 
+ * Read cluster cl of inode as stored on disk into buf (CLUSTER_BLKS blocks), decompressing
+ * it if needed; dirty pages are not applied. Returns -1 if a block fails to read or decode.
+ */
+int cluster_load(struct rufs_fs *fs, struct inode *inode, uint32_t cl, char *buf) {
+	ARENA_SCOPE;
+	int ptrs[CLUSTER_BLKS];
+	for(int s = 0; s < CLUSTER_BLKS; s++){
+		ptrs[s] = bmap(fs, inode, cl * CLUSTER_BLKS + s, 0);
+	}
+	if(ptrs[0] <= 0 || !(ptrs[0] & PTR_COMPRESSED)){
+		for(int s = 0; s < CLUSTER_BLKS; s++){
+			if(ptrs[s] <= 0 || (ptrs[s] & PTR_UNWRITTEN)){
+				memset(buf + s * BLOCK_SIZE, 0, BLOCK_SIZE);
+			}
+			else if(bio_read(fs->dev, ptrs[s], buf + s * BLOCK_SIZE) < 0){
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	// Compressed: the stored blocks come first, the remaining slots have no block
+	char* packed = (char*)arena_alloc(CLUSTER_BLKS * BLOCK_SIZE);
+	int k = 0;
+	for(int s = 0; s < CLUSTER_BLKS && PTR_BLKNO(ptrs[s]) != 0; s++, k++){
+		if(bio_read(fs->dev, PTR_BLKNO(ptrs[s]), packed + k * BLOCK_SIZE) < 0){
+			return -1;
+		}
+	}
+	struct cluster_hdr* hdr = (struct cluster_hdr*)packed;
+	int retval = 0;
+	if(hdr->magic != CLUSTER_MAGIC || hdr->clen > k * BLOCK_SIZE - sizeof(struct cluster_hdr) ||
+	   lz_decompress(packed + sizeof(struct cluster_hdr), hdr->clen, buf, CLUSTER_BLKS * BLOCK_SIZE) != CLUSTER_BLKS * BLOCK_SIZE){
+		fprintf(stderr, "rufs: inode %d has a corrupt compressed cluster at block %u\n", inode->ino, cl * CLUSTER_BLKS);
+		retval = -1;
+	}
+	return retval;
+}
+
+/* 
+ * Replace cluster cl of inode with the CLUSTER_BLKS blocks in buf. With compress set it is
+ * stored compressed when that saves at least one block, otherwise raw; all-zero blocks
+ * become holes either way. New blocks are written and mapped before the old ones are
+ * freed. Caller writes the inode.
+ */
+int cluster_store(struct rufs_fs *fs, struct inode *inode, uint32_t cl, const char *buf, int compress) {
+	ARENA_SCOPE;
+	uint32_t first = cl * CLUSTER_BLKS;
+	int old[CLUSTER_BLKS], new[CLUSTER_BLKS];
+	int nold = 0, nnew = 0;
+	for(int s = 0; s < CLUSTER_BLKS; s++){
+		int ptr = bmap(fs, inode, first + s, 0);
+		if(ptr > 0 && PTR_BLKNO(ptr) != 0){
+			old[nold++] = PTR_BLKNO(ptr);
+		}
+	}
+
+	// Step 1: Decide what to write for each slot
+	const char* src[CLUSTER_BLKS] = {NULL};
+	int zero = 1;
+	for(int s = 0; s < CLUSTER_BLKS; s++){
+		const char* blk = buf + s * BLOCK_SIZE;
+		int nz = 0;
+		for(int i = 0; i < BLOCK_SIZE && !nz; i++){
+			nz = blk[i] != 0;
+		}
+		src[s] = nz ? blk : NULL;
+		zero &= !nz;
+	}
+	char* packed = NULL;
+	int flag = 0;
+	if(compress && !zero){
+		packed = (char*)arena_zalloc((CLUSTER_BLKS - 1) * BLOCK_SIZE);
+		int cap = (CLUSTER_BLKS - 1) * BLOCK_SIZE - sizeof(struct cluster_hdr);
+		int clen = lz_compress(buf, CLUSTER_BLKS * BLOCK_SIZE, packed + sizeof(struct cluster_hdr), cap);
+		__atomic_fetch_add(&fs->stats.compress_in, CLUSTER_BLKS * BLOCK_SIZE, __ATOMIC_RELAXED);
+		if(clen > 0){
+			struct cluster_hdr* hdr = (struct cluster_hdr*)packed;
+			hdr->magic = CLUSTER_MAGIC;
+			hdr->clen = clen;
+			int k = (sizeof(struct cluster_hdr) + clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			for(int s = 0; s < CLUSTER_BLKS; s++){
+				src[s] = s < k ? packed + s * BLOCK_SIZE : NULL;
+			}
+			flag = PTR_COMPRESSED;
+			__atomic_fetch_add(&fs->stats.compress_out, clen, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&fs->stats.clusters_compressed, 1, __ATOMIC_RELAXED);
+		}
+		else{
+			__atomic_fetch_add(&fs->stats.clusters_raw, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	// Step 2: Allocate next to the previous block and write the new blocks
+	int want = 0;
+	for(int s = 0; s < CLUSTER_BLKS; s++){
+		want += src[s] != NULL;
+	}
+	int prev = first > 0 ? bmap(fs, inode, first - 1, 0) : 0;
+	int goal = prev > 0 && PTR_BLKNO(prev) != 0 ? PTR_BLKNO(prev) + 1 : inode_goal(fs, inode);
+	while(nnew < want){
+		int got = 0;
+		int start = (inode->flags & INODE_LOG) ? log_alloc(fs, want - nnew, &got) : get_avail_blkrange(fs, goal, want - nnew, &got);
+		if(start == -1){
+			release_blocks(fs, new, nnew);
+			return -ENOSPC;
+		}
+		for(int k = 0; k < got; k++){
+			new[nnew++] = start + k;
+		}
+		goal = start + got;
+	}
+	for(int s = 0, k = 0; s < CLUSTER_BLKS; s++){
+		if(src[s] != NULL){
+			bio_write(fs->dev, new[k++], src[s]);
+		}
+	}
+
+	// Step 3: Point the cluster at the new blocks, then free the old ones
+	for(int s = 0, k = 0; s < CLUSTER_BLKS; s++){
+		int ptr = src[s] != NULL ? new[k++] : 0;
+		if(bmap_set(fs, inode, first + s, ptr | flag) == -1){
+			return -ENOSPC;
+		}
+	}
+	inode->blocks += nnew - nold;
+	release_blocks(fs, old, nold);
+	return 0;
+}
+
+/* 
+ * Copy from logical block lblk of a compressed cluster, decompressing the whole cluster
+ * into the block cache on a miss. Returns -1 on a read error.
+ */
+int cluster_read(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, char *dst, uint32_t off, size_t len) {
+	ARENA_SCOPE;
+	uint64_t gen = bcache_snapshot(fs);
+	uint32_t first = lblk - lblk % CLUSTER_BLKS;
+	int head = PTR_BLKNO(bmap(fs, inode, first, 0));
+	if(bcache_read(fs, head, lblk - first, dst, off, len)){
+		return 0;
+	}
+	char* buf = (char*)arena_alloc(CLUSTER_BLKS * BLOCK_SIZE);
+	if(cluster_load(fs, inode, first / CLUSTER_BLKS, buf) == -1){
+		return -1;
+	}
+	for(int s = 0; s < CLUSTER_BLKS; s++){
+		bcache_fill(fs, head, s, buf + s * BLOCK_SIZE, gen);
+	}
+	memcpy(dst, buf + (lblk - first) * BLOCK_SIZE + off, len);
+	return 0;
+}
+
+/* 
+ * Rewrite cluster cl as raw blocks if it is compressed, so its blocks can be changed one
+ * at a time. Caller writes the inode.
+ */
+int cluster_unpack(struct rufs_fs *fs, struct inode *inode, uint32_t cl) {
+	ARENA_SCOPE;
+	int ptr = bmap(fs, inode, cl * CLUSTER_BLKS, 0);
+	if(ptr <= 0 || !(ptr & PTR_COMPRESSED)){
+		return 0;
+	}
+	char* buf = (char*)arena_alloc(CLUSTER_BLKS * BLOCK_SIZE);
+	int retval = cluster_load(fs, inode, cl, buf) == -1 ? -EIO : cluster_store(fs, inode, cl, buf, 0);
+	return retval;
+}
+
+/* 
+ * Punch [offset, offset + len) out of inode: whole blocks are unmapped and freed,
+ * partial blocks at either end are zeroed in place. Caller writes the inode.
+ */
+int punch_range(struct rufs_fs *fs, struct inode *inode, off_t offset, off_t len) {
+	if(inode->flags & INODE_INLINE){
+		if(offset < INLINE_MAX){
+			memset(inode->inline_data + offset, 0, (offset + len > INLINE_MAX ? INLINE_MAX : offset + len) - offset);
+		}
+		return 0;
+	}
+	char* block_buffer = (char*)blk_get();
+	off_t end = offset + len;
+	uint32_t first_full = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t last_full = end / BLOCK_SIZE; /* exclusive */
+
+	// Step 0: Compressed clusters cut by either end of the range go back to raw blocks
+	if(inode->flags & INODE_COMPRESS){
+		uint32_t head = offset / BLOCK_SIZE / CLUSTER_BLKS, tail = (end - 1) / BLOCK_SIZE / CLUSTER_BLKS;
+		cluster_unpack(fs, inode, head);
+		if(tail != head){
+			cluster_unpack(fs, inode, tail);
+		}
+	}
+
+	// Step 1: Zero the partial head and tail blocks if they are mapped
+	off_t lo[2] = {offset, (off_t)last_full * BLOCK_SIZE};
+	off_t hi[2] = {(off_t)first_full * BLOCK_SIZE < end ? (off_t)first_full * BLOCK_SIZE : end, end};
+	int partial[2] = {offset % BLOCK_SIZE != 0, end % BLOCK_SIZE != 0 && last_full >= first_full};
+	for(int e = 0; e < 2; e++){
+		int blkno = partial[e] ? bmap(fs, inode, lo[e] / BLOCK_SIZE, 0) : 0;
+		if(blkno > 0 && !(blkno & PTR_UNWRITTEN) && (blkno = cow_block(fs, inode, lo[e] / BLOCK_SIZE, blkno, 1)) > 0){
+			bio_read(fs->dev, blkno, block_buffer);
+			memset(block_buffer + (lo[e] % BLOCK_SIZE), 0, hi[e] - lo[e]);
+			bio_write(fs->dev, blkno, block_buffer);
+		}
+	}
+
+	// Step 2: Unmap and free whole blocks in between, skipping unmapped indirect ranges
+	int* blks = (int*)blk_get();
+	int n = 0;
+	for(uint32_t lblk = first_full; lblk < last_full; lblk++){
+		int iblk, idx;
+		int r = bmap_slot(fs, inode, lblk, BMAP_LOOKUP, &iblk, &idx);
+		if(r == -1){
+			break;
+		}
+		if(r == 1){
+			lblk += idx - 1;
+			continue;
+		}
+		int blkno = bmap(fs, inode, lblk, 0);
+		if(blkno > 0 && bmap_set(fs, inode, lblk, 0) == -1){
+			/*no space to copy a shared indirect block, the block stays mapped*/
+			continue;
+		}
+		if(blkno > 0 && PTR_BLKNO(blkno) != 0){
+			blks[n++] = PTR_BLKNO(blkno);
+			inode->blocks--;
+			if(n == PTRS_PER_BLK){
+				release_blocks(fs, blks, n);
+				n = 0;
+			}
+		}
+	}
+	release_blocks(fs, blks, n);
+
+	// Step 3: Free indirect blocks left without any mapping
+	if(last_full > NUM_DPTRS){
+		for(int i = 0; i < NUM_IPTRS; i++){
+			if(inode->indirect_ptr[i] != 0 && block_is_zero(fs, inode->indirect_ptr[i], block_buffer)){
+				release_blocks(fs, &inode->indirect_ptr[i], 1);
+				inode->indirect_ptr[i] = 0;
+				inode->blocks--;
+			}
+		}
+	}
+	if(inode->dindirect_ptr != 0 && last_full > NUM_DPTRS + NUM_IPTRS * PTRS_PER_BLK && !blk_shared(fs, inode->dindirect_ptr)){
+		int* l1 = (int*)blk_get();
+		bio_read(fs->dev, inode->dindirect_ptr, l1);
+		int used = 0, changed = 0;
+		for(int i = 0; i < PTRS_PER_BLK; i++){
+			if(l1[i] == 0){
+				continue;
+			}
+			if(block_is_zero(fs, l1[i], block_buffer)){
+				release_blocks(fs, &l1[i], 1);
+				l1[i] = 0;
+				inode->blocks--;
+				changed = 1;
+			}
+			else{
+				used = 1;
+			}
+		}
+		if(!used){
+			release_blocks(fs, &inode->dindirect_ptr, 1);
+			inode->dindirect_ptr = 0;
+			inode->blocks--;
+		}
+		else if(changed){
+			bio_write(fs->dev, inode->dindirect_ptr, l1);
+		}
+		blk_put(l1);
+	}
+
+	blk_put(blks);
+	blk_put(block_buffer);
+	return 0;
+}
+
+/* 
+ * SEEK_DATA / SEEK_HOLE: next offset >= offset that starts data or a hole.
+ * The end of file and unwritten blocks count as holes.
+ */
+off_t seek_data_hole(struct rufs_fs *fs, struct inode *inode, off_t offset, int whence) {
+	if(offset < 0 || offset >= inode->size){
+		return -ENXIO;
+	}
+	if(inode->flags & INODE_INLINE){
+		return whence == SEEK_DATA ? offset : (off_t)inode->size;
+	}
+	uint32_t last = (inode->size - 1) / BLOCK_SIZE;
+	for(uint32_t lblk = offset / BLOCK_SIZE; lblk <= last; lblk++){
+		int iblk, idx;
+		if(whence == SEEK_DATA && bmap_slot(fs, inode, lblk, BMAP_LOOKUP, &iblk, &idx) == 1){
+			/*no indirect block, the whole subtree is a hole*/
+			lblk += idx - 1;
+			continue;
+		}
+		int ptr = bmap(fs, inode, lblk, 0);
+		int mapped = ptr > 0 && !(ptr & PTR_UNWRITTEN);
+		if((whence == SEEK_DATA && mapped) || (whence == SEEK_HOLE && !mapped)){
+			off_t pos = (off_t)lblk * BLOCK_SIZE;
+			return pos > offset ? pos : offset;
+		}
+	}
+	return whence == SEEK_DATA ? -ENXIO : (off_t)inode->size;
+}
+
+
+/* 
+ * Move inline data out to a data block once the file outgrows the inode.
+ * Caller writes the inode.
+ */
+int inline_spill(struct rufs_fs *fs, struct inode *inode) {
+	if(!(inode->flags & INODE_INLINE)){
+		return 0;
+	}
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	memcpy(block_buffer, inode->inline_data, INLINE_MAX);
+	memset(inode->inline_data, 0, INLINE_MAX);
+	inode->flags &= ~INODE_INLINE;
+
+	if(inode->size > 0){
+		int blkno = bmap(fs, inode, 0, 1);
+		if(blkno == -1){
+			memcpy(inode->inline_data, block_buffer, INLINE_MAX);
+			inode->flags |= INODE_INLINE;
+			blk_put(block_buffer);
+			return -1;
+		}
+		bio_write(fs->dev, blkno, block_buffer);
+	}
+	blk_put(block_buffer);
+	return 0;
+}
+
+/* 
+ * I/O thread pool
+ */
+
+void io_group_init(struct io_group *g) {
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->done, NULL);
+	g->pending = 0;
+}
+
+static void io_run(struct rufs_fs *fs, struct io_task *t) {
+	t->fn(t->arg);
+	__atomic_fetch_sub(&fs->io_inflight[t->cls], 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&t->grp->lock);
+	if(--t->grp->pending == 0){
+		pthread_cond_broadcast(&t->grp->done);
+	}
+	pthread_mutex_unlock(&t->grp->lock);
+}
+
+/* 
+ * Take the newest task of worker w's own deque, or else steal the oldest one of another
+ */
+static int io_take(struct rufs_fs *fs, int w, struct io_task *t) {
+	for(int k = 0; k < IO_WORKERS; k++){
+		struct io_worker* wk = &fs->io_workers[(w + k) % IO_WORKERS];
+		pthread_mutex_lock(&wk->lock);
+		if(wk->count > 0){
+			if(k == 0){
+				*t = wk->q[(wk->head + wk->count - 1) % IO_QUEUE];
+			}
+			else{
+				*t = wk->q[wk->head];
+				wk->head = (wk->head + 1) % IO_QUEUE;
+				__atomic_fetch_add(&fs->stats.io_steals, 1, __ATOMIC_RELAXED);
+			}
+			wk->count--;
+			pthread_mutex_unlock(&wk->lock);
+			__atomic_fetch_sub(&fs->io_queued, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+		pthread_mutex_unlock(&wk->lock);
+	}
+	return 0;
+}
+
+static void *io_worker(void *arg) {
+	struct io_worker* self = (struct io_worker*)arg;
+	struct rufs_fs* fs = self->fs;
+	int w = self->id;
+	io_self = w;
+	struct io_task t;
+	while(1){
+		if(io_take(fs, w, &t)){
+			io_run(fs, &t);
+			__atomic_fetch_add(&fs->stats.io_tasks, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		pthread_mutex_lock(&fs->io_lock);
+		while(__atomic_load_n(&fs->io_queued, __ATOMIC_RELAXED) == 0 && !fs->io_stop){
+			pthread_cond_wait(&fs->io_cond, &fs->io_lock);
+		}
+		int stop = fs->io_stop && __atomic_load_n(&fs->io_queued, __ATOMIC_RELAXED) == 0;
+		pthread_mutex_unlock(&fs->io_lock);
+		if(stop){
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* 
+ * Queue fn(arg) as part of group g. It runs in the caller instead when the pool is not
+ * running, the caller is a pool worker (tasks never wait on tasks), or cls already has
+ * io_depth[cls] tasks outstanding.
+ */
+void io_submit(struct rufs_fs *fs, struct io_group *g, int cls, void (*fn)(void *arg), void *arg) {
+	struct io_task t = {fn, arg, g, cls};
+	pthread_mutex_lock(&g->lock);
+	g->pending++;
+	pthread_mutex_unlock(&g->lock);
+	int queued = 0;
+	int depth = __atomic_add_fetch(&fs->io_inflight[cls], 1, __ATOMIC_RELAXED); /*given back by io_run()*/
+	if(fs->io_running && io_self == -1 && depth <= io_depth[cls]){
+		uint32_t w = __atomic_fetch_add(&fs->io_next, 1, __ATOMIC_RELAXED);
+		for(int k = 0; k < IO_WORKERS && !queued; k++){
+			struct io_worker* wk = &fs->io_workers[(w + k) % IO_WORKERS];
+			pthread_mutex_lock(&wk->lock);
+			if(wk->count < IO_QUEUE){
+				wk->q[(wk->head + wk->count) % IO_QUEUE] = t;
+				wk->count++;
+				queued = 1;
+			}
+			pthread_mutex_unlock(&wk->lock);
+		}
+	}
+	if(!queued){
+		io_run(fs, &t);
+		return;
+	}
+	pthread_mutex_lock(&fs->io_lock);
+	__atomic_add_fetch(&fs->io_queued, 1, __ATOMIC_RELAXED); /*workers take tasks without io_lock*/
+	pthread_cond_signal(&fs->io_cond);
+	pthread_mutex_unlock(&fs->io_lock);
+}
+
+/* 
+ * Wait for every task of group g
+ */
+void io_wait(struct io_group *g) {
+	pthread_mutex_lock(&g->lock);
+	while(g->pending > 0){
+		pthread_cond_wait(&g->done, &g->lock);
+	}
+	pthread_mutex_unlock(&g->lock);
+	pthread_mutex_destroy(&g->lock);
+	pthread_cond_destroy(&g->done);
+}
+
+/* A range of a file read by a pool worker for rufs_read() */
+struct read_task {
+	struct rufs_fs *fs;
+	struct inode *inode;
+	char *buffer;
+	off_t offset;
+	size_t size;
+	size_t copied;
+};
+
+/* A batch of whole blocks to read or write, see io_blocks() */
+struct io_range {
+	struct rufs_fs *fs;
+	const int *blknos;
+	char **bufs;
+	uint32_t n;
+	int write;
+	int err;					/* set if a read failed verification */
+};
+
+static void io_range_run(void *arg) {
+	struct io_range* r = (struct io_range*)arg;
+	struct rufs_fs* fs = r->fs;
+	for(uint32_t k = 0; k < r->n; k++){
+		if(r->write){
+			bio_write(fs->dev, r->blknos[k], r->bufs[k]);
+		}
+		else if(bio_read(fs->dev, r->blknos[k], r->bufs[k]) < 0){
+			r->err = 1;
+		}
+	}
+}
+
+/* 
+ * Read or write n whole blocks, bufs[k] to or from blknos[k], split into tasks of
+ * IO_TASK_BLKS blocks run across the pool. On a striped device each task stays on one
+ * member file and the members are handed work in turn. Returns -1 if any read failed.
+ */
+int io_blocks(struct rufs_fs *fs, int cls, int write, const int *blknos, char **bufs, uint32_t n) {
+	ARENA_SCOPE;
+	if(n == 0){
+		return 0;
+	}
+	// Step 1: Group the blocks by member file, start[m] is where member m's run begins
+	int members = dev_members(fs->dev);
+	uint32_t* start = (uint32_t*)arena_zalloc((members + 1) * sizeof(uint32_t));
+	start[members] = n;
+	if(members > 1){
+		int* sorted_blknos = (int*)arena_alloc(n * sizeof(int));
+		char** sorted_bufs = (char**)arena_alloc(n * sizeof(char*));
+		uint32_t* fill = (uint32_t*)arena_zalloc(members * sizeof(uint32_t));
+		for(uint32_t k = 0; k < n; k++){
+			fill[dev_member(fs->dev, blknos[k])]++;
+		}
+		for(int m = 1; m < members; m++){
+			start[m] = start[m - 1] + fill[m - 1];
+		}
+		memcpy(fill, start, members * sizeof(uint32_t));
+		for(uint32_t k = 0; k < n; k++){
+			uint32_t at = fill[dev_member(fs->dev, blknos[k])]++;
+			sorted_blknos[at] = blknos[k];
+			sorted_bufs[at] = bufs[k];
+		}
+		blknos = sorted_blknos;
+		bufs = sorted_bufs;
+	}
+
+	// Step 2: Cut each member's run into tasks, submitting one per member per round
+	uint32_t ntasks = 0;
+	for(int m = 0; m < members; m++){
+		ntasks += (start[m + 1] - start[m] + IO_TASK_BLKS - 1) / IO_TASK_BLKS;
+	}
+	struct io_range* r = (struct io_range*)arena_zalloc(ntasks * sizeof(struct io_range));
+	struct io_group g;
+	io_group_init(&g);
+	uint32_t t = 0;
+	for(uint32_t round = 0; t < ntasks; round++){
+		for(int m = 0; m < members; m++){
+			uint32_t at = start[m] + round * IO_TASK_BLKS;
+			if(at >= start[m + 1]){
+				continue;
+			}
+			r[t].fs = fs;
+			r[t].blknos = blknos + at;
+			r[t].bufs = bufs + at;
+			r[t].n = start[m + 1] - at < IO_TASK_BLKS ? start[m + 1] - at : IO_TASK_BLKS;
+			r[t].write = write;
+			io_submit(fs, &g, cls, io_range_run, &r[t]);
+			t++;
+		}
+	}
+	io_wait(&g);
+	int retval = 0;
+	for(uint32_t k = 0; k < ntasks; k++){
+		retval = r[k].err ? -1 : retval;
+	}
+	return retval;
+}
+
+void io_start(struct rufs_fs *fs) {
+	fs->io_stop = 0;
+	for(int w = 0; w < IO_WORKERS; w++){
+		pthread_mutex_init(&fs->io_workers[w].lock, NULL);
+		fs->io_workers[w].head = fs->io_workers[w].count = 0;
+		fs->io_workers[w].fs = fs;
+		fs->io_workers[w].id = w;
+	}
+	for(int w = 0; w < IO_WORKERS; w++){
+		if(pthread_create(&fs->io_workers[w].thread, NULL, io_worker, &fs->io_workers[w]) != 0){
+			/*Without a full pool every task runs in its caller*/
+			fs->io_stop = 1;
+			pthread_cond_broadcast(&fs->io_cond);
+			for(int k = 0; k < w; k++){
+				pthread_join(fs->io_workers[k].thread, NULL);
+			}
+			return;
+		}
+	}
+	fs->io_running = 1;
+}
+
+/* 
+ * Stop the pool once the queued tasks have run
+ */
+void io_shutdown(struct rufs_fs *fs) {
+	if(!fs->io_running){
+		return;
+	}
+	fs->io_running = 0;
+	pthread_mutex_lock(&fs->io_lock);
+	fs->io_stop = 1;
+	pthread_cond_broadcast(&fs->io_cond);
+	pthread_mutex_unlock(&fs->io_lock);
+	for(int w = 0; w < IO_WORKERS; w++){
+		pthread_join(fs->io_workers[w].thread, NULL);
+	}
+}
+
+
+/* 
+ * readahead
+ */
+
+/* 
+ * Readahead state for a newly opened file, NULL once RA_STATES files have one
+ */
+struct ra_state* ra_state_new(struct rufs_fs *fs) {
+	pthread_mutex_lock(&fs->ra_lock);
+	struct ra_state* ra = fs->ra_free;
+	if(ra != NULL){
+		fs->ra_free = ra->free_next;
+	}
+	pthread_mutex_unlock(&fs->ra_lock);
+	if(ra != NULL){
+		ra->next = ra->window = ra->ahead = 0;
+	}
+	return ra;
+}
+
+void ra_state_put(struct rufs_fs *fs, struct ra_state *ra) {
+	pthread_mutex_lock(&fs->ra_lock);
+	ra->free_next = fs->ra_free;
+	fs->ra_free = ra;
+	pthread_mutex_unlock(&fs->ra_lock);
+}
+
+/* 
+ * Queue a prefetch for the readahead thread: blocks [lblk, lblk + n) of inode, or with
+ * itab set the inode table blocks in it. Prefetching is only a hint, so it is dropped
+ * when the queue is full.
+ */
+void ra_submit(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, uint32_t n, uint32_t itab) {
+	pthread_mutex_lock(&fs->ra_lock);
+	if(fs->ra_running && fs->ra_count < RA_QUEUE){
+		struct ra_job* job = &fs->ra_queue[(fs->ra_head + fs->ra_count) % RA_QUEUE];
+		if(inode != NULL){
+			memcpy(&job->inode, inode, sizeof(struct inode));
+		}
+		job->lblk = lblk;
+		job->n = n;
+		job->itab = itab;
+		fs->ra_count++;
+		pthread_cond_signal(&fs->ra_cond);
+	}
+	pthread_mutex_unlock(&fs->ra_lock);
+}
+
+/* 
+ * Read blocks [lblk, lblk + n) of inode into the block cache. Holes, unwritten and already
+ * cached blocks are skipped; a compressed cluster is decompressed into the cache whole.
+ */
+void ra_fetch(struct rufs_fs *fs, struct inode *inode, uint32_t lblk, uint32_t n) {
+	char* block_buffer = (char*)blk_get();
+	int* ptrs = (int*)blk_get();
+	uint32_t done = 0;
+	while(done < n){
+		int got = bmap_get_run(fs, inode, lblk + done, n - done, ptrs);
+		if(got <= 0){
+			break;
+		}
+		for(int k = 0; k < got; k++){
+			uint32_t i = lblk + done + k;
+			if(ptrs[k] <= 0 || (ptrs[k] & PTR_UNWRITTEN)){
+				continue;
+			}
+			if(ptrs[k] & PTR_COMPRESSED){
+				if(k == 0 || i % CLUSTER_BLKS == 0){
+					cluster_read(fs, inode, i, block_buffer, 0, BLOCK_SIZE);
+				}
+				continue;
+			}
+			if(bcache_has(fs, ptrs[k], BCACHE_RAW)){
+				continue;
+			}
+			uint64_t gen = bcache_snapshot(fs);
+			if(bio_read(fs->dev, ptrs[k], block_buffer) < 0){
+				continue;
+			}
+			bcache_fill(fs, ptrs[k], BCACHE_RAW, block_buffer, gen);
+			__atomic_fetch_add(&fs->stats.ra_blocks, 1, __ATOMIC_RELAXED);
+		}
+		done += got;
+	}
+	blk_put(ptrs);
+	blk_put(block_buffer);
+}
+
+/* 
+ * Feed a read of blocks [first, last] through the reader's readahead state. A read that
+ * continues where the last one stopped doubles the window, up to RA_MAX_BLKS, and once less
+ * than half of it is left prefetched the rest is queued for the readahead thread. Any other
+ * read halves the window and starts over from it.
+ */
+void ra_update(struct rufs_fs *fs, struct inode *inode, struct ra_state *ra, uint32_t first, uint32_t last) {
+	uint32_t end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t from = 0, to = 0;
+	pthread_mutex_lock(&ra->lock);
+	if(first == ra->next || first + 1 == ra->next){
+		ra->window = ra->window == 0 ? RA_MIN_BLKS : (ra->window * 2 > RA_MAX_BLKS ? RA_MAX_BLKS : ra->window * 2);
+		if(ra->ahead < last + 1 + ra->window / 2){
+			from = ra->ahead > last + 1 ? ra->ahead : last + 1;
+			to = last + 1 + ra->window < end ? last + 1 + ra->window : end;
+			if(from < to){
+				ra->ahead = to;
+			}
+		}
+	}
+	else{
+		ra->window /= 2;
+		ra->ahead = 0;
+	}
+	ra->next = last + 1;
+	pthread_mutex_unlock(&ra->lock);
+	if(from >= to){
+		return;
+	}
+
+	ra_submit(fs, inode, from, to - from, 0);
+}
+
+static void *ra_worker(void *arg) {
+	struct rufs_fs* fs = (struct rufs_fs*)arg;
+	struct ra_job* job = (struct ra_job*)malloc(sizeof(struct ra_job));
+	pthread_mutex_lock(&fs->ra_lock);
+	while(1){
+		while(fs->ra_count == 0 && !fs->ra_stop){
+			pthread_cond_wait(&fs->ra_cond, &fs->ra_lock);
+		}
+		if(fs->ra_stop){
+			break;
+		}
+		memcpy(job, &fs->ra_queue[fs->ra_head], sizeof(struct ra_job));
+		fs->ra_head = (fs->ra_head + 1) % RA_QUEUE;
+		fs->ra_count--;
+		pthread_mutex_unlock(&fs->ra_lock);
+		if(job->itab != 0){
+			itable_fetch(fs, job->itab);
+		}
+		else{
+			ra_fetch(fs, &job->inode, job->lblk, job->n);
+		}
+		pthread_mutex_lock(&fs->ra_lock);
+	}
+	pthread_mutex_unlock(&fs->ra_lock);
+	free(job);
+	return NULL;
+}
+
+/* 
+ * Start the readahead thread
+ */
+void ra_start(struct rufs_fs *fs) {
+	fs->ra_stop = 0;
+	fs->ra_head = fs->ra_count = 0;
+	if(pthread_create(&fs->ra_thread, NULL, ra_worker, fs) == 0){
+		fs->ra_running = 1;
+	}
+}
+
+/* 
+ * Stop the readahead thread, dropping queued prefetches
+ */
+void ra_shutdown(struct rufs_fs *fs) {
+	if(!fs->ra_running){
+		return;
+	}
+	pthread_mutex_lock(&fs->ra_lock);
+	fs->ra_stop = 1;
+	fs->ra_running = 0;
+	pthread_cond_broadcast(&fs->ra_cond);
+	pthread_mutex_unlock(&fs->ra_lock);
+	pthread_join(fs->ra_thread, NULL);
+}
+
+
+/* 
+ * delayed allocation
+ */
+static inline uint32_t dalloc_bucket(uint16_t ino, uint32_t lblk) {
+	return (ino * 31 + lblk) % DALLOC_HASH;
+}
+
+/* 
+ * Find the dirty page for (ino, lblk), caller holds dalloc_lock
+ */
+struct page* dalloc_lookup(struct rufs_fs *fs, uint16_t ino, uint32_t lblk) {
+	struct page* pg = fs->dalloc_hash[dalloc_bucket(ino, lblk)];
+	while(pg != NULL && (pg->ino != ino || pg->lblk != lblk)){
+		pg = pg->hash_next;
+	}
+	return pg;
+}
+
+/* 
+ * Copy a write into the page for (ino, lblk), creating it from base (zeros if NULL) if
+ * needed. A page with reserve set holds one block so writeback cannot run out of space;
+ * hole is set if no block is mapped at lblk yet.
+ */
+int dalloc_write(struct rufs_fs *fs, uint16_t ino, uint32_t lblk, int reserve, int hole, const char *base, const char *src, uint32_t off, size_t len) {
+	pthread_mutex_lock(&fs->dalloc_lock);
+	struct page* pg = dalloc_lookup(fs, ino, lblk);
+	if(pg == NULL){
+		/*Keep headroom for indirect blocks allocated at writeback*/
+		if(reserve && free_blk_count(fs) - (int)fs->dalloc_reserved <= NUM_IPTRS){
+			pthread_mutex_unlock(&fs->dalloc_lock);
+			return -1;
+		}
+		pg = fs->dalloc_free;
+		if(pg != NULL){
+			fs->dalloc_free = pg->hash_next;
+			fs->dalloc_nfree--;
+		}
+		else if((pg = (struct page*)malloc(sizeof(struct page))) == NULL){
+			pthread_mutex_unlock(&fs->dalloc_lock);
+			return -1;
+		}
+		pg->ino = ino;
+		pg->lblk = lblk;
+		pg->reserved = reserve;
+		pg->hole = hole;
+		pg->written = 0;
+		if(base != NULL){
+			memcpy(pg->data, base, BLOCK_SIZE);
+		}
+		else{
+			memset(pg->data, 0, BLOCK_SIZE);
+		}
+		pg->hash_next = fs->dalloc_hash[dalloc_bucket(ino, lblk)];
+		fs->dalloc_hash[dalloc_bucket(ino, lblk)] = pg;
+		pg->ino_next = fs->dalloc_ino_list[ino];
+		fs->dalloc_ino_list[ino] = pg;
+		fs->dalloc_pages[ino]++;
+		fs->dalloc_holes[ino] += hole;
+		fs->dalloc_total++;
+		fs->dalloc_reserved += reserve;
+	}
+	memcpy(pg->data + off, src, len);
+	pthread_mutex_unlock(&fs->dalloc_lock);
+	return 0;
+}
+
+/* 
+ * Copy from the dirty page for (ino, lblk) if there is one, returns 1 if it was found
+ */
+int dalloc_read(struct rufs_fs *fs, uint16_t ino, uint32_t lblk, char *dst, uint32_t off, size_t len) {
+	if(__atomic_load_n(&fs->dalloc_pages[ino], __ATOMIC_ACQUIRE) == 0){
+		return 0;
+	}
+	pthread_mutex_lock(&fs->dalloc_lock);
+	struct page* pg = dalloc_lookup(fs, ino, lblk);
+	if(pg != NULL){
+		memcpy(dst, pg->data + off, len);
+	}
+	pthread_mutex_unlock(&fs->dalloc_lock);
+	return pg != NULL;
+}
+
+/* 
+ * Unlink a page from the hash and inode list and keep it for reuse, up to DALLOC_MAX_PAGES
+ * of them, caller holds dalloc_lock
+ */
+void dalloc_evict(struct rufs_fs *fs, struct page *pg) {
+	struct page** pp = &fs->dalloc_hash[dalloc_bucket(pg->ino, pg->lblk)];
+	while(*pp != pg){
+		pp = &(*pp)->hash_next;
+	}
+	*pp = pg->hash_next;
+	pp = &fs->dalloc_ino_list[pg->ino];
+	while(*pp != pg){
+		pp = &(*pp)->ino_next;
+	}
+	*pp = pg->ino_next;
+	__atomic_sub_fetch(&fs->dalloc_pages[pg->ino], 1, __ATOMIC_RELEASE);
+	fs->dalloc_holes[pg->ino] -= pg->hole;
+	fs->dalloc_total--;
+	fs->dalloc_reserved -= pg->reserved;
+	if(fs->dalloc_nfree < DALLOC_MAX_PAGES){
+		pg->hash_next = fs->dalloc_free;
+		fs->dalloc_free = pg;
+		fs->dalloc_nfree++;
+		return;
+	}
+	free(pg);
+}
+
+/* 
+ * Throw away dirty pages of ino at or beyond from_lblk (file truncated or deleted), once
+ * a writeback that is using them is done
+ */
+void dalloc_drop(struct rufs_fs *fs, uint16_t ino, uint32_t from_lblk) {
+	if(fs->dalloc_pages[ino] == 0){
+		return;
+	}
+	pthread_mutex_lock(&fs->dalloc_lock);
+	while(fs->dalloc_busy[ino]){
+		pthread_cond_wait(&fs->dalloc_cond, &fs->dalloc_lock);
+	}
+	struct page* pg = fs->dalloc_ino_list[ino];
+	while(pg != NULL){
+		struct page* next = pg->ino_next;
+		if(pg->lblk >= from_lblk){
+			dalloc_evict(fs, pg);
+		}
+		pg = next;
+	}
+	pthread_mutex_unlock(&fs->dalloc_lock);
+}
+
+static int page_cmp(const void *a, const void *b) {
+	uint32_t x = (*(struct page**)a)->lblk, y = (*(struct page**)b)->lblk;
+	return (x > y) - (x < y);
+}
+
+/* 
+ * Write back the dirty pages of a compressed inode (pages sorted by lblk), one whole
+ * cluster at a time: the pages are laid over the cluster's current contents and the
+ * result is stored again.
+ */
+int dalloc_flush_clusters(struct rufs_fs *fs, struct inode *inode, struct page **pages, uint32_t n) {
+	ARENA_SCOPE;
+	char* buf = (char*)arena_alloc(CLUSTER_BLKS * BLOCK_SIZE);
+	int retval = 0;
+	uint32_t i = 0;
+	while(i < n){
+		uint32_t cl = pages[i]->lblk / CLUSTER_BLKS;
+		uint32_t j = i;
+		while(j < n && pages[j]->lblk / CLUSTER_BLKS == cl){
+			j++;
+		}
+		// A fully dirty cluster needs nothing from disk
+		if(j - i < CLUSTER_BLKS && cluster_load(fs, inode, cl, buf) == -1){
+			retval = -EIO;
+			break;
+		}
+		for(uint32_t k = i; k < j; k++){
+			memcpy(buf + (pages[k]->lblk % CLUSTER_BLKS) * BLOCK_SIZE, pages[k]->data, BLOCK_SIZE);
+		}
+		if((retval = cluster_store(fs, inode, cl, buf, 1)) < 0){
+			break;
+		}
+		for(; i < j; i++){
+			pages[i]->written = 1;
+		}
+	}
+	return retval;
+}
+
+/* 
+ * Write back the dirty pages of a log-structured inode (pages sorted by lblk). Every page,
+ * overwrites included, goes to a fresh block at the log head, so writeback is one sequential
+ * stream; the blocks the pages replace are freed once remapped.
+ */
+int dalloc_flush_log(struct rufs_fs *fs, struct inode *inode, struct page **pages, uint32_t n, int dedup) {
+	ARENA_SCOPE;
+	int* old = (int*)arena_alloc(n * sizeof(int));
+	int retval = 0;
+	uint32_t i = 0;
+	while(i < n && retval == 0){
+		int got = 0;
+		int start = log_alloc(fs, n - i, &got);
+		if(start == -1){
+			retval = -ENOSPC;
+			break;
+		}
+		int nold = 0;
+		for(int k = 0; k < got; k++, i++){
+			int ptr = bmap(fs, inode, pages[i]->lblk, 0);
+			bio_write(fs->dev, start + k, pages[i]->data);
+			if(bmap_set(fs, inode, pages[i]->lblk, start + k) == -1){
+				for(int r = k; r < got; r++){
+					old[nold++] = start + r;
+				}
+				retval = -ENOSPC;
+				break;
+			}
+			if(ptr > 0 && PTR_BLKNO(ptr) != 0){
+				old[nold++] = PTR_BLKNO(ptr);
+			}
+			else{
+				inode->blocks++;
+			}
+			if(dedup){
+				dedup_index(fs, start + k, pages[i]->data);
+			}
+			pages[i]->written = 1;
+		}
+		release_blocks(fs, old, nold);
+	}
+	return retval;
+}
+
+/* 
+ * Write back every dirty page of inode. Pages are sorted by logical block so each run
+ * of consecutive holes gets one contiguous extent from a single allocator call.
+ * Updates the block map in inode and writes it before evicting the pages it now maps.
+ * Caller holds the inode lock.
+ */
+int dalloc_flush(struct rufs_fs *fs, struct inode *inode) {
+	ARENA_SCOPE;
+	if(fs->dalloc_pages[inode->ino] == 0){
+		return 0;
+	}
+	// Step 1: Take the inode's pages under dalloc_lock. They stay hashed for readers and the
+	// inode lock keeps writers off them, so the writeback runs without the lock
+	pthread_mutex_lock(&fs->dalloc_lock);
+	uint32_t n = fs->dalloc_pages[inode->ino];
+	struct page** pages = (struct page**)arena_alloc(n * sizeof(struct page*));
+	struct page* pg = fs->dalloc_ino_list[inode->ino];
+	for(uint32_t i = 0; i < n; i++, pg = pg->ino_next){
+		pages[i] = pg;
+	}
+	fs->dalloc_busy[inode->ino] = 1;
+	pthread_mutex_unlock(&fs->dalloc_lock);
+	qsort(pages, n, sizeof(struct page*), page_cmp);
+
+	int retval = 0;
+	uint32_t i = 0;
+	int dedup = (inode->flags & INODE_DEDUP) && !(inode->flags & INODE_COMPRESS);
+	if(inode->flags & INODE_COMPRESS){
+		retval = dalloc_flush_clusters(fs, inode, pages, n);
+		i = n;
+	}
+	else if(dedup){
+		// Pages identical to an indexed block just take a reference to it
+		uint32_t kept = 0;
+		for(uint32_t k = 0; k < n; k++){
+			int ptr = bmap(fs, inode, pages[k]->lblk, 0);
+			int hit = dedup_lookup(fs, pages[k]->data, 0);
+			if(hit != 0 && bmap_set(fs, inode, pages[k]->lblk, hit) == 0){
+				if(ptr > 0){
+					int old = PTR_BLKNO(ptr);
+					release_blocks(fs, &old, 1);
+				}
+				else{
+					inode->blocks++;
+				}
+				pages[k]->written = 1;
+				continue;
+			}
+			if(hit != 0){
+				release_blocks(fs, &hit, 1);
+			}
+			pages[kept++] = pages[k];
+		}
+		n = kept;
+	}
+	if((inode->flags & INODE_LOG) && !(inode->flags & INODE_COMPRESS)){
+		retval = dalloc_flush_log(fs, inode, pages, n, dedup);
+		i = n;
+	}
+	uint32_t first = i;
+	int* ptrs = (int*)arena_alloc((n - first + 1) * sizeof(int));
+	char** bufs = (char**)arena_alloc((n - first + 1) * sizeof(char*));
+	int* blknos = (int*)arena_alloc((n - first + 1) * sizeof(int));
+	while(i < n){
+		// Step 2: Allocate one extent for the run of consecutive pages over holes
+		int ptr = bmap(fs, inode, pages[i]->lblk, 0);
+		if(ptr == 0){
+			uint32_t run = 1;
+			while(i + run < n && pages[i + run]->lblk == pages[i]->lblk + run && bmap(fs, inode, pages[i + run]->lblk, 0) == 0){
+				run++;
+			}
+			if(bmap_alloc_range(fs, inode, pages[i]->lblk, run, PTR_UNWRITTEN) == -1){
+				retval = -ENOSPC;
+				break;
+			}
+			ptr = bmap(fs, inode, pages[i]->lblk, 0);
+		}
+		ptrs[i - first] = ptr;
+		blknos[i - first] = PTR_BLKNO(ptr);
+		bufs[i - first] = pages[i]->data;
+		i++;
+	}
+	// Step 3: Write the pages across the I/O pool, then let the blocks read as data
+	io_blocks(fs, IO_WRITE, 1, blknos, bufs, i - first);
+	for(uint32_t k = first; k < i; k++){
+		if(ptrs[k - first] & PTR_UNWRITTEN){
+			bmap_set(fs, inode, pages[k]->lblk, blknos[k - first]);
+		}
+		if(dedup){
+			dedup_index(fs, blknos[k - first], pages[k]->data);
+		}
+		pages[k]->written = 1;
+	}
+	if(dedup){
+		fp_sync(fs);
+	}
+
+	// Step 4: Publish the new mapping before the pages go, so a reader that misses a page
+	// finds its block in the inode
+	writei(fs, inode->ino, inode);
+	pthread_mutex_lock(&fs->dalloc_lock);
+	pg = fs->dalloc_ino_list[inode->ino];
+	while(pg != NULL){
+		struct page* next = pg->ino_next;
+		if(pg->written){
+			dalloc_evict(fs, pg);
+		}
+		pg = next;
+	}
+	fs->dalloc_busy[inode->ino] = 0;
+	pthread_cond_broadcast(&fs->dalloc_cond);
+	pthread_mutex_unlock(&fs->dalloc_lock);
+	return retval;
+}
+
+/* 
+ * Write back dirty pages of an inode that is not already held in memory
+ */
+int dalloc_sync_ino(struct rufs_fs *fs, uint16_t ino) {
+	ARENA_SCOPE;
+	if(fs->dalloc_pages[ino] == 0){
+		return 0;
+	}
+	struct inode* inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	ilock(fs, ino);
+	readi(fs, ino, inode);
+	int retval = dalloc_flush(fs, inode);
+	iunlock(fs, ino);
+	return retval;
+}
+
+/* 
+ * Write back other inodes' dirty pages, in turn, until the cache is back under
+ * DALLOC_MAX_PAGES. Caller holds no inode lock.
+ */
+void dalloc_balance(struct rufs_fs *fs) {
+	for(int k = 0; k < MAX_INUM && fs->dalloc_total > DALLOC_MAX_PAGES; k++){
+		uint16_t ino = __atomic_fetch_add(&fs->dalloc_next, 1, __ATOMIC_RELAXED) % MAX_INUM;
+		dalloc_sync_ino(fs, ino);
+	}
+}
+
+
+/* 
+ * Make [dst_off, dst_off + len) of dst share the blocks behind [src_off, src_off + len) of
+ * src, taking a reference to each; later writes to either side copy first. Both inodes are
+ * written back, except a src read from a snapshot. Returns 0 or a negative errno.
+ */
+int clone_range(struct rufs_fs *fs, struct inode *src, struct inode *dst, off_t src_off, off_t dst_off, off_t len) {
+	// Step 1: Check the range, clamping it to the source's end of file
+	if(src_off < 0 || dst_off < 0 || len < 0 || src_off % BLOCK_SIZE != 0 || dst_off % BLOCK_SIZE != 0){
+		return -EINVAL;
+	}
+	if(src_off >= src->size){
+		return 0;
+	}
+	if(len == 0 || src_off + len > src->size){
+		len = src->size - src_off;
+	}
+	if(dst_off + len > fs->s_block_mem->max_file_size){
+		return -EFBIG;
+	}
+	if(len % BLOCK_SIZE != 0 && (src_off + len != src->size || dst_off + len < dst->size)){
+		/*a partial last block would zero the rest of the destination block*/
+		return -EINVAL;
+	}
+	int same = src->ino == dst->ino && !(src->flags & INODE_SNAP);
+	if(same && src_off < dst_off + len && dst_off < src_off + len){
+		return -EINVAL;
+	}
+	uint32_t nblks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t slblk = src_off / BLOCK_SIZE, dlblk = dst_off / BLOCK_SIZE;
+	if(src->flags & INODE_COMPRESS){
+		// Compressed clusters can only be shared whole, into another compressed file
+		if(!(dst->flags & INODE_COMPRESS)){
+			return -EOPNOTSUPP;
+		}
+		if(slblk % CLUSTER_BLKS != 0 || dlblk % CLUSTER_BLKS != 0 ||
+		   (nblks % CLUSTER_BLKS != 0 && (src_off + len != src->size || dst_off + len < dst->size))){
+			return -EINVAL;
+		}
+		nblks = (nblks + CLUSTER_BLKS - 1) / CLUSTER_BLKS * CLUSTER_BLKS;
+	}
+
+	// Step 2: Get both files' data onto disk and clear the destination range. A source in a
+	// snapshot is already complete and must not be written
+	if(!(src->flags & INODE_SNAP)){
+		dalloc_flush(fs, src);
+		writei(fs, src->ino, src);
+	}
+	if(same){
+		memcpy(dst, src, sizeof(struct inode));
+	}
+	dalloc_flush(fs, dst);
+	if(dst->flags & INODE_INLINE){
+		if(src->flags & INODE_INLINE){
+			/*nothing to share, the bytes fit in the inode*/
+			if(dst_off + len > INLINE_MAX && inline_spill(fs, dst) == -1){
+				return -ENOSPC;
+			}
+		}
+		else if(inline_spill(fs, dst) == -1){
+			return -ENOSPC;
+		}
+	}
+	if(src->flags & INODE_INLINE){
+		if(dst->flags & INODE_INLINE){
+			memcpy(dst->inline_data + dst_off, src->inline_data + src_off, len);
+		}
+		else{
+			// The bytes end the file, so the rest of their block is zeroed rather than kept.
+			// An unwritten block stops reading as zeros once they are on disk
+			char* block_buffer = (char*)blk_zget();
+			int ptr = bmap(fs, dst, dlblk, 1);
+			int blkno = ptr == -1 ? -1 : PTR_BLKNO(ptr);
+			if(blkno != -1 && !(ptr & PTR_UNWRITTEN)){
+				blkno = cow_block(fs, dst, dlblk, ptr, 0);
+			}
+			if(blkno == -1){
+				blk_put(block_buffer);
+				return -ENOSPC;
+			}
+			memcpy(block_buffer, src->inline_data + src_off, len);
+			bio_write(fs->dev, blkno, block_buffer);
+			bcache_forget(fs, blkno, 1);
+			if(ptr & PTR_UNWRITTEN){
+				bmap_set(fs, dst, dlblk, blkno);
+			}
+			blk_put(block_buffer);
+		}
+	}
+	else{
+		dalloc_drop(fs, dst->ino, dlblk);
+		punch_range(fs, dst, dst_off, (off_t)nblks * BLOCK_SIZE);
+
+		// Step 3: Share the source's blocks a pointer block at a time
+		int* ptrs = (int*)blk_get();
+		int* blks = (int*)blk_get();
+		char* block_buffer = (char*)blk_get();
+		uint32_t done = 0;
+		int retval = 0;
+		while(done < nblks){
+			int got = bmap_get_run(fs, src, slblk + done, nblks - done, ptrs);
+			if(got <= 0){
+				break;
+			}
+			// Unwritten blocks are not shared, they read as zeros anyway
+			int n = 0;
+			for(int k = 0; k < got; k++){
+				if(ptrs[k] & PTR_UNWRITTEN){
+					ptrs[k] = 0;
+				}
+				if(PTR_BLKNO(ptrs[k]) != 0){
+					blks[n++] = PTR_BLKNO(ptrs[k]);
+				}
+			}
+			ref_blocks(fs, blks, n);
+			for(int k = 0, b = 0; k < got && retval == 0; k++){
+				if(PTR_BLKNO(ptrs[k]) == 0){
+					continue;
+				}
+				if(blks[b] == 0){
+					/*reference count saturated: give the destination its own copy*/
+					int fresh = get_avail_blkno(fs);
+					if(fresh == -1){
+						retval = -ENOSPC;
+						break;
+					}
+					if(bio_read(fs->dev, PTR_BLKNO(ptrs[k]), block_buffer) < 0){
+						/*never carry a block that failed its checksum over under a new one*/
+						release_blocks(fs, &fresh, 1);
+						retval = -EIO;
+						break;
+					}
+					bio_write(fs->dev, fresh, block_buffer);
+					blks[b] = fresh;
+					ptrs[k] = fresh | (ptrs[k] & PTR_COMPRESSED);
+				}
+				b++;
+			}
+			if(retval == 0 && bmap_set_run(fs, dst, dlblk + done, got, ptrs) == -1){
+				// Unmap what was set before the failure; the paths to it exist now
+				memset(ptrs, 0, got * sizeof(int));
+				bmap_set_run(fs, dst, dlblk + done, got, ptrs);
+				retval = -ENOSPC;
+			}
+			if(retval != 0){
+				// Drop the references and copies this batch took, blks[k] is 0 where none was
+				int m = 0;
+				for(int k = 0; k < n; k++){
+					if(blks[k] != 0){
+						blks[m++] = blks[k];
+					}
+				}
+				release_blocks(fs, blks, m);
+				break;
+			}
+			dst->blocks += n;
+			done += got;
+		}
+		blk_put(block_buffer);
+		blk_put(blks);
+		blk_put(ptrs);
+		if(retval == 0 && done < nblks){
+			retval = -ENOSPC;
+		}
+		if(retval != 0){
+			writei(fs, dst->ino, dst);
+			return retval;
+		}
+	}
+
+	// Step 4: Update the destination's size and times
+	if(dst_off + len > dst->size){
+		dst->size = dst_off + len;
+	}
+	dst->mtime_ns = dst->ctime_ns = now_ns();
+	writei(fs, dst->ino, dst);
+	return 0;
+}
+
+
+/* 
+ * Unlinked inode reclamation
+ */
+int inode_blk_count(struct inode *inode) {
+	return inode->blocks;
+}
+
+/* 
+ * Free an unlinked inode and its data blocks. The inode is zeroed on disk before
+ * any bitmap bit is released, so a crash part way through can only leak blocks.
+ */
+int reclaim_inode(struct rufs_fs *fs, uint16_t ino) {
+	ARENA_SCOPE;
+	struct inode* inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	struct inode* cleared = (struct inode*)arena_zalloc(sizeof(struct inode));
+	ilock(fs, ino);
+	readi(fs, ino, inode);
+
+	// Step 1: Invalidate the on-disk inode, keeping the snapshot charge current
+	cleared->ino = ino;
+	cleared->snap_gen = inode->snap_gen;
+	writei(fs, ino, cleared);
+
+	// Step 2: Drop the references to every block the inode owned
+	if(inode->valid == 1){
+		release_tree(fs, inode);
+	}
+	iunlock(fs, ino);
+
+	// Step 3: Clear inode bitmap bit so the inode number can be reused, forgetting any
+	// entries cached for it as a directory
+	dcache_forget(fs, ino, NULL);
+	pthread_mutex_lock(&fs->alloc_lock);
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	bio_read(fs->dev, fs->s_block_mem->i_bitmap_blk, block_buffer);
+	unset_bitmap((bitmap_t)block_buffer, ino);
+	bio_write(fs->dev, fs->s_block_mem->i_bitmap_blk, block_buffer);
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	blk_put(block_buffer);
+	return 0;
+}
+
+/* 
+ * Remove ino from the superblock orphan list (caller holds alloc_lock)
+ */
+void orphan_del(struct rufs_fs *fs, uint16_t ino) {
+	for(int i = 0; i < fs->s_block_mem->orphan_cnt; i++){
+		if(fs->s_block_mem->orphans[i] == ino){
+			memmove(&fs->s_block_mem->orphans[i], &fs->s_block_mem->orphans[i + 1], (fs->s_block_mem->orphan_cnt - i - 1)*sizeof(uint16_t));
+			fs->s_block_mem->orphan_cnt--;
+			write_superblock(fs);
+			return;
+		}
+	}
+}
+
+/* 
+ * Release an inode whose link count dropped to zero. Small inodes are freed inline,
+ * larger ones are recorded in the on-disk orphan list and handed to the reclaim thread.
+ */
+int release_inode(struct rufs_fs *fs, struct inode *inode) {
+	dalloc_drop(fs, inode->ino, 0);
+	pthread_mutex_lock(&fs->alloc_lock);
+	if(inode_blk_count(inode) > RECLAIM_SYNC_BLKS && fs->reclaim_running && fs->s_block_mem->orphan_cnt < MAX_ORPHANS){
+		fs->s_block_mem->orphans[fs->s_block_mem->orphan_cnt++] = inode->ino;
+		write_superblock(fs);
+		pthread_cond_signal(&fs->reclaim_cond);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return reclaim_inode(fs, inode->ino);
+}
+
+/* An orphan reclaimed by a pool worker */
+struct reclaim_task {
+	struct rufs_fs *fs;
+	uint16_t ino;
+};
+
+static void reclaim_task_run(void *arg) {
+	struct reclaim_task* t = (struct reclaim_task*)arg;
+	reclaim_inode(t->fs, t->ino);
+}
+
+static void *reclaim_worker(void *arg) {
+	struct rufs_fs* fs = (struct rufs_fs*)arg;
+	pthread_mutex_lock(&fs->alloc_lock);
+	while(1){
+		while(fs->s_block_mem->orphan_cnt == 0 && !fs->reclaim_stop){
+			pthread_cond_wait(&fs->reclaim_cond, &fs->alloc_lock);
+		}
+		if(fs->reclaim_stop){
+			break;
+		}
+		// Oldest orphans first, up to one per pool worker at a time; they stay on the on-disk
+		// list until fully reclaimed
+		uint16_t inos[IO_WORKERS];
+		int n = fs->s_block_mem->orphan_cnt < IO_WORKERS ? fs->s_block_mem->orphan_cnt : IO_WORKERS;
+		memcpy(inos, fs->s_block_mem->orphans, n * sizeof(uint16_t));
+		pthread_mutex_unlock(&fs->alloc_lock);
+		struct io_group g;
+		io_group_init(&g);
+		struct reclaim_task tasks[IO_WORKERS];
+		for(int k = 0; k < n; k++){
+			tasks[k].fs = fs;
+			tasks[k].ino = inos[k];
+			io_submit(fs, &g, IO_RECLAIM, reclaim_task_run, &tasks[k]);
+		}
+		io_wait(&g);
+		pthread_mutex_lock(&fs->alloc_lock);
+		for(int k = 0; k < n; k++){
+			orphan_del(fs, inos[k]);
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return NULL;
+}
+
+/* 
+ * Start the reclaim thread; orphans left over from a previous mount are picked up immediately
+ */
+void reclaim_start(struct rufs_fs *fs) {
+	fs->reclaim_stop = 0;
+	if(pthread_create(&fs->reclaim_thread, NULL, reclaim_worker, fs) == 0){
+		fs->reclaim_running = 1;
+	}
+}
+
+/* 
+ * Stop the reclaim thread. Pending orphans remain on disk for the next mount.
+ */
+void reclaim_shutdown(struct rufs_fs *fs) {
+	if(!fs->reclaim_running){
+		return;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->reclaim_stop = 1;
+	pthread_cond_broadcast(&fs->reclaim_cond);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_join(fs->reclaim_thread, NULL);
+	fs->reclaim_running = 0;
+}
+
+/* 
+ * Whether the pointers of inode's block lblk sit in an indirect block shared with a snapshot
+ * or clone, so they cannot be changed without copying it
+ */
+static int map_shared(struct rufs_fs *fs, struct inode *inode, uint32_t lblk) {
+	int iblk, idx;
+	return bmap_slot(fs, inode, lblk, BMAP_LOOKUP, &iblk, &idx) == 0 && iblk != 0 &&
+		(blk_shared(fs, iblk) || (lblk >= NUM_DPTRS + NUM_IPTRS * PTRS_PER_BLK && blk_shared(fs, inode->dindirect_ptr)));
+}
+
+/* 
+ * Add the blocks of log-structured inode ino that log_relocate() could move to the count of
+ * the segment each sits in
+ */
+static void log_movable(struct rufs_fs *fs, uint16_t ino, int *movable) {
+	ARENA_SCOPE;
+	struct inode* inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	int* ptrs = (int*)blk_get();
+	ilock(fs, ino);
+	readi(fs, ino, inode);
+	if(inode->valid && S_ISREG(inode->type) && (inode->flags & INODE_LOG) && !(inode->flags & INODE_INLINE)){
+		uint32_t nblk = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		for(uint32_t lblk = 0; lblk < nblk;){
+			int n = bmap_get_run(fs, inode, lblk, nblk - lblk, ptrs);
+			if(n <= 0){
+				break;
+			}
+			for(int k = 0; k < n && !map_shared(fs, inode, lblk); k++){
+				int blkno = PTR_BLKNO(ptrs[k]);
+				if(blkno != 0 && !blk_shared(fs, blkno)){
+					movable[(blkno - fs->s_block_mem->d_start_blk) / SEG_BLKS]++;
+				}
+			}
+			lblk += n;
+		}
+	}
+	iunlock(fs, ino);
+	blk_put(ptrs);
+}
+
+/* 
+ * Move the live blocks of log-structured inode ino that sit in a victim segment to the log
+ * head. Blocks still shared with a snapshot or clone are left, moving them frees nothing.
+ * Returns the number of blocks moved.
+ */
+int log_relocate(struct rufs_fs *fs, uint16_t ino, const char *victim) {
+	ARENA_SCOPE;
+	struct inode* inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	char* block_buffer = (char*)blk_get();
+	int* ptrs = (int*)blk_get();
+	int* old = NULL;
+	int moved = 0, full = 0;
+	ilock(fs, ino);
+	readi(fs, ino, inode);
+	if(inode->valid && S_ISREG(inode->type) && (inode->flags & INODE_LOG) && !(inode->flags & INODE_INLINE)){
+		uint32_t nblk = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		old = (int*)arena_zalloc((nblk + 1) * sizeof(int));
+		for(uint32_t lblk = 0; lblk < nblk && !full;){
+			// Step 1: Read the pointers held by one indirect block (or the inode), skipping
+			// groups reached through a shared indirect block
+			int n = bmap_get_run(fs, inode, lblk, nblk - lblk, ptrs);
+			if(n <= 0){
+				break;
+			}
+			if(map_shared(fs, inode, lblk)){
+				lblk += n;
+				continue;
+			}
+
+			// Step 2: Copy each block in a victim segment to the head and remap it
+			for(int k = 0; k < n; k++){
+				int blkno = PTR_BLKNO(ptrs[k]);
+				if(blkno == 0 || !victim[(blkno - fs->s_block_mem->d_start_blk) / SEG_BLKS] || blk_shared(fs, blkno) ||
+				   bio_read(fs->dev, blkno, block_buffer) < 0){
+					continue;
+				}
+				int got = 0;
+				int fresh = log_alloc(fs, 1, &got);
+				if(fresh != -1 && victim[(fresh - fs->s_block_mem->d_start_blk) / SEG_BLKS]){
+					/*No clean segment to move into*/
+					release_blocks(fs, &fresh, 1);
+					fresh = -1;
+				}
+				if(fresh == -1){
+					full = 1;
+					break;
+				}
+				bio_write(fs->dev, fresh, block_buffer);
+				if(bmap_set(fs, inode, lblk + k, fresh | (ptrs[k] & (PTR_UNWRITTEN | PTR_COMPRESSED))) == -1){
+					release_blocks(fs, &fresh, 1);
+					full = 1;
+					break;
+				}
+				if((inode->flags & INODE_DEDUP) && !(ptrs[k] & PTR_COMPRESSED)){
+					dedup_index(fs, fresh, block_buffer);
+				}
+				old[moved++] = blkno;
+			}
+			lblk += n;
+		}
+		// Step 3: Publish the new map, then free the old blocks once readers are done with them
+		if(moved > 0){
+			writei(fs, ino, inode);
+			release_moved(fs, old, moved);
+		}
+	}
+	iunlock(fs, ino);
+	blk_put(ptrs);
+	blk_put(block_buffer);
+	return moved;
+}
+
+/* 
+ * Fill inos with the inode numbers of the log-structured files, returns how many there are
+ */
+static int log_files(struct rufs_fs *fs, uint16_t *inos) {
+	char* block_buffer = (char*)blk_get();
+	int n = 0;
+	for(uint32_t b = 0; b < ITABLE_BLKS; b++){
+		pthread_mutex_lock(&fs->itable_lock);
+		char* cur = itable_get(fs, b);
+		if(cur != NULL){
+			memcpy(block_buffer, cur, BLOCK_SIZE);
+		}
+		pthread_mutex_unlock(&fs->itable_lock);
+		if(cur == NULL){
+			continue;
+		}
+		for(uint32_t k = 0; k < fs->s_block_mem->inodes_per_blk; k++){
+			struct inode* inode = (struct inode*)block_buffer + k;
+			if(inode->valid && S_ISREG(inode->type) && (inode->flags & INODE_LOG)){
+				inos[n++] = b * fs->s_block_mem->inodes_per_blk + k;
+			}
+		}
+	}
+	blk_put(block_buffer);
+	return n;
+}
+
+/* 
+ * One pass of the segment cleaner: when fewer than LOG_MIN_CLEAN segments are clean, pick
+ * the emptiest ones that moving log-file blocks can empty and move those blocks out of
+ * them. Returns the number of blocks moved.
+ */
+int log_clean(struct rufs_fs *fs) {
+	int nseg = (fs->s_block_mem->max_dnum + SEG_BLKS - 1) / SEG_BLKS;
+	char* victim = (char*)calloc(nseg, sizeof(char));
+	int* live = (int*)malloc(nseg * sizeof(int));
+	int* movable = (int*)calloc(nseg, sizeof(int));
+	uint16_t* inos = (uint16_t*)malloc(MAX_INUM * sizeof(uint16_t));
+
+	// Step 1: Count clean segments, nothing to do with enough of them
+	pthread_mutex_lock(&fs->alloc_lock);
+	int clean = 0, picks = 0, nfiles = 0;
+	for(int seg = 0; seg < nseg; seg++){
+		clean += seg_live(fs, seg, NULL) == 0;
+	}
+	int needed = fs->s_block_mem->log_head != 0 && clean < LOG_MIN_CLEAN;
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	// Step 2: Count the blocks of log-structured files the cleaner could move out of each segment
+	if(needed){
+		nfiles = log_files(fs, inos);
+		for(int i = 0; i < nfiles; i++){
+			log_movable(fs, inos[i], movable);
+		}
+	}
+
+	// Step 3: Pick victims, least live first, among segments holding nothing but movable blocks
+	// and never the segment the head is filling
+	pthread_mutex_lock(&fs->alloc_lock);
+	int head_seg = fs->s_block_mem->log_head == 0 ? -1 : (int)(fs->s_block_mem->log_head - 1) / SEG_BLKS;
+	for(int seg = 0; seg < nseg; seg++){
+		live[seg] = seg_live(fs, seg, NULL);
+	}
+	while(needed && clean + picks < LOG_MIN_CLEAN){
+		int best = -1;
+		for(int seg = 0; seg < nseg; seg++){
+			if(seg != head_seg && !victim[seg] && live[seg] > 0 && live[seg] <= LOG_CLEAN_LIVE && live[seg] == movable[seg] &&
+			   (best == -1 || live[seg] < live[best])){
+				best = seg;
+			}
+		}
+		if(best == -1){
+			break;
+		}
+		victim[best] = 1;
+		picks++;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	// Step 4: Move the victims' blocks to the log head
+	int moved = 0;
+	if(picks > 0){
+		for(int i = 0; i < nfiles; i++){
+			moved += log_relocate(fs, inos[i], victim);
+		}
+
+		pthread_mutex_lock(&fs->alloc_lock);
+		for(int seg = 0; seg < nseg; seg++){
+			if(victim[seg] && seg_live(fs, seg, NULL) == 0){
+				fs->stats.log_cleaned++;
+			}
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+		__atomic_fetch_add(&fs->stats.log_moved, moved, __ATOMIC_RELAXED);
+	}
+	free(inos);
+	free(movable);
+	free(live);
+	free(victim);
+	return moved;
+}
+
+static void *cleaner_worker(void *arg) {
+	struct rufs_fs* fs = (struct rufs_fs*)arg;
+	pthread_mutex_lock(&fs->alloc_lock);
+	while(1){
+		while(!fs->cleaner_kick && !fs->cleaner_stop){
+			pthread_cond_wait(&fs->cleaner_cond, &fs->alloc_lock);
+		}
+		if(fs->cleaner_stop){
+			break;
+		}
+		fs->cleaner_kick = 0;
+		pthread_mutex_unlock(&fs->alloc_lock);
+		log_clean(fs);
+		pthread_mutex_lock(&fs->alloc_lock);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return NULL;
+}
+
+/* 
+ * Start the segment cleaner; it sleeps until the log head runs short of clean segments
+ */
+void cleaner_start(struct rufs_fs *fs) {
+	fs->cleaner_stop = 0;
+	fs->cleaner_kick = 0;
+	if(pthread_create(&fs->cleaner_thread, NULL, cleaner_worker, fs) == 0){
+		fs->cleaner_running = 1;
+	}
+}
 
 /* 
- * Get available inode number from bitmap
+ * Stop the segment cleaner, waiting for a pass in progress
  */
-int get_avail_ino() {
-	bitmap_t i_bm  = (bitmap_t)malloc((s_block_mem->max_inum/8)*sizeof(char));
-	memset(i_bm, 0, (s_block_mem->max_inum/8)*sizeof(char));
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
-	memset(block_buffer, 0, BLOCK_SIZE);
-	// Step 1: Read inode bitmap from disk
-	bio_read(s_block_mem->i_bitmap_blk, block_buffer);
-	memcpy(i_bm, block_buffer, (s_block_mem->max_inum/8)*sizeof(char));
+void cleaner_shutdown(struct rufs_fs *fs) {
+	if(!fs->cleaner_running){
+		return;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->cleaner_stop = 1;
+	pthread_cond_broadcast(&fs->cleaner_cond);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_join(fs->cleaner_thread, NULL);
+	fs->cleaner_running = 0;
+}
 
-	// Step 2: Traverse inode bitmap to find an available slot
-	for(int i = 0; i < s_block_mem->max_inum; i++){
-		if(get_bitmap(i_bm, i) == 0){
-			// Step 3: Update inode bitmap and write to disk 
-			set_bitmap(i_bm, i);
-			memcpy(block_buffer, i_bm, (s_block_mem->max_inum/8)*sizeof(char));
-			bio_write(s_block_mem->i_bitmap_blk, block_buffer);
-			free(block_buffer);
-			return i;
+
+/* 
+ * online defragmentation
+ */
+
+/* 
+ * Count the mapped blocks among n block pointers and how many of them do not directly
+ * follow the previous mapped block on disk
+ */
+static int frag_breaks(const int *ptrs, uint32_t n, int *mapped) {
+	int breaks = 0, prev = 0;
+	*mapped = 0;
+	for(uint32_t k = 0; k < n; k++){
+		int blkno = PTR_BLKNO(ptrs[k]);
+		if(blkno == 0){
+			continue;
+		}
+		if(prev != 0 && blkno != prev + 1){
+			breaks++;
 		}
+		prev = blkno;
+		(*mapped)++;
 	}
+	return breaks;
+}
 
-	free(block_buffer);
-	free(i_bm);
-	return -1;
+/* 
+ * Flush inode's delayed pages so every block is in place and read its whole block map, *nblk
+ * pointers. *movable is cleared if a data or indirect block is shared with a snapshot or
+ * clone, or is compressed, so the blocks cannot be moved by rewriting the map. Caller holds
+ * the inode lock and frees the array.
+ */
+static int* file_ptrs(struct rufs_fs *fs, struct inode *inode, uint32_t *nblk, int *movable) {
+	if(fs->dalloc_pages[inode->ino] > 0){
+		dalloc_flush(fs, inode);
+		writei(fs, inode->ino, inode);
+	}
+	*nblk = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int* ptrs = (int*)calloc(*nblk + 1, sizeof(int));
+	*movable = 1;
+	for(uint32_t lblk = 0; lblk < *nblk;){
+		int n = bmap_get_run(fs, inode, lblk, *nblk - lblk, ptrs + lblk);
+		if(n <= 0){
+			break;
+		}
+		if(map_shared(fs, inode, lblk)){
+			*movable = 0;
+		}
+		for(int k = 0; k < n && *movable; k++){
+			*movable = !(ptrs[lblk + k] & PTR_COMPRESSED) && (PTR_BLKNO(ptrs[lblk + k]) == 0 || !blk_shared(fs, PTR_BLKNO(ptrs[lblk + k])));
+		}
+		lblk += n;
+	}
+	return ptrs;
 }
 
 /* 
- * Get available data block number from bitmap
+ * Move the first n mapped blocks of ptrs that pick selects, or of all of them if pick is
+ * NULL, into the run of n blocks from start. The copies are written a batch at a time,
+ * taking what the block cache holds and reading the rest across the I/O pool; unwritten
+ * blocks need no copy. The block map is then switched over and the old blocks freed once
+ * in-flight reads are done. On failure the run is freed and -1 returned. Caller holds the
+ * inode lock.
  */
-int get_avail_blkno() {
-	bitmap_t d_bm = (bitmap_t)malloc((s_block_mem->max_dnum/8)*sizeof(char));
-	memset(d_bm, 0, (s_block_mem->max_dnum/8)*sizeof(char));
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
-	memset(block_buffer, 0, BLOCK_SIZE);
-	// Step 1: Read data block bitmap from disk
-	bio_read(s_block_mem->d_bitmap_blk, block_buffer);
-	memcpy(d_bm, block_buffer, (s_block_mem->max_dnum/8)*sizeof(char));
+static int move_blocks(struct rufs_fs *fs, struct inode *inode, int *ptrs, uint32_t nblk, const char *pick, int start, int n, int cls) {
+	ARENA_SCOPE;
+	char* copy = (char*)arena_alloc(DEFRAG_BATCH * BLOCK_SIZE);
+	char* bufs[DEFRAG_BATCH];
+	char* rbufs[DEFRAG_BATCH];
+	int rd[DEFRAG_BATCH], wr[DEFRAG_BATCH];
+	int* old = (int*)arena_alloc(n * sizeof(int));
+	uint64_t gen = bcache_snapshot(fs);
+	int m = 0, err = 0;
+	for(uint32_t k = 0; k < nblk && m < n && !err;){
+		int nrd = 0, nwr = 0;
+		for(; k < nblk && m < n && nwr < DEFRAG_BATCH; k++){
+			int blkno = PTR_BLKNO(ptrs[k]);
+			if(blkno == 0 || (pick != NULL && !pick[k])){
+				continue;
+			}
+			if(!(ptrs[k] & PTR_UNWRITTEN)){
+				bufs[nwr] = copy + nwr * BLOCK_SIZE;
+				if(!bcache_read(fs, blkno, BCACHE_RAW, bufs[nwr], 0, BLOCK_SIZE)){
+					rd[nrd] = blkno;
+					rbufs[nrd++] = bufs[nwr];
+				}
+				wr[nwr++] = start + m;
+			}
+			old[m] = blkno;
+			ptrs[k] = (start + m) | (ptrs[k] & PTR_UNWRITTEN);
+			fs->blk_heat[start + m - fs->s_block_mem->d_start_blk] = __atomic_load_n(&fs->blk_heat[blkno - fs->s_block_mem->d_start_blk], __ATOMIC_RELAXED);
+			m++;
+		}
+		if(io_blocks(fs, cls, 0, rd, rbufs, nrd) == -1){
+			err = 1;
+			break;
+		}
+		io_blocks(fs, cls, 1, wr, bufs, nwr);
+		for(int b = 0; b < nwr; b++){
+			bcache_fill(fs, wr[b], BCACHE_RAW, bufs[b], gen);
+			if(inode->flags & INODE_DEDUP){
+				dedup_index(fs, wr[b], bufs[b]);
+			}
+		}
+	}
 
-	// Step 2: Traverse data block bitmap to find an available slot
-	for(int i = 0; i < s_block_mem->max_dnum; i++){ 
-		if(get_bitmap(d_bm, i) == 0){
-			// Step 3: Update data block bitmap and write to disk 
-			set_bitmap(d_bm, i);
-			memcpy(block_buffer, d_bm, (s_block_mem->max_dnum/8)*sizeof(char));
-			bio_write(s_block_mem->d_bitmap_blk, block_buffer);
-			free(block_buffer);
-			s_block_mem->total_blocks_alloc++;
-			return s_block_mem->d_start_blk + i;
+	if(err || bmap_set_run(fs, inode, 0, nblk, ptrs) == -1){
+		for(int k = 0; k < n; k++){
+			int blkno = start + k;
+			release_blocks(fs, &blkno, 1);
 		}
+		m = -1;
 	}
+	else{
+		writei(fs, inode->ino, inode);
+		release_moved(fs, old, m);
+	}
+	return m;
+}
 
-	free(block_buffer);
-	free(d_bm);
+/* 
+ * Smallest inode number from ino on that is a valid regular file, -1 if there is none
+ */
+int next_file(struct rufs_fs *fs, int ino) {
+	for(; ino < MAX_INUM; ino++){
+		pthread_mutex_lock(&fs->itable_lock);
+		char* cur = itable_get(fs, ino / fs->s_block_mem->inodes_per_blk);
+		struct inode* inode = cur != NULL ? (struct inode*)cur + ino % fs->s_block_mem->inodes_per_blk : NULL;
+		int found = inode != NULL && inode->valid && S_ISREG(inode->type);
+		pthread_mutex_unlock(&fs->itable_lock);
+		if(found){
+			return ino;
+		}
+	}
 	return -1;
 }
 
 /* 
- * inode operations
+ * Rewrite the data blocks of regular file ino into one contiguous extent near its inode if
+ * they are fragmented. The copies are written first and the block map is switched over
+ * under the inode lock before the old blocks are freed. Inline and compressed files, and
+ * files with blocks shared with a snapshot or clone, are left alone. Adds to *t and returns
+ * the number of blocks moved.
  */
-int readi(uint16_t ino, struct inode *inode) {
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
-	memset(block_buffer, 0, BLOCK_SIZE);
-  // Step 1: Get the inode's on-disk block number
-  	uint16_t blk = ((ino * sizeof(struct inode)) / BLOCK_SIZE) + s_block_mem->i_start_blk; 
-  // Step 2: Get offset of the inode in the inode on-disk block
-  	uint16_t idx = ino % s_block_mem->inodes_per_blk;
+int defrag_inode(struct rufs_fs *fs, uint16_t ino, struct defrag_tally *t) {
+	ARENA_SCOPE;
+	struct inode* inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	ilock(fs, ino);
+	readi(fs, ino, inode);
+	if(!inode->valid || !S_ISREG(inode->type) || (inode->flags & (INODE_INLINE | INODE_COMPRESS))){
+		iunlock(fs, ino);
+		return 0;
+	}
 
-  // Step 3: Read the block from disk and then copy into inode structure
-	bio_read(blk, block_buffer);
-	memcpy((void*)inode, (void*)block_buffer + (idx*sizeof(struct inode)), sizeof(struct inode));
+	// Step 1: Read the whole block map and score it
+	uint32_t nblk;
+	int movable;
+	int* ptrs = file_ptrs(fs, inode, &nblk, &movable);
+	int mapped;
+	int breaks = frag_breaks(ptrs, nblk, &mapped);
+	t->steps += mapped > 1 ? mapped - 1 : 0;
+	t->before += breaks;
 
-	free(block_buffer);
-	return 0;
+	// Step 2: Take one free run for the whole file, or give up on it
+	int got = 0;
+	int start = (breaks > 0 && movable) ? get_avail_blkrange(fs, inode_goal(fs, inode), mapped, &got) : -1;
+	if(start != -1 && got < mapped){
+		for(int k = 0; k < got; k++){
+			int blkno = start + k;
+			release_blocks(fs, &blkno, 1);
+		}
+		start = -1;
+	}
+
+	// Step 3: Copy the blocks into the run and switch the block map over
+	int m = start != -1 ? move_blocks(fs, inode, ptrs, nblk, NULL, start, mapped, IO_DEFRAG) : -1;
+	if(m == -1){
+		t->after += breaks;
+		m = 0;
+	}
+	else{
+		t->files++;
+		t->blocks += m;
+		__atomic_fetch_add(&fs->stats.defrag_blocks, m, __ATOMIC_RELAXED);
+	}
+	iunlock(fs, ino);
+	free(ptrs);
+	return m;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
-	memset(block_buffer, 0, BLOCK_SIZE);
-	// Step 1: Get the block number where this inode resides on disk
-	uint16_t blk = ((ino * sizeof(struct inode)) / BLOCK_SIZE) + s_block_mem->i_start_blk; 
-	
-	// Step 2: Get the offset in the block where this inode resides on disk
-	uint16_t idx = ino % s_block_mem->inodes_per_blk;
+/* 
+ * Defragment every regular file, one inode at a time
+ */
+void defrag_all(struct rufs_fs *fs, struct defrag_tally *t) {
+	for(int ino = next_file(fs, 0); ino != -1; ino = next_file(fs, ino + 1)){
+		defrag_inode(fs, ino, t);
+	}
+}
 
-	// Step 3: Write inode to disk 
-	bio_read(blk, block_buffer);
-	memcpy((void*)block_buffer + (idx*sizeof(struct inode)), (void*)inode, sizeof(struct inode));
-	bio_write(blk, block_buffer);
+/* 
+ * tiered storage
+ */
 
-	free(block_buffer);
-	return 0;
+/* 
+ * First block of group g's slice of the slow tier, where its cold blocks are moved
+ */
+int slow_goal(struct rufs_fs *fs, int g) {
+	return fs->s_block_mem->d_start_blk + fs->tier_dnum + (int)((int64_t)(fs->s_block_mem->max_dnum - fs->tier_dnum) * g / GROUPS);
 }
 
+/* 
+ * Move regular file ino's cold blocks off the fast tier (to_slow) or its hot blocks onto
+ * it, at most want of them, in one run near its group's slice of the other tier. Files the
+ * defragmenter would leave alone are left alone. Returns the number of blocks moved.
+ */
+int tier_inode(struct rufs_fs *fs, uint16_t ino, int to_slow, int want) {
+	ARENA_SCOPE;
+	struct inode* inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	ilock(fs, ino);
+	readi(fs, ino, inode);
+	if(!inode->valid || !S_ISREG(inode->type) || (inode->flags & (INODE_INLINE | INODE_COMPRESS))){
+		iunlock(fs, ino);
+		return 0;
+	}
+
+	// Step 1: Pick the blocks on the wrong tier for their heat
+	uint32_t nblk;
+	int movable;
+	int* ptrs = file_ptrs(fs, inode, &nblk, &movable);
+	char* pick = (char*)arena_zalloc(nblk + 1);
+	int n = 0;
+	for(uint32_t k = 0; k < nblk && movable && n < want; k++){
+		int i = PTR_BLKNO(ptrs[k]) - fs->s_block_mem->d_start_blk;
+		if(PTR_BLKNO(ptrs[k]) == 0 || (ptrs[k] & PTR_UNWRITTEN)){
+			continue;
+		}
+		if(to_slow ? (i < fs->tier_dnum && fs->blk_heat[i] == 0) : (i >= fs->tier_dnum && fs->blk_heat[i] >= TIER_HOT)){
+			pick[k] = 1;
+			n++;
+		}
+	}
+
+	// Step 2: Take a run on the other tier; a search that wrapped back to this tier is given up
+	int got = 0;
+	int goal = to_slow ? slow_goal(fs, ino_group(fs, ino)) : group_goal(fs, ino_group(fs, ino));
+	int start = n > 0 ? get_avail_blkrange(fs, goal, n, &got) : -1;
+	if(start != -1 && (start - fs->s_block_mem->d_start_blk < fs->tier_dnum) == to_slow){
+		for(int k = 0; k < got; k++){
+			int blkno = start + k;
+			release_blocks(fs, &blkno, 1);
+		}
+		start = -1;
+	}
+	for(; start != -1 && !to_slow && start + got - fs->s_block_mem->d_start_blk > fs->tier_dnum; got--){
+		/*Promoting, keep only the part of the run on the fast tier*/
+		int blkno = start + got - 1;
+		release_blocks(fs, &blkno, 1);
+	}
+
+	// Step 3: Copy the picked blocks into it and switch the block map over
+	int m = start != -1 ? move_blocks(fs, inode, ptrs, nblk, pick, start, got, IO_TIER) : -1;
+	m = m < 0 ? 0 : m;
+	__atomic_fetch_add(to_slow ? &fs->stats.tier_demoted : &fs->stats.tier_promoted, m, __ATOMIC_RELAXED);
+	iunlock(fs, ino);
+	free(ptrs);
+	return m;
+}
+
+/* 
+ * Free data blocks on the fast tier
+ */
+int fast_free_blks(struct rufs_fs *fs) {
+	int n = 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(int i = 0; i < fs->tier_dnum; i++){
+		n += fs->refcnt[i] == 0;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return n;
+}
+
+/* 
+ * One migrator pass: demote cold blocks until TIER_FREE_PCT of the fast tier is free, then
+ * promote hot ones into what is free beyond that, then halve every block's heat
+ */
+void tier_pass(struct rufs_fs *fs) {
+	int reserve = fs->tier_dnum * TIER_FREE_PCT / 100;
+	int fast_free = fast_free_blks(fs);
+	for(int ino = next_file(fs, 0); ino != -1 && fast_free < reserve; ino = next_file(fs, ino + 1)){
+		fast_free += tier_inode(fs, ino, 1, reserve - fast_free);
+	}
+	for(int ino = next_file(fs, 0); ino != -1 && fast_free > reserve; ino = next_file(fs, ino + 1)){
+		fast_free -= tier_inode(fs, ino, 0, fast_free - reserve);
+	}
+	for(int i = 0; i < fs->s_block_mem->max_dnum; i++){
+		__atomic_store_n(&fs->blk_heat[i], __atomic_load_n(&fs->blk_heat[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *tier_worker(void *arg) {
+	struct rufs_fs* fs = (struct rufs_fs*)arg;
+	pthread_mutex_lock(&fs->alloc_lock);
+	while(!fs->tier_stop){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += TIER_SCAN_SECS;
+		pthread_cond_timedwait(&fs->tier_cond, &fs->alloc_lock, &ts);
+		if(fs->tier_stop){
+			break;
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+		tier_pass(fs);
+		pthread_mutex_lock(&fs->alloc_lock);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return NULL;
+}
+
+/* 
+ * Start the migrator if the device is tiered; it runs a pass every TIER_SCAN_SECS
+ */
+void tier_start(struct rufs_fs *fs) {
+	fs->tier_stop = 0;
+	if(fs->tier_dnum > 0 && pthread_create(&fs->tier_thread, NULL, tier_worker, fs) == 0){
+		fs->tier_running = 1;
+	}
+}
+
+/* 
+ * Stop the migrator, waiting for a pass in progress
+ */
+void tier_shutdown(struct rufs_fs *fs) {
+	if(!fs->tier_running){
+		return;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->tier_stop = 1;
+	pthread_cond_broadcast(&fs->tier_cond);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_join(fs->tier_thread, NULL);
+	fs->tier_running = 0;
+}
 
 /* 
  * directory operations
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
+
+/* 
+ * Make directory block i of dir_inode safe to overwrite: a block still shared with a
+ * snapshot is swapped for a private one, which the caller then writes in full. Caller
+ * writes the inode. Returns -1 if the disk is full.
+ */
+int dir_block_w(struct rufs_fs *fs, struct inode *dir_inode, int i) {
+	int blkno = cow_block(fs, dir_inode, i, dir_inode->direct_ptr[i], 0);
+	return blkno == -1 ? -1 : 0;
+}
+
+/* 
+ * Look fname up in the directory held in curr_inode, which may come from a snapshot
+ */
+int dir_scan(struct rufs_fs *fs, struct inode *curr_inode, const char *fname, struct dirent *dirent) {
+	ARENA_SCOPE;
+	char* block_buffer = (char*)blk_get();
 	memset(block_buffer, 0, BLOCK_SIZE);
-	struct inode* curr_inode = (struct inode*)malloc(sizeof(struct inode));
-	memset(curr_inode, 0, sizeof(struct inode));
-	struct dirent* curr_dirent = (struct dirent*)malloc(sizeof(struct dirent));
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
 	memset(curr_dirent, 0, sizeof(struct dirent));
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-  	readi(ino, curr_inode);
 
   // Step 2: Get data block of current directory from inode
   // Step 3: Read directory's data block and check each directory entry.
   //If the name matches, then copy directory entry to dirent structure
 	for(int i = 0; i < NUM_DPTRS; i++){
 		if(curr_inode->direct_ptr[i] != 0){
-			bio_read(curr_inode->direct_ptr[i], block_buffer);
-			for(int j = 0; j < s_block_mem->dirents_per_blk; j++){
+			bio_read(fs->dev, curr_inode->direct_ptr[i], block_buffer);
+			for(int j = 0; j < fs->s_block_mem->dirents_per_blk; j++){
 				memcpy((void*)curr_dirent, (void*)block_buffer + (j*sizeof(struct dirent)), sizeof(struct dirent));
 				if(curr_dirent->valid == 1 && strcmp(fname, curr_dirent->name) == 0){
                 	memcpy(dirent, curr_dirent, sizeof(struct dirent));
 					memset(block_buffer, 0, BLOCK_SIZE);
-					free(curr_inode);
-					free(curr_dirent);
-					free(block_buffer);
+					blk_put(block_buffer);
 					return 0;
             	}
 			}
 			memset(block_buffer, 0, BLOCK_SIZE);
 		}
 	}
-	free(curr_inode);
-	free(curr_dirent);
-	free(block_buffer);
+	blk_put(block_buffer);
 	return -1;
 }
 
-int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+int dir_find(struct rufs_fs *fs, uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	ARENA_SCOPE;
+	// Step 0: Entries looked up or listed before come from the dentry cache
+	uint16_t hit;
+	if(dcache_lookup(fs, ino, fname, &hit)){
+		memset(dirent, 0, sizeof(struct dirent));
+		dirent->ino = hit;
+		dirent->valid = 1;
+		strcpy(dirent->name, fname);
+		dirent->len = strlen(fname);
+		return 0;
+	}
+	uint64_t gen = dcache_snapshot(fs);
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	memset(curr_inode, 0, sizeof(struct inode));
+  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+  	readi(fs, ino, curr_inode);
+	int retval = dir_scan(fs, curr_inode, fname, dirent);
+	if(retval == 0){
+		dcache_add(fs, ino, fname, dirent->ino, gen);
+	}
+	return retval;
+}
+
+int dir_add(struct rufs_fs *fs, struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	ARENA_SCOPE;
 	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
 	// Step 2: Check if fname (directory name) is already used in other entries
 	// Step 3: Add directory entry in dir_inode's data block and write to disk
 	// Allocate a new data block for this directory if it does not exist
 	// Update directory inode
 	// Write directory entry
-	struct dirent* curr_dirent = (struct dirent*)malloc(sizeof(struct dirent));
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
 	memset(curr_dirent, 0, sizeof(struct dirent));
-	if(dir_find(dir_inode->ino, fname, name_len, curr_dirent) == -1){
-		char* block_buffer = (char*)malloc(BLOCK_SIZE);
+	if(dir_find(fs, dir_inode->ino, fname, name_len, curr_dirent) == -1){
+		char* block_buffer = (char*)blk_get();
 		memset(block_buffer, 0, BLOCK_SIZE);
 		for(int i = 0; i < NUM_DPTRS; i++){
 			if(dir_inode->direct_ptr[i] != 0){
-				bio_read(dir_inode->direct_ptr[i], block_buffer);
-				for(int j = 0; j < s_block_mem->dirents_per_blk; j++){
+				bio_read(fs->dev, dir_inode->direct_ptr[i], block_buffer);
+				for(int j = 0; j < fs->s_block_mem->dirents_per_blk; j++){
 					memcpy((void*)curr_dirent, (void*)block_buffer + (j*sizeof(struct dirent)), sizeof(struct dirent));
 					if(curr_dirent->valid == 0){
 						curr_dirent->ino = f_ino;
@@ -191,15 +4006,18 @@ int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t n
 						strcpy(curr_dirent->name, fname);
 						curr_dirent->valid = 1;
 						/*UPDATE dir_inode*/
-						time(&dir_inode->vstat.st_atime);
-						time(&dir_inode->vstat.st_mtime);
+						dir_inode->atime_ns = now_ns();
+						dir_inode->mtime_ns = dir_inode->ctime_ns = now_ns();
 
 						/*WRITE new dirent to disk*/
 						memcpy((void*)block_buffer + (j*sizeof(struct dirent)), (void*)curr_dirent, sizeof(struct dirent));
-						bio_write(dir_inode->direct_ptr[i], block_buffer);
+						if(dir_block_w(fs, dir_inode, i) == -1){
+							blk_put(block_buffer);
+							return -1;
+						}
+						bio_write(fs->dev, dir_inode->direct_ptr[i], block_buffer);
 					
-						free(curr_dirent);
-						free(block_buffer);
+						blk_put(block_buffer);
 						return 0;
 					}
 				}
@@ -211,58 +4029,419 @@ int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t n
 				strcpy(curr_dirent->name, fname);
 				curr_dirent->valid = 1;
 				
-				dir_inode->direct_ptr[i] = get_avail_blkno();
+				int got = 0;
+				dir_inode->direct_ptr[i] = get_avail_blkrange(fs, inode_goal(fs, dir_inode), 1, &got);
 				if(dir_inode->direct_ptr[i] == -1){
-					free(curr_dirent);
-					free(block_buffer);
+					blk_put(block_buffer);
 					return -1;
 				}
 				/*UPDATE dir_inode*/
 				dir_inode->size += BLOCK_SIZE;
-				dir_inode->vstat.st_size += BLOCK_SIZE;
-				time(&dir_inode->vstat.st_atime);
-				time(&dir_inode->vstat.st_mtime);
+				dir_inode->blocks++;
+				dir_inode->atime_ns = now_ns();
+				dir_inode->mtime_ns = dir_inode->ctime_ns = now_ns();
 				
-				/*Build new block buffer*/
+				/*Build new block buffer, the other slots zeroed (invalid)*/
+				memset(block_buffer, 0, BLOCK_SIZE);
 				memcpy((void*)block_buffer, (void*)curr_dirent, sizeof(struct dirent));
-				for(int x = 1; x < s_block_mem->dirents_per_blk; x++){
-					struct dirent* new_dirent = (struct dirent*)calloc(1, sizeof(struct dirent));
-					new_dirent->valid = 0;
-					memcpy((void*)block_buffer + (x*sizeof(struct dirent)), (void*)new_dirent, sizeof(struct dirent));
-					free(new_dirent);
-				}
 				/*WRITE new dirent to disk*/
-				bio_write(dir_inode->direct_ptr[i], block_buffer);
-				free(curr_dirent);
-				free(block_buffer);
+				bio_write(fs->dev, dir_inode->direct_ptr[i], block_buffer);
+				blk_put(block_buffer);
 				return 0;
 			}
 		}
-		free(block_buffer);
+		blk_put(block_buffer);
 	}
-	free(curr_dirent);
 	return -1;
 }
-/*OPTIONAL: SKIP*/
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+int dir_remove(struct rufs_fs *fs, struct inode *dir_inode, const char *fname, size_t name_len) {
+	ARENA_SCOPE;
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	memset(curr_dirent, 0, sizeof(struct dirent));
 
 	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	
-	// Step 2: Check if fname exist
+	for(int i = 0; i < NUM_DPTRS; i++){
+		if(dir_inode->direct_ptr[i] != 0){
+			bio_read(fs->dev, dir_inode->direct_ptr[i], block_buffer);
+			for(int j = 0; j < fs->s_block_mem->dirents_per_blk; j++){
+				memcpy((void*)curr_dirent, (void*)block_buffer + (j*sizeof(struct dirent)), sizeof(struct dirent));
+				// Step 2: Check if fname exist
+				if(curr_dirent->valid == 1 && strcmp(fname, curr_dirent->name) == 0){
+					// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+					memset((void*)block_buffer + (j*sizeof(struct dirent)), 0, sizeof(struct dirent));
+					int retval = dir_block_w(fs, dir_inode, i) == -1 ? -1 : 0;
+					if(retval == 0){
+						bio_write(fs->dev, dir_inode->direct_ptr[i], block_buffer);
+						dcache_forget(fs, dir_inode->ino, fname);
+					}
+					blk_put(block_buffer);
+					return retval;
+				}
+			}
+			memset(block_buffer, 0, BLOCK_SIZE);
+		}
+	}
+
+	blk_put(block_buffer);
+	return -1;
+}
+
+/* 
+ * Check that a directory holds nothing but "." and ".."
+ */
+int dir_is_empty(struct rufs_fs *fs, struct inode *dir_inode) {
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	struct dirent* curr_dirent;
+
+	for(int i = 0; i < NUM_DPTRS; i++){
+		if(dir_inode->direct_ptr[i] != 0){
+			bio_read(fs->dev, dir_inode->direct_ptr[i], block_buffer);
+			for(int j = 0; j < fs->s_block_mem->dirents_per_blk; j++){
+				curr_dirent = (struct dirent*)(block_buffer + (j*sizeof(struct dirent)));
+				if(curr_dirent->valid == 1 && strcmp(curr_dirent->name, ".") != 0 && strcmp(curr_dirent->name, "..") != 0){
+					blk_put(block_buffer);
+					return 0;
+				}
+			}
+		}
+	}
+
+	blk_put(block_buffer);
+	return 1;
+}
+/* 
+ * Rewrite the inode number (and optionally the name) of an existing entry in place
+ */
+int dir_update(struct rufs_fs *fs, struct inode *dir_inode, const char *fname, uint16_t new_ino, const char *new_name) {
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	struct dirent* curr_dirent;
+
+	for(int i = 0; i < NUM_DPTRS; i++){
+		if(dir_inode->direct_ptr[i] != 0){
+			bio_read(fs->dev, dir_inode->direct_ptr[i], block_buffer);
+			for(int j = 0; j < fs->s_block_mem->dirents_per_blk; j++){
+				curr_dirent = (struct dirent*)(block_buffer + (j*sizeof(struct dirent)));
+				if(curr_dirent->valid == 1 && strcmp(fname, curr_dirent->name) == 0){
+					curr_dirent->ino = new_ino;
+					if(new_name != NULL){
+						memset(curr_dirent->name, 0, sizeof(curr_dirent->name));
+						strcpy(curr_dirent->name, new_name);
+						curr_dirent->len = strlen(new_name);
+					}
+					/*Single block write keeps the update atomic*/
+					if(dir_block_w(fs, dir_inode, i) == -1){
+						blk_put(block_buffer);
+						return -1;
+					}
+					bio_write(fs->dev, dir_inode->direct_ptr[i], block_buffer);
+					dcache_forget(fs, dir_inode->ino, fname);
+					dir_inode->mtime_ns = dir_inode->ctime_ns = now_ns();
+					blk_put(block_buffer);
+					return 0;
+				}
+			}
+		}
+	}
+
+	blk_put(block_buffer);
+	return -1;
+}
+
+/* 
+ * Finish a cross-directory rename interrupted by a crash. If the destination entry
+ * was written the rename is rolled forward, otherwise it never happened.
+ */
+int rename_recover(struct rufs_fs *fs) {
+	ARENA_SCOPE;
+	struct rename_intent* log = &fs->s_block_mem->rename_log;
+	if(log->active == 0){
+		return 0;
+	}
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	struct inode* src_parent = (struct inode*)arena_zalloc(sizeof(struct inode));
+	struct inode* dst_parent = (struct inode*)arena_zalloc(sizeof(struct inode));
+	struct inode* moved = (struct inode*)arena_zalloc(sizeof(struct inode));
+	readi(fs, log->src_dir, src_parent);
+	readi(fs, log->dst_dir, dst_parent);
+	readi(fs, log->ino, moved);
+
+	if(dir_find(fs, log->dst_dir, log->dst_name, strlen(log->dst_name), curr_dirent) == 0 && curr_dirent->ino == log->ino){
+		// Step 1: Drop the source entry if it still points at the moved inode
+		if(dir_find(fs, log->src_dir, log->src_name, strlen(log->src_name), curr_dirent) == 0 && curr_dirent->ino == log->ino){
+			dir_remove(fs, src_parent, log->src_name, strlen(log->src_name));
+			writei(fs, src_parent->ino, src_parent);
+		}
+		// Step 2: Repoint ".." of a moved directory and fix parent link counts
+		if(S_ISDIR(moved->type) && dir_find(fs, log->ino, "..", 2, curr_dirent) == 0 && curr_dirent->ino == log->src_dir){
+			dir_update(fs, moved, "..", log->dst_dir, NULL);
+			writei(fs, moved->ino, moved);
+			src_parent->link--;
+			dst_parent->link++;
+			writei(fs, src_parent->ino, src_parent);
+			writei(fs, dst_parent->ino, dst_parent);
+		}
+		// Step 3: Release the replaced inode if that had not happened yet. It leaves the log
+		// first, so a crash from here on can leak it but never release it twice
+		if(log->victim_ino != 0){
+			struct inode* victim = (struct inode*)arena_zalloc(sizeof(struct inode));
+			readi(fs, log->victim_ino, victim);
+			pthread_mutex_lock(&fs->alloc_lock);
+			log->victim_ino = 0;
+			write_superblock(fs);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			if(victim->valid == 1){
+				if(S_ISDIR(victim->type)){
+					readi(fs, log->dst_dir, dst_parent);
+					dst_parent->link--;
+					writei(fs, dst_parent->ino, dst_parent);
+				}
+				victim->link = 0;
+				release_inode(fs, victim);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	memset(log, 0, sizeof(struct rename_intent));
+	write_superblock(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	return 0;
+}
+
+/* 
+ * snapshot namespace
+ */
+
+/* 
+ * Whether path is SNAP_DIR or lies under it
+ */
+int snap_path(const char *path) {
+	size_t len = strlen(SNAP_DIR);
+	return strncmp(path, SNAP_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/* 
+ * Index of the snapshot called name, -1 if there is none (caller holds alloc_lock)
+ */
+int snap_find(struct rufs_fs *fs, const char *name) {
+	for(uint32_t k = 0; k < fs->s_block_mem->snap_cnt; k++){
+		if(strcmp(fs->s_block_mem->snaps[k].name, name) == 0){
+			return k;
+		}
+	}
+	return -1;
+}
+
+/* 
+ * Read inode ino as it was when snapshot gen was taken. Returns -1 if the snapshot is gone.
+ */
+int snap_readi(struct rufs_fs *fs, uint32_t gen, uint16_t ino, struct inode *inode) {
+	char* block_buffer = (char*)blk_get();
+	uint32_t b = (ino * sizeof(struct inode)) / BLOCK_SIZE;
+	uint16_t idx = ino % fs->s_block_mem->inodes_per_blk;
+	int retval = -1;
+	pthread_mutex_lock(&fs->itable_lock);
+	for(uint32_t k = 0; k < fs->s_block_mem->snap_cnt; k++){
+		struct snapshot* snap = &fs->s_block_mem->snaps[k];
+		if(snap->gen == gen){
+			// Blocks not changed since the snapshot are still read from the live table
+			char* live = (snap->copied & (1u << b)) ? NULL : itable_get(fs, b);
+			if(live != NULL){
+				memcpy(block_buffer, live, BLOCK_SIZE);
+				retval = 0;
+			}
+			else if(snap->copied & (1u << b)){
+				retval = bio_read(fs->dev, snap->itab[b], block_buffer) < 0 ? -1 : 0;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->itable_lock);
+	if(retval == 0){
+		memcpy((void*)inode, (void*)block_buffer + (idx*sizeof(struct inode)), sizeof(struct inode));
+		inode->flags |= INODE_SNAP;
+	}
+	blk_put(block_buffer);
+	return retval;
+}
+
+/* 
+ * Resolve a path under SNAP_DIR: the directory itself, or a path inside one snapshot's tree
+ */
+int snap_lookup(struct rufs_fs *fs, const char *path, struct inode *inode) {
+	ARENA_SCOPE;
+	const char* path_ptr = path + strlen(SNAP_DIR);
+	if(path_ptr[0] == '\0' || strcmp(path_ptr, "/") == 0){
+		// Step 1: SNAP_DIR has no inode of its own, it borrows the root's
+		readi(fs, ROOT_INO, inode);
+		memset(inode->direct_ptr, 0, sizeof(inode->inline_data));
+		inode->type = S_IFDIR | 0555;
+		inode->link = 2;
+		inode->size = 0;
+		inode->blocks = 0;
+		inode->flags = INODE_SNAP;
+		return 0;
+	}
+
+	// Step 2: Find the snapshot named by the first component
+	path_ptr++;
+	int name_len = strcspn(path_ptr, "/");
+	char* name = (char*)arena_zalloc(name_len + 1);
+	strncpy(name, path_ptr, name_len);
+	path_ptr += name_len;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int k = snap_find(fs, name);
+	uint32_t gen = k == -1 ? 0 : fs->s_block_mem->snaps[k].gen;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if(k == -1 || snap_readi(fs, gen, ROOT_INO, inode) == -1){
+		return -1;
+	}
+
+	// Step 3: Walk the rest through the snapshot's own inodes
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	int retval = 0;
+	while(path_ptr[0] != '\0' && retval == 0){
+		if(path_ptr[0] == '/'){
+			path_ptr++;
+		}
+		name_len = strcspn(path_ptr, "/");
+		if(name_len == 0){
+			break;
+		}
+		name = (char*)arena_zalloc(name_len + 1);
+		strncpy(name, path_ptr, name_len);
+		if(!S_ISDIR(inode->type) || dir_scan(fs, inode, name, curr_dirent) == -1 || snap_readi(fs, gen, curr_dirent->ino, inode) == -1){
+			retval = -1;
+		}
+		path_ptr += name_len;
+	}
+	return retval;
+}
+
+/* 
+ * Take snapshot name of the whole file system. Only the superblock is written and a block
+ * per inode table block reserved; the table itself and all data stay shared until changed.
+ */
+int snapshot_create(struct rufs_fs *fs, const char *name) {
+	if(strlen(name) == 0 || strlen(name) >= sizeof(((struct snapshot*)0)->name)){
+		return strlen(name) == 0 ? -EINVAL : -ENAMETOOLONG;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	int busy = snap_find(fs, name) != -1 ? -EEXIST : (fs->s_block_mem->snap_cnt == MAX_SNAPS ? -EMLINK : 0);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if(busy){
+		return busy;
+	}
+
+	// Step 1: Put delayed-allocation pages on disk so the captured inodes are complete
+	for(int i = 0; i < MAX_INUM; i++){
+		dalloc_sync_ino(fs, i);
+	}
+
+	// Step 2: Reserve the blocks the inode table will be preserved into
+	int itab[ITABLE_BLKS];
+	int n = 0;
+	while(n < ITABLE_BLKS){
+		int got = 0;
+		int start = get_avail_blkrange(fs, n > 0 ? itab[n - 1] + 1 : 0, ITABLE_BLKS - n, &got);
+		if(start == -1){
+			release_blocks(fs, itab, n);
+			return -ENOSPC;
+		}
+		for(int k = 0; k < got; k++){
+			itab[n++] = start + k;
+		}
+	}
+
+	// Step 3: Record it; from now on every inode table write preserves the old block first
+	pthread_mutex_lock(&fs->itable_lock);
+	pthread_mutex_lock(&fs->alloc_lock);
+	int retval = snap_find(fs, name) != -1 ? -EEXIST : (fs->s_block_mem->snap_cnt == MAX_SNAPS ? -EMLINK : 0);
+	if(retval == 0){
+		struct snapshot* snap = &fs->s_block_mem->snaps[fs->s_block_mem->snap_cnt];
+		memset(snap, 0, sizeof(struct snapshot));
+		strcpy(snap->name, name);
+		snap->gen = ++fs->s_block_mem->snap_gen;
+		snap->ctime_ns = now_ns();
+		memcpy(snap->itab, itab, sizeof(itab));
+		fs->s_block_mem->snap_cnt++;
+		write_superblock(fs);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_unlock(&fs->itable_lock);
+	if(retval != 0){
+		release_blocks(fs, itab, ITABLE_BLKS);
+	}
+	return retval;
+}
+
+/* 
+ * Delete snapshot name, dropping the block references charged to it
+ */
+int snapshot_delete(struct rufs_fs *fs, const char *name) {
+	// Step 1: Take it off the list so no inode is charged for it any more
+	pthread_mutex_lock(&fs->itable_lock);
+	pthread_mutex_lock(&fs->alloc_lock);
+	int k = snap_find(fs, name);
+	if(k == -1){
+		pthread_mutex_unlock(&fs->alloc_lock);
+		pthread_mutex_unlock(&fs->itable_lock);
+		return -ENOENT;
+	}
+	struct snapshot snap = fs->s_block_mem->snaps[k];
+	memmove(&fs->s_block_mem->snaps[k], &fs->s_block_mem->snaps[k + 1], (fs->s_block_mem->snap_cnt - k - 1) * sizeof(struct snapshot));
+	fs->s_block_mem->snap_cnt--;
+	write_superblock(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+	// Step 2: An inode it holds was charged for it if the live inode was read since; blocks
+	// that never changed were never charged
+	char* saved = (char*)blk_get();
+	for(uint32_t b = 0; b < ITABLE_BLKS; b++){
+		char* live = (snap.copied & (1u << b)) ? itable_get(fs, b) : NULL;
+		if(live == NULL){
+			continue;
+		}
+		bio_read(fs->dev, snap.itab[b], saved);
+		for(uint32_t j = 0; j < fs->s_block_mem->inodes_per_blk; j++){
+			struct inode* old = (struct inode*)(saved + j * sizeof(struct inode));
+			struct inode* cur = (struct inode*)(live + j * sizeof(struct inode));
+			if(old->valid && cur->snap_gen >= snap.gen){
+				release_tree(fs, old);
+			}
+		}
+	}
+	pthread_mutex_unlock(&fs->itable_lock);
 
+	// Step 3: Free its inode table blocks
+	int itab[ITABLE_BLKS];
+	for(uint32_t b = 0; b < ITABLE_BLKS; b++){
+		itab[b] = snap.itab[b];
+	}
+	release_blocks(fs, itab, ITABLE_BLKS);
+	blk_put(saved);
 	return 0;
 }
+
+
 /* 
  * namei operation
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+int get_node_by_path(struct rufs_fs *fs, const char *path, uint16_t ino, struct inode *inode) {
+	ARENA_SCOPE;
 	
 	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
 	// Note: You could either implement it in a iterative way or recursive way
+	if(ino == ROOT_INO && snap_path(path)){
+		return snap_lookup(fs, path, inode);
+	}
 	if(strcmp(path, "/") == 0){
-        readi(ino, inode);
+        readi(fs, ino, inode);
         return 0;
     }
 	uint16_t curr_ino = ino;
@@ -272,317 +4451,1144 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
             path_ptr++;
         }
         int name_len = strcspn(path_ptr, "/");
-        char* name = (char*)calloc(name_len, sizeof(char));
+        char* name = (char*)arena_zalloc(name_len + 1);
         strncpy(name, path_ptr, name_len);
         if(strcmp(name, "\0") == 0){
-            free(name);
             break;
         }
-		struct dirent* curr_dirent = (struct dirent*)calloc(1, sizeof(struct dirent));
-        if(dir_find(curr_ino, name, name_len, curr_dirent) == -1){
-			free(name);
-			free(curr_dirent);
+		struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+        if(dir_find(fs, curr_ino, name, name_len, curr_dirent) == -1){
+			return -1;
+		}
+		curr_ino = curr_dirent->ino;
+        path_ptr += name_len;
+    }
+	readi(fs, curr_ino, inode);
+    return 0;
+}
+
+/* 
+ * get_node_by_path() for an op that changes the file: the inode is locked and reread under
+ * the lock, the caller unlocks it. Snapshot inodes are returned unlocked.
+ */
+int get_node_locked(struct rufs_fs *fs, const char *path, struct inode *inode) {
+	if(get_node_by_path(fs, path, ROOT_INO, inode) == -1){
+		return -1;
+	}
+	if(!(inode->flags & INODE_SNAP)){
+		ilock(fs, inode->ino);
+		readi(fs, inode->ino, inode);
+		if(!inode->valid){
+			/*Unlinked and reclaimed meanwhile*/
+			iunlock(fs, inode->ino);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* 
+ * Lock the entry name of parent, whose lock the caller holds, and read its inode. Should
+ * the parent's lock be dropped to keep stripe order, parent is reread and the entry looked
+ * up again. Returns -1 if there is no such entry; otherwise the caller unlocks inode.
+ */
+int get_child_locked(struct rufs_fs *fs, struct inode *parent, const char *name, size_t name_len, struct inode *inode) {
+	ARENA_SCOPE;
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	for(;;){
+		if(dir_find(fs, parent->ino, name, name_len, curr_dirent) == -1){
 			return -1;
 		}
-		curr_ino = curr_dirent->ino;
-        path_ptr += name_len;
-        free(name);
-		free(curr_dirent);
-    }
-	readi(curr_ino, inode);
-    return 0;
+		uint16_t ino = curr_dirent->ino;
+		if(ilock_also(fs, parent->ino, ino) == 0){
+			break;
+		}
+		readi(fs, parent->ino, parent);
+		if(dir_find(fs, parent->ino, name, name_len, curr_dirent) == 0 && curr_dirent->ino == ino){
+			break;
+		}
+		iunlock(fs, ino);
+	}
+	readi(fs, curr_dirent->ino, inode);
+	return 0;
 }
 
 
 /* 
  * Make file system
  */
-int rufs_mkfs() {
+int rufs_mkfs(struct rufs_fs *fs) {
+	ARENA_SCOPE;
 	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
-	dev_open(diskfile_path);
+	if((fs->dev = dev_init(fs->diskfile_path)) == NULL){
+		return -1;
+	}
 
 	// write superblock information
-	s_block_mem = (struct superblock*)malloc(sizeof(struct superblock));
-	s_block_mem->magic_num = MAGIC_NUM;
-	s_block_mem->max_inum = MAX_INUM;
-	s_block_mem->max_dnum = MAX_DNUM;
-	s_block_mem->i_bitmap_blk = IBM_IDX;
-	s_block_mem->d_bitmap_blk = DBM_IDX;
-	s_block_mem->i_start_blk = IREG_IDX;
-	s_block_mem->d_start_blk = ((sizeof(struct inode)*MAX_INUM)/BLOCK_SIZE) + (IREG_IDX + 1);
-	s_block_mem->inodes_per_blk = BLOCK_SIZE / sizeof(struct inode);
-	s_block_mem->dirents_per_blk = BLOCK_SIZE / sizeof(struct dirent);
-	s_block_mem->max_file_size = NUM_DPTRS * BLOCK_SIZE;
-	s_block_mem->total_blocks_alloc = s_block_mem->d_start_blk;
+	fs->s_block_mem = (struct superblock*)calloc(1, sizeof(struct superblock));
+	fs->s_block_mem->magic_num = MAGIC_NUM;
+	fs->s_block_mem->max_inum = MAX_INUM;
+	fs->s_block_mem->i_bitmap_blk = IBM_IDX;
+	fs->s_block_mem->d_refcnt_blk = RC_IDX;
+	fs->s_block_mem->d_refcnt_blks = RC_BLKS;
+	fs->s_block_mem->fp_blk = RC_IDX + RC_BLKS;
+	fs->s_block_mem->fp_blks = FP_BLKS;
+	fs->s_block_mem->i_start_blk = fs->s_block_mem->fp_blk + FP_BLKS;
+	fs->s_block_mem->d_start_blk = fs->s_block_mem->i_start_blk + (sizeof(struct inode)*MAX_INUM)/BLOCK_SIZE;
+	// Data region ends where the block layer's checksum area begins
+	int avail_dnum = dev_blocks() - fs->s_block_mem->d_start_blk;
+	fs->s_block_mem->max_dnum = (avail_dnum < MAX_DNUM ? avail_dnum : MAX_DNUM) & ~7;
+	fs->s_block_mem->inodes_per_blk = BLOCK_SIZE / sizeof(struct inode);
+	fs->s_block_mem->dirents_per_blk = BLOCK_SIZE / sizeof(struct dirent);
+	fs->s_block_mem->inode_size = INODE_SIZE;
+	fs->s_block_mem->inode_version = INODE_VERSION;
+	fs->s_block_mem->max_file_size = (uint64_t)(NUM_DPTRS + NUM_IPTRS * PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK) * BLOCK_SIZE;
+	fs->s_block_mem->total_blocks_alloc = fs->s_block_mem->d_start_blk;
 
 	// initialize block buffer
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
+	char* block_buffer = (char*)blk_get();
 	memset(block_buffer, 0, BLOCK_SIZE);
 
-	memcpy(block_buffer, s_block_mem, sizeof(struct superblock));
-	bio_write(SUPER_IDX, block_buffer);
+	memcpy(block_buffer, fs->s_block_mem, sizeof(struct superblock));
+	bio_write(fs->dev, SUPER_IDX, block_buffer);
 	memset(block_buffer, 0, BLOCK_SIZE);
 
 	// initialize inode bitmap
 	bitmap_t inode_bm = (bitmap_t)malloc((MAX_INUM/8)*sizeof(char));
 	memset(inode_bm, 0, (MAX_INUM/8)*sizeof(char));
-	// initialize data block bitmap
-	bitmap_t data_bm = (bitmap_t)malloc((MAX_DNUM/8)*sizeof(char));
-	memset(data_bm, 0, (MAX_DNUM/8)*sizeof(char));
 	
 	// update bitmap information for root directory
 	set_bitmap(inode_bm, ROOT_INO);
-	set_bitmap(data_bm, 0);
 	
 	memcpy(block_buffer, inode_bm, (MAX_INUM/8)*sizeof(char));
-	bio_write(s_block_mem->i_bitmap_blk, block_buffer);
-	memset(block_buffer, 0, BLOCK_SIZE);
-	
-	memcpy(block_buffer, data_bm, (MAX_DNUM/8)*sizeof(char));
-	bio_write(s_block_mem->d_bitmap_blk, block_buffer);
+	bio_write(fs->dev, fs->s_block_mem->i_bitmap_blk, block_buffer);
 	memset(block_buffer, 0, BLOCK_SIZE);
+
+	// initialize data block reference counts and an empty fingerprint index
+	for(uint32_t b = 0; b < RC_BLKS + FP_BLKS; b++){
+		bio_write(fs->dev, fs->s_block_mem->d_refcnt_blk + b, block_buffer);
+	}
+	recount_blocks(fs);
+	pthread_mutex_lock(&fs->alloc_lock);
+	set_ref(fs, 0, 1);
+	refcnt_flush(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
 	
 	free(inode_bm);
-	free(data_bm);
-	free(block_buffer);
+	blk_put(block_buffer);
 
 	// update inode for root directory
-	struct inode* root_inode = (struct inode*)calloc(1, sizeof(struct inode));
+	struct inode* root_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
 	root_inode->ino = ROOT_INO;
 	root_inode->valid = 1;
 	root_inode->type = S_IFDIR | 0755;
 	root_inode->link = 1;
 
-	/*Init vstat fields*/
-	root_inode->vstat.st_uid = getuid();
-	root_inode->vstat.st_gid = getgid();
-	root_inode->vstat.st_mode = S_IFDIR | 0755;
-	root_inode->vstat.st_nlink = 1;
+	/*Init ownership*/
+	root_inode->uid = getuid();
+	root_inode->gid = getgid();
+	root_inode->atime_ns = root_inode->mtime_ns = root_inode->ctime_ns = now_ns();
 	
-	dir_add(root_inode, root_inode->ino, ".", 1);
+	dir_add(fs, root_inode, root_inode->ino, ".", 1);
 
-	writei(ROOT_INO, root_inode);
+	writei(fs, ROOT_INO, root_inode);
 
-	free(root_inode);
 	
 	return 0;
 }
 
 
 /* 
- * FUSE file operations
+ * Render the runtime counters served through STATS_PATH as "name value" lines
+ */
+int format_stats(struct rufs_fs *fs, char *buf, size_t len) {
+	struct dev_stats ds;
+	dev_get_stats(fs->dev, &ds);
+	pthread_mutex_lock(&fs->alloc_lock);
+	uint32_t free_blks = free_blk_count(fs);
+	uint32_t orphans = fs->s_block_mem->orphan_cnt;
+	uint32_t snaps = fs->s_block_mem->snap_cnt;
+	uint32_t shared = 0, saved = 0;
+	for(int i = 0; i < fs->s_block_mem->max_dnum; i++){
+		if(fs->refcnt[i] > 1){
+			shared++;
+			saved += fs->refcnt[i] - 1;
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	uint64_t bhits, bmisses, dhits, dmisses;
+	ct_totals(&fs->bcache_ct, &bhits, &bmisses);
+	ct_totals(&fs->dcache_ct, &dhits, &dmisses);
+
+	int n = snprintf(buf, len,
+		"blk_reads %llu\n"
+		"blk_writes %llu\n"
+		"csum_impl %s\n"
+		"csum_bytes %llu\n"
+		"csum_ns %llu\n"
+		"csum_errors %llu\n"
+		"ram_saves %llu\n"
+		"csum_rebuilt %llu\n"
+		"free_blocks %u\n"
+		"orphans %u\n"
+		"snapshots %u\n"
+		"dalloc_pages %u\n"
+		"bcache_hits %llu\n"
+		"bcache_misses %llu\n"
+		"clusters_compressed %llu\n"
+		"clusters_raw %llu\n"
+		"compress_in %llu\n"
+		"compress_out %llu\n"
+		"dedup_hits %llu\n"
+		"cow_copies %llu\n"
+		"shared_blocks %u\n"
+		"blocks_saved %u\n"
+		"log_appends %llu\n"
+		"log_moved %llu\n"
+		"log_cleaned %llu\n"
+		"ra_blocks %llu\n"
+		"itable_reads %llu\n"
+		"dcache_hits %llu\n"
+		"dcache_misses %llu\n"
+		"defrag_blocks %llu\n"
+		"io_tasks %llu\n"
+		"io_steals %llu\n"
+		"tier_demoted %llu\n"
+		"tier_promoted %llu\n",
+		(unsigned long long)ds.reads, (unsigned long long)ds.writes, crc32c_impl(),
+		(unsigned long long)ds.csum_bytes, (unsigned long long)ds.csum_ns, (unsigned long long)ds.csum_errors,
+		(unsigned long long)ds.ram_saves, (unsigned long long)ds.csum_rebuilt, free_blks, orphans, snaps, fs->dalloc_total,
+		(unsigned long long)bhits, (unsigned long long)bmisses,
+		(unsigned long long)fs->stats.clusters_compressed, (unsigned long long)fs->stats.clusters_raw,
+		(unsigned long long)fs->stats.compress_in, (unsigned long long)fs->stats.compress_out,
+		(unsigned long long)fs->stats.dedup_hits, (unsigned long long)fs->stats.cow_copies, shared, saved,
+		(unsigned long long)fs->stats.log_appends, (unsigned long long)fs->stats.log_moved, (unsigned long long)fs->stats.log_cleaned,
+		(unsigned long long)fs->stats.ra_blocks, (unsigned long long)fs->stats.itable_reads,
+		(unsigned long long)dhits, (unsigned long long)dmisses,
+		(unsigned long long)fs->stats.defrag_blocks, (unsigned long long)fs->stats.io_tasks,
+		(unsigned long long)fs->stats.io_steals,
+		(unsigned long long)fs->stats.tier_demoted, (unsigned long long)fs->stats.tier_promoted);
+	return n < (int)len ? n : (int)len - 1;
+}
+
+
+/* 
+ * file system operations
+ */
+
+/* 
+ * A zeroed file system handle with its locks set up, NULL if out of memory
+ */
+static struct rufs_fs* fs_alloc(const char *image) {
+	struct rufs_fs* fs = (struct rufs_fs*)calloc(1, sizeof(struct rufs_fs));
+	if(fs == NULL){
+		return NULL;
+	}
+	strcpy(fs->diskfile_path, image);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_mutex_init(&fs->itable_lock, NULL);
+	pthread_mutex_init(&fs->rename_lock, NULL);
+	pthread_mutex_init(&fs->dalloc_lock, NULL);
+	pthread_cond_init(&fs->dalloc_cond, NULL);
+	pthread_mutex_init(&fs->ra_lock, NULL);
+	for(int i = RA_STATES - 1; i >= 0; i--){
+		pthread_mutex_init(&fs->ra_states[i].lock, NULL);
+		fs->ra_states[i].free_next = fs->ra_free;
+		fs->ra_free = &fs->ra_states[i];
+	}
+	pthread_mutex_init(&fs->io_lock, NULL);
+	pthread_cond_init(&fs->reclaim_cond, NULL);
+	pthread_cond_init(&fs->cleaner_cond, NULL);
+	pthread_cond_init(&fs->tier_cond, NULL);
+	pthread_cond_init(&fs->ra_cond, NULL);
+	pthread_cond_init(&fs->io_cond, NULL);
+	pthread_mutexattr_t ma;
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_settype(&ma, PTHREAD_MUTEX_RECURSIVE);
+	for(int i = 0; i < ILOCKS; i++){
+		pthread_mutex_init(&fs->ilocks[i], &ma);
+	}
+	pthread_mutexattr_destroy(&ma);
+	pthread_rwlockattr_t ra;
+	pthread_rwlockattr_init(&ra);
+	pthread_rwlockattr_setkind_np(&ra, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&fs->move_lock, &ra);
+	pthread_rwlockattr_destroy(&ra);
+	struct ctable* tables[] = {&fs->bcache_ct, &fs->itable_ct, &fs->dcache_ct};
+	for(int t = 0; t < 3; t++){
+		for(int s = 0; s < CT_SHARDS; s++){
+			pthread_mutex_init(&tables[t]->shards[s].lock, NULL);
+		}
+	}
+	return fs;
+}
+
+/* 
+ * Tear down what fs_alloc() set up and free the in-memory tables
  */
-static void *rufs_init(struct fuse_conn_info *conn) {
+static void fs_free(struct rufs_fs *fs) {
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_mutex_destroy(&fs->itable_lock);
+	pthread_mutex_destroy(&fs->rename_lock);
+	pthread_mutex_destroy(&fs->dalloc_lock);
+	pthread_mutex_destroy(&fs->ra_lock);
+	pthread_mutex_destroy(&fs->io_lock);
+	pthread_cond_destroy(&fs->dalloc_cond);
+	pthread_cond_destroy(&fs->reclaim_cond);
+	pthread_cond_destroy(&fs->cleaner_cond);
+	pthread_cond_destroy(&fs->tier_cond);
+	pthread_cond_destroy(&fs->ra_cond);
+	pthread_cond_destroy(&fs->io_cond);
+	for(int i = 0; i < ILOCKS; i++){
+		pthread_mutex_destroy(&fs->ilocks[i]);
+	}
+	for(int i = 0; i < RA_STATES; i++){
+		pthread_mutex_destroy(&fs->ra_states[i].lock);
+	}
+	while(fs->dalloc_free != NULL){
+		struct page* pg = fs->dalloc_free;
+		fs->dalloc_free = pg->hash_next;
+		free(pg);
+	}
+	pthread_rwlock_destroy(&fs->move_lock);
+	struct ctable* tables[] = {&fs->bcache_ct, &fs->itable_ct, &fs->dcache_ct};
+	for(int t = 0; t < 3; t++){
+		for(int s = 0; s < CT_SHARDS; s++){
+			pthread_mutex_destroy(&tables[t]->shards[s].lock);
+		}
+	}
+	free(fs->refcnt);
+	free(fs->fpidx);
+	free(fs->fp_head);
+	free(fs->fp_next);
+	free(fs->s_block_mem);
+	free(fs->itcache);
+	free(fs);
+}
+
+struct rufs_fs* rufs_mount(const char *image) {
+	if(strlen(image) >= PATH_MAX){
+		return NULL;
+	}
+	struct rufs_fs* fs = fs_alloc(image);
+	if(fs == NULL){
+		return NULL;
+	}
+	fs->itcache = (char*)malloc(ITABLE_BLKS * BLOCK_SIZE);
 
 	// Step 1b: If disk file is found, just initialize in-memory data structures
   	// and read superblock from disk
-	if (access(diskfile_path, F_OK) == 0) {
-		char* block_buffer = (char*)malloc(BLOCK_SIZE);
+	if (access(fs->diskfile_path, F_OK) == 0) {
+		if((fs->dev = dev_open(fs->diskfile_path)) == NULL){
+			fs_free(fs);
+			return NULL;
+		}
+		char* block_buffer = (char*)blk_get();
 		memset(block_buffer, 0, BLOCK_SIZE);
-		dev_open(diskfile_path);
-
-		s_block_mem = (struct superblock*)malloc(sizeof(struct superblock));
-		bio_read(SUPER_IDX, block_buffer);
-		memcpy(s_block_mem, block_buffer, sizeof(struct superblock));
-
-		free(block_buffer);
+		fs->s_block_mem = (struct superblock*)malloc(sizeof(struct superblock));
+		bio_read(fs->dev, SUPER_IDX, block_buffer);
+		memcpy(fs->s_block_mem, block_buffer, sizeof(struct superblock));
+		blk_put(block_buffer);
+		if(fs->s_block_mem->magic_num != MAGIC_NUM || fs->s_block_mem->inode_size != INODE_SIZE || fs->s_block_mem->inode_version != INODE_VERSION || fs->s_block_mem->d_refcnt_blks == 0 ||
+		   fs->s_block_mem->d_start_blk + fs->s_block_mem->max_dnum > dev_blocks() || fs->s_block_mem->snap_cnt > MAX_SNAPS){
+			fprintf(stderr, "rufs: %s has an unsupported format, remove it to create a new file system\n", fs->diskfile_path);
+			dev_close(fs->dev);
+			fs_free(fs);
+			return NULL;
+		}
+		recount_blocks(fs);
 	}
 	// Step 1a: If disk file is not found, call mkfs
-	else {
-		rufs_mkfs();
+	else if(rufs_mkfs(fs) < 0){
+		fs_free(fs);
+		return NULL;
 	}
-  
-	return NULL;
+
+	fs->tier_dnum = dev_fast_blocks(fs->dev) - (int)fs->s_block_mem->d_start_blk;
+	if(fs->tier_dnum <= 0 || fs->tier_dnum >= fs->s_block_mem->max_dnum){
+		fs->tier_dnum = 0;
+	}
+
+	// Step 2: Roll forward an interrupted rename, then start the I/O pool, background reclamation
+	// of unlinked inodes, the log segment cleaner, readahead and the tier migrator
+	rename_recover(fs);
+	io_start(fs);
+	reclaim_start(fs);
+	cleaner_start(fs);
+	ra_start(fs);
+	tier_start(fs);
+	return fs;
 }
 
-static void rufs_destroy(void *userdata) {
+void rufs_unmount(struct rufs_fs *fs) {
 
-	// Step 1: De-allocate in-memory data structures
-	free(s_block_mem);
+	// Step 1: Write back delayed-allocation pages and de-allocate in-memory data structures
+	tier_shutdown(fs);
+	ra_shutdown(fs);
+	cleaner_shutdown(fs);
+	for(int i = 0; i < MAX_INUM; i++){
+		dalloc_sync_ino(fs, i);
+	}
+	reclaim_shutdown(fs);
+	io_shutdown(fs);
+	fp_sync(fs);
 	// Step 2: Close diskfile
-	dev_close();
+	dev_close(fs->dev);
+	fs_free(fs);
 }
 
-static int rufs_getattr(const char *path, struct stat *stbuf) {
+int rufs_getattr(struct rufs_fs *fs, const char *path, struct stat *stbuf) {
+	ARENA_SCOPE;
 	memset(stbuf, 0, sizeof(struct stat));
+	if(strcmp(path, STATS_PATH) == 0){
+		char* stats = (char*)arena_alloc(STATS_MAX);
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		stbuf->st_size = format_stats(fs, stats, STATS_MAX);
+		return 0;
+	}
 	// printf("Total Blocks Allocated: %d\n", s_block_mem->total_blocks_alloc);
 	// Step 1: call get_node_by_path() to get inode from path
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(path, ROOT_INO, curr_inode) == -1){
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_by_path(fs, path, ROOT_INO, curr_inode) == -1){
 
-		free(curr_inode);
 		return -ENOENT;
 	}
 	
-	// Step 2: fill attribute of file into stbuf from inode
-	stbuf->st_uid = curr_inode->vstat.st_uid;
-	stbuf->st_gid = curr_inode->vstat.st_gid;
-	stbuf->st_mode = curr_inode->vstat.st_mode;
-	stbuf->st_size = curr_inode->vstat.st_size;
-	stbuf->st_nlink = curr_inode->vstat.st_nlink;
-	time(&curr_inode->vstat.st_atime);
-	time(&curr_inode->vstat.st_mtime);
-	stbuf->st_atime = curr_inode->vstat.st_atime;
-	stbuf->st_mtime = curr_inode->vstat.st_mtime;
-
-	writei(curr_inode->ino, curr_inode);
-
-	free(curr_inode);
+	// Step 2: fill attribute of file into stbuf from inode; this is the only place the
+	// on-disk inode is converted to a struct stat
+	stbuf->st_ino = curr_inode->ino;
+	stbuf->st_mode = curr_inode->type;
+	stbuf->st_nlink = curr_inode->link;
+	stbuf->st_uid = curr_inode->uid;
+	stbuf->st_gid = curr_inode->gid;
+	stbuf->st_size = curr_inode->size;
+	stbuf->st_blocks = (curr_inode->blocks + ((curr_inode->flags & INODE_SNAP) ? 0 : fs->dalloc_holes[curr_inode->ino])) * BLK_SECTORS;
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_atim = ns_to_timespec(curr_inode->atime_ns);
+	stbuf->st_mtim = ns_to_timespec(curr_inode->mtime_ns);
+	stbuf->st_ctim = ns_to_timespec(curr_inode->ctime_ns);
+
 	return 0;
 }
 
-static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+int rufs_opendir(struct rufs_fs *fs, const char *path, struct rufs_file *fi) {
+	ARENA_SCOPE;
 
 	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(path, ROOT_INO, curr_inode) == -1){
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_by_path(fs, path, ROOT_INO, curr_inode) == -1){
 		// Step 2: If not find, return -1
-		free(curr_inode);
 		return -ENOENT;
 	}
-	fi->fh = (uint64_t)curr_inode;
-	free(curr_inode);
-    return 0;
+    return 0;
+}
+
+int rufs_readdir(struct rufs_fs *fs, const char *path, void *buffer, rufs_fill_dir_t filler, off_t offset, struct rufs_file *fi) {
+	ARENA_SCOPE;
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_by_path(fs, path, ROOT_INO, curr_inode) == -1){
+		return -ENOENT;
+	}
+	if(strcmp(path, SNAP_DIR) == 0){
+		filler(buffer, ".", NULL, 0);
+		filler(buffer, "..", NULL, 0);
+		pthread_mutex_lock(&fs->alloc_lock);
+		for(uint32_t k = 0; k < fs->s_block_mem->snap_cnt; k++){
+			filler(buffer, fs->s_block_mem->snaps[k].name, NULL, 0);
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return 0;
+	}
+	// Step 2: Read directory entries from its data blocks, and copy them to filler. Live
+	// entries also go to the dentry cache, and the inode table blocks holding them are
+	// noted for stat-ahead
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	memset(curr_dirent, 0, sizeof(struct dirent));
+	int live = !(curr_inode->flags & INODE_SNAP);
+	uint64_t gen = dcache_snapshot(fs);
+	uint32_t itab = 0;
+
+	for(int i = 0; i < NUM_DPTRS; i++){
+		if(curr_inode->direct_ptr[i] != 0){
+			bio_read(fs->dev, curr_inode->direct_ptr[i], block_buffer);
+			for(int j = 0; j < fs->s_block_mem->dirents_per_blk; j++){
+				memcpy((void*)curr_dirent, (void*)block_buffer + (j*sizeof(struct dirent)), sizeof(struct dirent));
+				if(curr_dirent->valid == 1){
+					filler(buffer, curr_dirent->name, NULL, 0);
+					if(live){
+						dcache_add(fs, curr_inode->ino, curr_dirent->name, curr_dirent->ino, gen);
+						itab |= 1u << (curr_dirent->ino / fs->s_block_mem->inodes_per_blk);
+					}
+            	}
+			}
+			memset(block_buffer, 0, BLOCK_SIZE);
+		}
+	}
+
+	// Step 3: The getattr calls that follow a listing then find the inodes cached; the
+	// blocks are loaded in inode table order by the readahead thread
+	pthread_mutex_lock(&fs->itable_lock);
+	itab &= ~fs->itcached;
+	pthread_mutex_unlock(&fs->itable_lock);
+	if(itab != 0){
+		ra_submit(fs, NULL, 0, 0, itab);
+	}
+
+	blk_put(block_buffer);
+
+	return 0;
+}
+
+int rufs_mkdir(struct rufs_fs *fs, const char *path, mode_t mode) {
+	ARENA_SCOPE;
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	int path_len = strlen(path);
+	char* path_cpy = (char*)arena_zalloc(path_len + 1);
+	strcpy(path_cpy, path);
+	char* base = basename(path_cpy);
+	char* dir = dirname(path_cpy);
+	if(strcmp(dir, "/") == 0){
+		base = (char*)path;
+		base++;
+	}
+	size_t base_len = strlen(base);
+	if(snap_path(path)){
+		// mkdir directly in SNAP_DIR takes a snapshot; its trees are read-only
+		int retval = strcmp(dir, SNAP_DIR) == 0 ? snapshot_create(fs, base) : (strcmp(path, SNAP_DIR) == 0 ? -EEXIST : -EROFS);
+		return retval;
+	}
+	
+	// Step 2: Call get_node_by_path() to get inode of parent directory, locked until the
+	// new entry and inode are written
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, dir, curr_inode) == -1){
+		return -ENOENT;
+	}
+
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	if(dir_find(fs, curr_inode->ino, base, base_len, curr_dirent) == 0){
+		iunlock(fs, curr_inode->ino);
+		return -EEXIST;
+	}
+
+	// Step 3: Call get_avail_ino() to get an available inode number near the parent
+	int avail_ino = get_avail_ino(fs, curr_inode->ino, 1);
+	if(avail_ino == -1){
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+
+	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
+	int retval = dir_add(fs, curr_inode, avail_ino, base, base_len);
+	if(retval == -1){
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+
+	curr_inode->link++;
+	writei(fs, curr_inode->ino, curr_inode);
+
+	// Step 5: Update inode for target directory
+	struct inode* new_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	new_inode->ino = avail_ino;
+	new_inode->type = S_IFDIR | mode;
+	new_inode->link = 2;
+	new_inode->flags = curr_inode->flags & INODE_INHERIT;
+	new_inode->valid = 1;
+	new_inode->snap_gen = fs->s_block_mem->snap_gen;
+	new_inode->uid = getuid();
+	new_inode->gid = getgid();
+	new_inode->atime_ns = new_inode->mtime_ns = new_inode->ctime_ns = now_ns();
+
+	//Add self and parent dirents to target directory
+	if(dir_add(fs, new_inode, new_inode->ino, ".", 1) == -1){
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+
+	dir_add(fs, new_inode, curr_inode->ino, "..", 2);
+
+	// Step 6: Call writei() to write inode to disk
+	writei(fs, avail_ino, new_inode);
+	iunlock(fs, curr_inode->ino);
+
+	return 0;
+}
+int rufs_rmdir(struct rufs_fs *fs, const char *path) {
+	ARENA_SCOPE;
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	int path_len = strlen(path);
+	char* path_cpy = (char*)arena_zalloc(path_len + 1);
+	strcpy(path_cpy, path);
+	char* base = basename(path_cpy);
+	char* dir = dirname(path_cpy);
+	if(strcmp(dir, "/") == 0){
+		base = (char*)path;
+		base++;
+	}
+	size_t base_len = strlen(base);
+	if(base_len == 0){
+		return -EBUSY;
+	}
+	if(snap_path(path)){
+		// rmdir of an entry in SNAP_DIR deletes that snapshot
+		int retval = strcmp(dir, SNAP_DIR) == 0 ? snapshot_delete(fs, base) : -EROFS;
+		return retval;
+	}
+
+	// Step 2: Lock the parent directory, then the target directory through its entry, so
+	// neither gains an entry while it is checked and removed
+	struct inode* parent_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, dir, parent_inode) == -1){
+		return -ENOENT;
+	}
+	struct inode* target_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_child_locked(fs, parent_inode, base, base_len, target_inode) == -1){
+		iunlock(fs, parent_inode->ino);
+		return -ENOENT;
+	}
+	int retval = 0;
+	if(!S_ISDIR(target_inode->type)){
+		retval = -ENOTDIR;
+	}
+	else if(!dir_is_empty(fs, target_inode)){
+		retval = -ENOTEMPTY;
+	}
+	// Step 3: Call dir_remove() to remove directory entry of target directory in its parent directory
+	else if(dir_remove(fs, parent_inode, base, base_len) == -1){
+		retval = -ENOENT;
+	}
+	else{
+		parent_inode->link--;
+		parent_inode->mtime_ns = parent_inode->ctime_ns = now_ns();
+		writei(fs, parent_inode->ino, parent_inode);
+
+		// Step 4: Clear inode bitmap and data block bitmap of target directory
+		target_inode->link = 0;
+		release_inode(fs, target_inode);
+	}
+	iunlock(fs, target_inode->ino);
+	iunlock(fs, parent_inode->ino);
+
+	return retval;
+}
+
+int rufs_releasedir(struct rufs_fs *fs, const char *path, struct rufs_file *fi) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
+
+int rufs_create(struct rufs_fs *fs, const char *path, mode_t mode, struct rufs_file *fi) {
+	ARENA_SCOPE;
+	if(strcmp(path, STATS_PATH) == 0 || strcmp(path, SNAP_DIR) == 0){
+		return -EEXIST;
+	}
+	if(snap_path(path)){
+		return -EROFS;
+	}
+	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	int path_len = strlen(path);
+	char* path_cpy = (char*)arena_zalloc(path_len + 1);
+	strcpy(path_cpy, path);
+	char* base = basename(path_cpy);
+	char* dir = dirname(path_cpy);
+	if(strcmp(dir, "/") == 0){
+		base = (char*)path;
+		base++;
+	}
+
+	size_t base_len = strlen(base);
+
+	// Step 2: Call get_node_by_path() to get inode of parent directory, locked until the
+	// new entry and inode are written
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, dir, curr_inode) == -1){
+		return -ENOENT;
+	}
+
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	if(dir_find(fs, curr_inode->ino, base, base_len, curr_dirent) == 0){
+		iunlock(fs, curr_inode->ino);
+		return -EEXIST;
+	}
+
+	// Step 3: Call get_avail_ino() to get an available inode number near the parent
+	int avail_ino = get_avail_ino(fs, curr_inode->ino, 0);
+	if(avail_ino == -1){
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+
+	// Step 4: Call dir_add() to add directory entry of target file to parent directory
+	int retval = dir_add(fs, curr_inode, avail_ino, base, base_len);
+	if(retval == -1){
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+
+	writei(fs, curr_inode->ino, curr_inode);
+	// Step 5: Update inode for target file
+	struct inode* new_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	new_inode->ino = avail_ino;
+	new_inode->type = S_IFREG | mode;
+	new_inode->link = 1;
+	new_inode->flags = INODE_INLINE | (curr_inode->flags & INODE_INHERIT);
+	new_inode->valid = 1;
+	new_inode->snap_gen = fs->s_block_mem->snap_gen;
+	new_inode->uid = getuid();
+	new_inode->gid = getgid();
+	new_inode->atime_ns = new_inode->mtime_ns = new_inode->ctime_ns = now_ns();
+	fi->fh = (uint64_t)ra_state_new(fs);
+	// Step 6: Call writei() to write inode to disk
+	writei(fs, avail_ino, new_inode);
+	iunlock(fs, curr_inode->ino);
+
+	return 0;
+}
+
+int rufs_symlink(struct rufs_fs *fs, const char *target, const char *path) {
+	ARENA_SCOPE;
+	if(snap_path(path)){
+		return strcmp(path, SNAP_DIR) == 0 ? -EEXIST : -EROFS;
+	}
+	// Step 1: Use dirname() and basename() to separate parent directory path and link name
+	int path_len = strlen(path);
+	char* path_cpy = (char*)arena_zalloc(path_len + 1);
+	strcpy(path_cpy, path);
+	char* base = basename(path_cpy);
+	char* dir = dirname(path_cpy);
+	if(strcmp(dir, "/") == 0){
+		base = (char*)path;
+		base++;
+	}
+	size_t base_len = strlen(base);
+	size_t target_len = strlen(target);
+	if(target_len >= BLOCK_SIZE){
+		return -ENAMETOOLONG;
+	}
+
+	// Step 2: Call get_node_by_path() to get inode of parent directory, locked until the
+	// link is added
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, dir, curr_inode) == -1){
+		return -ENOENT;
+	}
+
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	if(dir_find(fs, curr_inode->ino, base, base_len, curr_dirent) == 0){
+		iunlock(fs, curr_inode->ino);
+		return -EEXIST;
+	}
+
+	// Step 3: Build the link inode; short targets are stored inline (fast symlink)
+	int avail_ino = get_avail_ino(fs, curr_inode->ino, 0);
+	if(avail_ino == -1){
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+	struct inode* new_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	new_inode->ino = avail_ino;
+	new_inode->type = S_IFLNK | 0777;
+	new_inode->link = 1;
+	new_inode->valid = 1;
+	new_inode->snap_gen = fs->s_block_mem->snap_gen;
+	new_inode->size = target_len;
+	new_inode->uid = getuid();
+	new_inode->gid = getgid();
+	new_inode->atime_ns = new_inode->mtime_ns = new_inode->ctime_ns = now_ns();
+	if(target_len <= INLINE_MAX){
+		new_inode->flags = INODE_INLINE;
+		memcpy(new_inode->inline_data, target, target_len);
+	}
+	else{
+		char* block_buffer = (char*)blk_zget();
+		int blkno = bmap(fs, new_inode, 0, 1);
+		if(blkno == -1){
+			blk_put(block_buffer);
+			reclaim_inode(fs, avail_ino);
+			iunlock(fs, curr_inode->ino);
+			return -ENOSPC;
+		}
+		memcpy(block_buffer, target, target_len);
+		bio_write(fs->dev, blkno, block_buffer);
+		blk_put(block_buffer);
+	}
+	writei(fs, avail_ino, new_inode);
+
+	// Step 4: Call dir_add() to add the link to its parent directory
+	if(dir_add(fs, curr_inode, avail_ino, base, base_len) == -1){
+		release_inode(fs, new_inode);
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+	writei(fs, curr_inode->ino, curr_inode);
+	iunlock(fs, curr_inode->ino);
+
+	return 0;
+}
+
+int rufs_readlink(struct rufs_fs *fs, const char *path, char *buf, size_t size) {
+	ARENA_SCOPE;
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_by_path(fs, path, ROOT_INO, curr_inode) == -1){
+		return -ENOENT;
+	}
+	if(!S_ISLNK(curr_inode->type)){
+		return -EINVAL;
+	}
+
+	// Fast symlinks need no block read; size includes room for the terminator
+	size_t len = curr_inode->size < size - 1 ? curr_inode->size : size - 1;
+	if(curr_inode->flags & INODE_INLINE){
+		memcpy(buf, curr_inode->inline_data, len);
+	}
+	else{
+		char* block_buffer = (char*)blk_get();
+		bio_read(fs->dev, bmap(fs, curr_inode, 0, 0), block_buffer);
+		memcpy(buf, block_buffer, len);
+		blk_put(block_buffer);
+	}
+	buf[len] = '\0';
+
+	return 0;
+}
+
+int rufs_open(struct rufs_fs *fs, const char *path, struct rufs_file *fi) {
+	ARENA_SCOPE;
+	if(strcmp(path, STATS_PATH) == 0){
+		/*Contents change between reads, so bypass the kernel page cache*/
+		fi->direct_io = 1;
+		return (fi->flags & O_ACCMODE) == O_RDONLY ? 0 : -EACCES;
+	}
+
+	if(snap_path(path) && (fi->flags & O_ACCMODE) != O_RDONLY){
+		return -EROFS;
+	}
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_by_path(fs, path, ROOT_INO, curr_inode) == -1){
+		return -ENOENT;
+	}
+	// Step 2: Give the open file its own readahead state, handed back by rufs_release()
+	fi->fh = (uint64_t)ra_state_new(fs);
+	return 0;
+}
+/* 
+ * Copy [offset, offset + size) of inode's data into buffer, holes and unwritten blocks
+ * reading as zeros. Returns the bytes copied, short at a block that failed to read.
+ */
+size_t read_range(struct rufs_fs *fs, struct inode *inode, char *buffer, off_t offset, size_t size) {
+	ARENA_SCOPE;
+	char* block_buffer = (char*)blk_get();
+	struct inode* cur = inode;
+	if(!(inode->flags & INODE_SNAP)){
+		cur = (struct inode*)arena_alloc(sizeof(struct inode));
+	}
+	size_t copied = 0;
+	while(copied < size){
+		uint32_t lblk = (offset + copied) / BLOCK_SIZE;
+		uint32_t blk_off = (offset + copied) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - blk_off;
+		if(chunk > size - copied){
+			chunk = size - copied;
+		}
+		// A page missed here may have just been written back, so map the block through
+		// the inode as it is now rather than the caller's copy
+		if(cur != inode){
+			if(dalloc_read(fs, inode->ino, lblk, buffer + copied, blk_off, chunk)){
+				/*served from a dirty delayed-allocation page*/
+				copied += chunk;
+				continue;
+			}
+			readi(fs, inode->ino, cur);
+		}
+		int blkno = bmap(fs, cur, lblk, 0);
+		if(blkno <= 0 || (blkno & PTR_UNWRITTEN)){
+			memset(buffer + copied, 0, chunk);
+		}
+		else if(blkno & PTR_COMPRESSED){
+			if(cluster_read(fs, cur, lblk, buffer + copied, blk_off, chunk) == -1){
+				break;
+			}
+		}
+		else if(bcache_read(fs, blkno, BCACHE_RAW, buffer + copied, blk_off, chunk)){
+			/*prefetched by readahead*/
+		}
+		else if(bio_read(fs->dev, blkno, block_buffer) < 0){
+			/*Failed checksum: never hand back data the disk can't vouch for*/
+			break;
+		}
+		else{
+			memcpy(buffer + copied, block_buffer + blk_off, chunk);
+		}
+		copied += chunk;
+	}
+	blk_put(block_buffer);
+	return copied;
 }
 
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+static void read_task_run(void *arg) {
+	struct read_task* t = (struct read_task*)arg;
+	t->copied = read_range(t->fs, t->inode, t->buffer, t->offset, t->size);
+}
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(path, ROOT_INO, curr_inode) == -1){
-		free(curr_inode);
+/* 
+ * rufs_read() of a file, with move_lock held
+ */
+static int read_locked(struct rufs_fs *fs, const char *path, char *buffer, size_t size, off_t offset, struct rufs_file *fi) {
+	ARENA_SCOPE;
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_by_path(fs, path, ROOT_INO, curr_inode) == -1){
 		return -ENOENT;
 	}
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
-	memset(block_buffer, 0, BLOCK_SIZE);
-	struct dirent* curr_dirent = (struct dirent*)malloc(sizeof(struct dirent));
-	memset(curr_dirent, 0, sizeof(struct dirent));
+	// Step 2: Based on size and offset, clamp the request to the end of file
+	if(offset >= curr_inode->size){
+		return 0;
+	}
+	if(offset + size > curr_inode->size){
+		size = curr_inode->size - offset;
+	}
 
-	for(int i = 0; i < NUM_DPTRS; i++){
-		if(curr_inode->direct_ptr[i] != 0){
-			bio_read(curr_inode->direct_ptr[i], block_buffer);
-			for(int j = 0; j < s_block_mem->dirents_per_blk; j++){
-				memcpy((void*)curr_dirent, (void*)block_buffer + (j*sizeof(struct dirent)), sizeof(struct dirent));
-				if(curr_dirent->valid == 1){
-					filler(buffer, curr_dirent->name, NULL, 0);
-            	}
+	// Step 3: copy the correct amount of data from offset to buffer, holes and unwritten blocks
+	// read as zeros without disk I/O
+	if(curr_inode->flags & INODE_INLINE){
+		memcpy(buffer, curr_inode->inline_data + offset, size);
+		return size;
+	}
+	if(fi != NULL && fi->fh != 0){
+		ra_update(fs, curr_inode, (struct ra_state*)fi->fh, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE);
+	}
+	size_t copied = 0;
+	if(size < 2 * IO_TASK_BLKS * BLOCK_SIZE){
+		copied = read_range(fs, curr_inode, buffer, offset, size);
+	}
+	else{
+		// Step 3b: Large reads are split into block ranges read across the I/O pool; the
+		// result ends at the first range that came up short
+		uint32_t ntasks = (offset % (IO_TASK_BLKS * BLOCK_SIZE) + size + IO_TASK_BLKS * BLOCK_SIZE - 1) / (IO_TASK_BLKS * BLOCK_SIZE);
+		struct read_task* t = (struct read_task*)arena_zalloc(ntasks * sizeof(struct read_task));
+		struct io_group g;
+		io_group_init(&g);
+		off_t pos = offset;
+		for(uint32_t k = 0; k < ntasks; k++){
+			off_t end = (pos / (IO_TASK_BLKS * BLOCK_SIZE) + 1) * (IO_TASK_BLKS * BLOCK_SIZE);
+			t[k].fs = fs;
+			t[k].inode = curr_inode;
+			t[k].buffer = buffer + (pos - offset);
+			t[k].offset = pos;
+			t[k].size = (end < offset + (off_t)size ? end : offset + (off_t)size) - pos;
+			io_submit(fs, &g, IO_READ, read_task_run, &t[k]);
+			pos += t[k].size;
+		}
+		io_wait(&g);
+		for(uint32_t k = 0; k < ntasks; k++){
+			copied += t[k].copied;
+			if(t[k].copied < t[k].size){
+				break;
 			}
-			memset(block_buffer, 0, BLOCK_SIZE);
 		}
 	}
 
-	free(curr_dirent);
-	free(block_buffer);
-	free(curr_inode);
+	// Note: this function should return the amount of bytes you copied to buffer
+	if(copied == 0 && size > 0){
+		return -EIO;
+	}
+	return copied;
+}
 
-	return 0;
+int rufs_read(struct rufs_fs *fs, const char *path, char *buffer, size_t size, off_t offset, struct rufs_file *fi) {
+	ARENA_SCOPE;
+	if(strcmp(path, STATS_PATH) == 0){
+		char* stats = (char*)arena_alloc(STATS_MAX);
+		int len = format_stats(fs, stats, STATS_MAX);
+		size_t n = offset < len ? len - offset : 0;
+		if(n > size){
+			n = size;
+		}
+		memcpy(buffer, stats + offset, n);
+		return n;
+	}
+	// Step 1: You could call get_node_by_path() to get inode from path. Blocks it maps stay
+	// allocated until the read is done, even if the cleaner or defragmenter moves them
+	pthread_rwlock_rdlock(&fs->move_lock);
+	int retval = read_locked(fs, path, buffer, size, offset, fi);
+	pthread_rwlock_unlock(&fs->move_lock);
+	return retval;
 }
 
-static int rufs_mkdir(const char *path, mode_t mode) {
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	int path_len = strlen(path);
-	char* path_cpy = (char*)calloc(path_len, sizeof(char));
-	strcpy(path_cpy, path);
-	char* base = basename(path_cpy);
-	char* dir = dirname(path_cpy);
-	if(strcmp(dir, "/") == 0){
-		base = (char*)path;
-		base++;
+int rufs_write(struct rufs_fs *fs, const char *path, const char *buffer, size_t size, off_t offset, struct rufs_file *fi) {
+	ARENA_SCOPE;
+	if(snap_path(path)){
+		return -EROFS;
 	}
-	size_t base_len = strlen(base);
-	
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(dir, ROOT_INO, curr_inode) == -1){
-		free(curr_inode);
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, path, curr_inode) == -1){
 		return -ENOENT;
 	}
-
-	struct dirent* curr_dirent = (struct dirent*)calloc(1, sizeof(struct dirent));
-	if(dir_find(curr_inode->ino, base, base_len, curr_dirent) == 0){
-		free(curr_dirent);
-		free(curr_inode);
-		return EEXIST;
+	// Step 2: Based on size and offset, check the write fits in the block map
+	if(offset + size > fs->s_block_mem->max_file_size){
+		iunlock(fs, curr_inode->ino);
+		return -EFBIG;
 	}
-	free(curr_dirent);
 
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int avail_ino = get_avail_ino();
-	if(avail_ino == -1){
-		free(curr_inode);
-		return ENOSPC;
+	// Step 2b: Small files are stored in the inode itself until they outgrow it
+	if(curr_inode->flags & INODE_INLINE){
+		if(offset + size <= INLINE_MAX){
+			memcpy(curr_inode->inline_data + offset, buffer, size);
+			if(offset + size > curr_inode->size){
+				curr_inode->size = offset + size;
+			}
+			curr_inode->atime_ns = now_ns();
+			curr_inode->mtime_ns = curr_inode->ctime_ns = now_ns();
+			writei(fs, curr_inode->ino, curr_inode);
+			iunlock(fs, curr_inode->ino);
+			return size;
+		}
+		if(inline_spill(fs, curr_inode) == -1){
+			iunlock(fs, curr_inode->ino);
+			return -ENOSPC;
+		}
 	}
 
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	int retval = dir_add(curr_inode, avail_ino, base, base_len);
-	if(retval == -1){
-		free(curr_inode);
-		return ENOSPC;
+	// Step 3: Write the correct amount of data from offset to disk. Only the blocks
+	// this write touches are allocated, anything skipped over stays a hole
+	char* block_buffer = (char*)blk_get();
+	memset(block_buffer, 0, BLOCK_SIZE);
+	uint32_t last_lblk = (offset + size - 1) / BLOCK_SIZE;
+	size_t written = 0;
+	int io_error = 0;
+	/*Whole blocks written in place are batched for the I/O pool, see Step 3b*/
+	uint32_t nbatch = 0;
+	int* batch_blk = (int*)arena_alloc((last_lblk - offset / BLOCK_SIZE + 1) * sizeof(int));
+	char** batch_buf = (char**)arena_alloc((last_lblk - offset / BLOCK_SIZE + 1) * sizeof(char*));
+	uint32_t* batch_unwritten = (uint32_t*)arena_alloc((last_lblk - offset / BLOCK_SIZE + 1) * sizeof(uint32_t));
+	uint32_t nunwritten = 0;
+	while(written < size){
+		uint32_t lblk = (offset + written) / BLOCK_SIZE;
+		uint32_t blk_off = (offset + written) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - blk_off;
+		if(chunk > size - written){
+			chunk = size - written;
+		}
+		int ptr = bmap(fs, curr_inode, lblk, 0);
+		int cow = curr_inode->flags & (INODE_COMPRESS | INODE_LOG);
+		if(DELALLOC && (ptr == 0 || (ptr & PTR_UNWRITTEN) || cow)){
+			/*Keep the data in memory; the physical block is chosen at writeback. Compressed
+			  files always go through here since rewriting a block rewrites its cluster, and
+			  log-structured ones since an overwrite gets a new block at the log head.*/
+			const char* base = NULL;
+			if(ptr > 0 && !(ptr & PTR_UNWRITTEN) && chunk < BLOCK_SIZE &&
+			   !dalloc_read(fs, curr_inode->ino, lblk, block_buffer, 0, BLOCK_SIZE)){
+				int r = (ptr & PTR_COMPRESSED) ? cluster_read(fs, curr_inode, lblk, block_buffer, 0, BLOCK_SIZE) : bio_read(fs->dev, ptr, block_buffer);
+				if(r < 0){
+					io_error = 1;
+					break;
+				}
+				base = block_buffer;
+			}
+			if(dalloc_write(fs, curr_inode->ino, lblk, ptr == 0 || cow, ptr == 0, base, buffer + written, blk_off, chunk) == -1){
+				break;
+			}
+			written += chunk;
+			continue;
+		}
+		if(ptr == 0){
+			/*Allocate the whole hole this write covers as one contiguous unwritten run*/
+			uint32_t run = 1;
+			while(lblk + run <= last_lblk && bmap(fs, curr_inode, lblk + run, 0) == 0){
+				run++;
+			}
+			if(bmap_alloc_range(fs, curr_inode, lblk, run, PTR_UNWRITTEN) == -1){
+				break;
+			}
+			ptr = bmap(fs, curr_inode, lblk, 0);
+		}
+		int blkno = PTR_BLKNO(ptr);
+		if(!(ptr & PTR_UNWRITTEN) && (blkno = cow_block(fs, curr_inode, lblk, ptr, chunk < BLOCK_SIZE)) == -1){
+			break;
+		}
+		if(chunk == BLOCK_SIZE){
+			batch_blk[nbatch] = blkno;
+			batch_buf[nbatch++] = (char*)buffer + written;
+			if(ptr & PTR_UNWRITTEN){
+				batch_unwritten[nunwritten++] = lblk;
+			}
+			written += chunk;
+			continue;
+		}
+		if(ptr & PTR_UNWRITTEN){
+			memset(block_buffer, 0, BLOCK_SIZE);
+		}
+		else if(bio_read(fs->dev, blkno, block_buffer) < 0){
+			/*Don't rewrite a corrupt block under a fresh checksum*/
+			io_error = 1;
+			break;
+		}
+		memcpy(block_buffer + blk_off, buffer + written, chunk);
+		bio_write(fs->dev, blkno, block_buffer);
+		bcache_forget(fs, blkno, 1);
+		/*Data is on disk, now the block may stop reading as zeros*/
+		if(ptr & PTR_UNWRITTEN){
+			bmap_set(fs, curr_inode, lblk, blkno);
+		}
+		written += chunk;
 	}
 
-	curr_inode->link++;
-	curr_inode->vstat.st_nlink++;
-	writei(curr_inode->ino, curr_inode);
-
-	// Step 5: Update inode for target directory
-	struct inode* new_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	new_inode->ino = avail_ino;
-	new_inode->type = S_IFDIR | mode;
-	new_inode->link = 2;
-	new_inode->valid = 1;
-	new_inode->vstat.st_uid = getuid();
-	new_inode->vstat.st_gid = getgid();
-	new_inode->vstat.st_mode = S_IFDIR | mode;
-	new_inode->vstat.st_nlink = 2;
-
-	//Add self and parent dirents to target directory
-	if(dir_add(new_inode, new_inode->ino, ".", 1) == -1){
-		free(new_inode);
-		free(curr_inode);
-		return ENOSPC;
+	// Step 3b: Write the batched whole blocks across the I/O pool; only then may unwritten
+	// ones read as data
+	io_blocks(fs, IO_WRITE, 1, batch_blk, batch_buf, nbatch);
+	for(uint32_t k = 0; k < nbatch; k++){
+		bcache_forget(fs, batch_blk[k], 1);
+	}
+	for(uint32_t k = 0; k < nunwritten; k++){
+		int ptr = bmap(fs, curr_inode, batch_unwritten[k], 0);
+		bmap_set(fs, curr_inode, batch_unwritten[k], PTR_BLKNO(ptr));
 	}
 
-	dir_add(new_inode, curr_inode->ino, "..", 2);
-
-	// Step 6: Call writei() to write inode to disk
-	writei(avail_ino, new_inode);
-	
-	free(new_inode);
-	free(curr_inode);
-	free(path_cpy);
-
-	return 0;
-}
-/*OPTIONAL: SKIP*/
-static int rufs_rmdir(const char *path) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-
-	// Step 2: Call get_node_by_path() to get inode of target directory
-
-	// Step 3: Clear data block bitmap of target directory
-
-	// Step 4: Clear inode bitmap and its data block
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
+	// Step 4: Update the inode info and write it to disk, writing back early under memory
+	// pressure; if this file's pages were not enough, other files' go once its lock is dropped
+	if(fs->dalloc_total > DALLOC_MAX_PAGES){
+		dalloc_flush(fs, curr_inode);
+	}
+	if(offset + written > curr_inode->size){
+		curr_inode->size = offset + written;
+	}
+	curr_inode->atime_ns = now_ns();
+	curr_inode->mtime_ns = curr_inode->ctime_ns = now_ns();
+	writei(fs, curr_inode->ino, curr_inode);
+	iunlock(fs, curr_inode->ino);
+	if(fs->dalloc_total > DALLOC_MAX_PAGES){
+		dalloc_balance(fs);
+	}
 
-	return 0;
+	// Note: this function should return the amount of bytes you write to disk
+	blk_put(block_buffer);
+	if(written == 0 && size > 0){
+		return io_error ? -EIO : -ENOSPC;
+	}
+	return written;
 }
 
-static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+int rufs_unlink(struct rufs_fs *fs, const char *path) {
+	ARENA_SCOPE;
+	if(snap_path(path)){
+		return -EROFS;
+	}
 
-static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
 	int path_len = strlen(path);
-	char* path_cpy = (char*)calloc(path_len, sizeof(char));
+	char* path_cpy = (char*)arena_zalloc(path_len + 1);
 	strcpy(path_cpy, path);
 	char* base = basename(path_cpy);
 	char* dir = dirname(path_cpy);
@@ -590,303 +5596,530 @@ static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 		base = (char*)path;
 		base++;
 	}
-
 	size_t base_len = strlen(base);
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(dir, ROOT_INO, curr_inode) == -1){
-		free(curr_inode);
+	// Step 2: Lock the parent directory, then the target file through its entry
+	struct inode* parent_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, dir, parent_inode) == -1){
 		return -ENOENT;
 	}
-
-	struct dirent* curr_dirent = (struct dirent*)calloc(1, sizeof(struct dirent));
-	if(dir_find(curr_inode->ino, base, base_len, curr_dirent) == 0){
-		free(curr_dirent);
-		free(curr_inode);
-		return EEXIST;
+	struct inode* target_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_child_locked(fs, parent_inode, base, base_len, target_inode) == -1){
+		iunlock(fs, parent_inode->ino);
+		return -ENOENT;
 	}
-	free(curr_dirent);
-
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int avail_ino = get_avail_ino();
-	if(avail_ino == -1){
-		free(curr_inode);
-		return ENOSPC;
+	if(S_ISDIR(target_inode->type)){
+		iunlock(fs, target_inode->ino);
+		iunlock(fs, parent_inode->ino);
+		return -EISDIR;
 	}
 
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	int retval = dir_add(curr_inode, avail_ino, base, base_len);
-	if(retval == -1){
-		free(curr_inode);
-		return ENOSPC;
+	// Step 3: Call dir_remove() to remove directory entry of target file in its parent directory
+	if(dir_remove(fs, parent_inode, base, base_len) == -1){
+		iunlock(fs, target_inode->ino);
+		iunlock(fs, parent_inode->ino);
+		return -ENOENT;
 	}
+	parent_inode->mtime_ns = parent_inode->ctime_ns = now_ns();
+	writei(fs, parent_inode->ino, parent_inode);
 
-	writei(curr_inode->ino, curr_inode);
-	// Step 5: Update inode for target file
-	struct inode* new_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	new_inode->ino = avail_ino;
-	new_inode->type = S_IFREG | mode;
-	new_inode->link = 1;
-	new_inode->valid = 1;
-	new_inode->vstat.st_uid = getuid();
-	new_inode->vstat.st_gid = getgid();
-	new_inode->vstat.st_mode = S_IFREG | mode;
-	new_inode->vstat.st_nlink = 1;
-	fi->fh = (uint64_t)new_inode;
-	// Step 6: Call writei() to write inode to disk
-	writei(avail_ino, new_inode);
-	
-	free(new_inode);
-	free(curr_inode);
-	free(path_cpy);
+	// Step 4: Drop the link; the last link hands inode and data blocks to reclamation
+	target_inode->link--;
+	if(target_inode->link == 0){
+		release_inode(fs, target_inode);
+	}
+	else{
+		writei(fs, target_inode->ino, target_inode);
+	}
+	iunlock(fs, target_inode->ino);
+	iunlock(fs, parent_inode->ino);
 
 	return 0;
 }
 
-static int rufs_open(const char *path, struct fuse_file_info *fi) {
-
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(path, ROOT_INO, curr_inode) == -1){
-		free(curr_inode);
-		return -ENOENT;
+int rufs_rename(struct rufs_fs *fs, const char *from, const char *to) {
+	ARENA_SCOPE;
+	if(snap_path(from) || snap_path(to)){
+		return -EROFS;
 	}
-	// Step 2: If not find, return -1
-	fi->fh = (uint64_t)curr_inode;
-	free(curr_inode);
-	return 0;
-}
-/*TODO: FIZ rufs_read(), figure out test_cases*/
-static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(path, ROOT_INO, curr_inode) == -1){
-		free(curr_inode);
-		return -ENOENT;
+	// Step 1: Use dirname() and basename() to separate parent directory paths and names
+	char* src_cpy = (char*)arena_zalloc(strlen(from) + 1);
+	strcpy(src_cpy, from);
+	char* src_base = basename(src_cpy);
+	char* src_dir = dirname(src_cpy);
+	if(strcmp(src_dir, "/") == 0){
+		src_base = (char*)from;
+		src_base++;
 	}
-	// Step 2: Based on size and offset, read its data blocks from disk
-	if(offset > s_block_mem->max_file_size || size > s_block_mem->max_file_size || (offset + size) > s_block_mem->max_file_size){
-		free(curr_inode);
-		return 	EFBIG;
+	char* dst_cpy = (char*)arena_zalloc(strlen(to) + 1);
+	strcpy(dst_cpy, to);
+	char* dst_base = basename(dst_cpy);
+	char* dst_dir = dirname(dst_cpy);
+	if(strcmp(dst_dir, "/") == 0){
+		dst_base = (char*)to;
+		dst_base++;
+	}
+	size_t from_len = strlen(from);
+	if(strlen(src_base) == 0 || strlen(dst_base) == 0 || (strncmp(to, from, from_len) == 0 && to[from_len] == '/')){
+		return -EINVAL;
+	}
+	if(strlen(dst_base) >= sizeof(((struct dirent*)0)->name)){
+		return -ENAMETOOLONG;
 	}
-	uint32_t tot_blks = (offset + size) / BLOCK_SIZE;
-	uint32_t start_blk = offset / BLOCK_SIZE;
-	uint32_t start_offset = offset % BLOCK_SIZE;
-	// Step 3: copy the correct amount of data from offset to buffer
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
-	memset(block_buffer, 0, BLOCK_SIZE);
-	
-	if(tot_blks < 1){
-		bio_read(curr_inode->direct_ptr[0], block_buffer);
-		memcpy((void*)buffer, (void*)block_buffer + start_offset, size);
 
-		fi->fh = (uint64_t)curr_inode;
+	pthread_mutex_lock(&fs->rename_lock);
+	int retval = 0;
+	struct inode* src_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	struct inode* src_parent = (struct inode*)arena_zalloc(sizeof(struct inode));
+	struct inode* dst_parent = (struct inode*)arena_zalloc(sizeof(struct inode));
+	struct inode* victim = (struct inode*)arena_zalloc(sizeof(struct inode));
+	struct dirent* curr_dirent = (struct dirent*)arena_zalloc(sizeof(struct dirent));
+	uint16_t locked[4];
+	int nlocked = 0;
+	int has_victim;
 
-		free(block_buffer);
-		free(curr_inode);
-		return size;
+	// Step 2: Call get_node_by_path() to get the source inode and both parent directories
+retry:
+	if(get_node_by_path(fs, from, ROOT_INO, src_inode) == -1 || get_node_by_path(fs, src_dir, ROOT_INO, src_parent) == -1 ||
+	   get_node_by_path(fs, dst_dir, ROOT_INO, dst_parent) == -1){
+		retval = -ENOENT;
+		goto out;
+	}
+	if(!S_ISDIR(dst_parent->type)){
+		retval = -ENOTDIR;
+		goto out;
 	}
+	int same_dir = (src_parent->ino == dst_parent->ino);
+	has_victim = (dir_find(fs, dst_parent->ino, dst_base, strlen(dst_base), curr_dirent) == 0);
+	victim->ino = has_victim ? curr_dirent->ino : 0;
 
-	int curr_bytes = size;
-	size_t write_amount = BLOCK_SIZE - start_offset;
-	for(int i = start_blk; i < tot_blks; i++){
-		if(i == start_blk){
-			bio_read(curr_inode->direct_ptr[i], block_buffer);
-			curr_bytes -= write_amount;
-			memcpy((void*)buffer, (void*)block_buffer + start_offset, write_amount);
-			memset(block_buffer, 0, BLOCK_SIZE);
+	// Step 2b: Lock both parents, the source and the inode the destination name replaces, in
+	// stripe order. Either name may have changed before the locks were taken; then start over
+	locked[0] = src_parent->ino;
+	locked[1] = dst_parent->ino;
+	locked[2] = src_inode->ino;
+	locked[3] = victim->ino;
+	nlocked = has_victim ? 4 : 3;
+	ilock_all(fs, locked, nlocked);
+	readi(fs, src_parent->ino, src_parent);
+	readi(fs, dst_parent->ino, dst_parent);
+	readi(fs, src_inode->ino, src_inode);
+	if(!src_parent->valid || !dst_parent->valid ||
+	   dir_find(fs, src_parent->ino, src_base, strlen(src_base), curr_dirent) == -1 || curr_dirent->ino != src_inode->ino ||
+	   (dir_find(fs, dst_parent->ino, dst_base, strlen(dst_base), curr_dirent) == 0 ? curr_dirent->ino : 0) != victim->ino){
+		iunlock_all(fs, locked, nlocked);
+		nlocked = 0;
+		goto retry;
+	}
+
+	// Step 3: Check whether the destination name already exists and may be replaced
+	if(has_victim){
+		readi(fs, locked[3], victim);
+		if(victim->ino == src_inode->ino){
+			goto out;
 		}
-		if(curr_bytes > 0 && i > start_blk){
-			bio_read(curr_inode->direct_ptr[i], block_buffer);
-			if(curr_bytes > BLOCK_SIZE){
-				curr_bytes -= BLOCK_SIZE;
-				memcpy((void*)buffer + write_amount, (void*)block_buffer, BLOCK_SIZE);
-				write_amount += BLOCK_SIZE;
-			}
-			else{
-				memcpy((void*)buffer + write_amount, (void*)block_buffer, curr_bytes);
-				curr_bytes -= curr_bytes;
-			}
-			memset(block_buffer, 0, BLOCK_SIZE);
+		if(S_ISDIR(victim->type) && !S_ISDIR(src_inode->type)){
+			retval = -EISDIR;
+			goto out;
+		}
+		if(!S_ISDIR(victim->type) && S_ISDIR(src_inode->type)){
+			retval = -ENOTDIR;
+			goto out;
+		}
+		if(S_ISDIR(victim->type) && !dir_is_empty(fs, victim)){
+			retval = -ENOTEMPTY;
+			goto out;
 		}
 	}
-	fi->fh = (uint64_t)curr_inode;
-	// Note: this function should return the amount of bytes you copied to buffer
-	free(block_buffer);
-	free(curr_inode);
-	return size;
-}
 
-static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode* curr_inode = (struct inode*)calloc(1, sizeof(struct inode));
-	if(get_node_by_path(path, ROOT_INO, curr_inode) == -1){
-		free(curr_inode);
-		return -ENOENT;
-	}
-	// Step 2: Based on size and offset, read its data blocks from disk
-	if(offset > s_block_mem->max_file_size || size > s_block_mem->max_file_size || (offset + size) > s_block_mem->max_file_size){
-		free(curr_inode);
-		return 	EFBIG;
+	// Step 4a: Same directory, rewrite the dirent in place. When replacing, the target
+	// name is repointed first so it never disappears
+	if(same_dir){
+		if(has_victim){
+			dir_update(fs, dst_parent, dst_base, src_inode->ino, NULL);
+			dir_remove(fs, dst_parent, src_base, strlen(src_base));
+		}
+		else{
+			dir_update(fs, dst_parent, src_base, src_inode->ino, dst_base);
+		}
 	}
-	uint32_t tot_blks = (offset + size) / BLOCK_SIZE;
-	uint32_t start_blk = offset / BLOCK_SIZE;
-	uint32_t start_offset = offset % BLOCK_SIZE;
+	// Step 4b: Across directories, log the intent, add at the destination, then remove the source
+	else{
+		pthread_mutex_lock(&fs->alloc_lock);
+		struct rename_intent* log = &fs->s_block_mem->rename_log;
+		memset(log, 0, sizeof(struct rename_intent));
+		log->ino = src_inode->ino;
+		log->src_dir = src_parent->ino;
+		log->dst_dir = dst_parent->ino;
+		log->victim_ino = has_victim ? victim->ino : 0;
+		strcpy(log->src_name, src_base);
+		strcpy(log->dst_name, dst_base);
+		log->active = 1;
+		write_superblock(fs);
+		pthread_mutex_unlock(&fs->alloc_lock);
 
-	// Step 3: Write the correct amount of data from offset to disk
-	char* block_buffer = (char*)malloc(BLOCK_SIZE);
-	memset(block_buffer, 0, BLOCK_SIZE);
-	
-	if(tot_blks < 1){
-		if(curr_inode->direct_ptr[0] == 0){
-			curr_inode->direct_ptr[0] = get_avail_blkno();
-			if(curr_inode->direct_ptr[0] == -1){
-				free(block_buffer);
-				free(curr_inode);
-				return ENOSPC;
-			}
-			curr_inode->size += BLOCK_SIZE;
-			curr_inode->vstat.st_size += BLOCK_SIZE;
-		}
-		bio_read(curr_inode->direct_ptr[0], block_buffer);
-		memcpy((void*)block_buffer + start_offset, (void*)buffer, size);
-		bio_write(curr_inode->direct_ptr[0], block_buffer);
-		memset(block_buffer, 0, BLOCK_SIZE);
-
-		time(&curr_inode->vstat.st_atime);
-		time(&curr_inode->vstat.st_mtime);
-		writei(curr_inode->ino, curr_inode);
-
-		fi->fh = (uint64_t)curr_inode;
+		if(has_victim){
+			dir_update(fs, dst_parent, dst_base, src_inode->ino, NULL);
+		}
+		else if(dir_add(fs, dst_parent, src_inode->ino, dst_base, strlen(dst_base)) == -1){
+			pthread_mutex_lock(&fs->alloc_lock);
+			memset(log, 0, sizeof(struct rename_intent));
+			write_superblock(fs);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			retval = -ENOSPC;
+			goto out;
+		}
+		dir_remove(fs, src_parent, src_base, strlen(src_base));
+		src_parent->mtime_ns = src_parent->ctime_ns = now_ns();
 
-		free(block_buffer);
-		free(curr_inode);
-		return size;
+		if(S_ISDIR(src_inode->type)){
+			dir_update(fs, src_inode, "..", dst_parent->ino, NULL);
+			writei(fs, src_inode->ino, src_inode);
+			src_parent->link--;
+			dst_parent->link++;
+		}
+		writei(fs, src_parent->ino, src_parent);
 	}
 
-	int curr_bytes = size;
-	size_t write_amount = BLOCK_SIZE - start_offset;
-	for(int i = 0; i < tot_blks; i++){
-		if(curr_inode->direct_ptr[i] == 0){
-			curr_inode->direct_ptr[i] = get_avail_blkno();
-			if(curr_inode->direct_ptr[i] == -1){
-				free(block_buffer);
-				free(curr_inode);
-				return ENOSPC;
-			}
-			curr_inode->size += BLOCK_SIZE;
-			curr_inode->vstat.st_size += BLOCK_SIZE;
-		}
-		if(i == start_blk){
-			bio_read(curr_inode->direct_ptr[i], block_buffer);
-			curr_bytes -= write_amount;
-			memcpy((void*)block_buffer + start_offset, (void*)buffer,  write_amount);
-			bio_write(curr_inode->direct_ptr[i], block_buffer);
-			memset(block_buffer, 0, BLOCK_SIZE);
+	// Step 5: Release the replaced inode, taking it out of the intent log first so
+	// rename_recover() never releases it again
+	if(has_victim){
+		if(!same_dir){
+			pthread_mutex_lock(&fs->alloc_lock);
+			fs->s_block_mem->rename_log.victim_ino = 0;
+			write_superblock(fs);
+			pthread_mutex_unlock(&fs->alloc_lock);
 		}
-		if(curr_bytes > 0 && i > start_blk){
-			bio_read(curr_inode->direct_ptr[i], block_buffer);
-			if(curr_bytes > BLOCK_SIZE){
-				curr_bytes -= BLOCK_SIZE;
-				memcpy((void*)block_buffer, (void*)buffer + write_amount,  BLOCK_SIZE);
-				write_amount += BLOCK_SIZE;
-			}
-			else{
-				memcpy((void*)block_buffer, (void*)buffer + write_amount,  curr_bytes);
-				curr_bytes -= curr_bytes;
-			}
-			bio_write(curr_inode->direct_ptr[i], block_buffer);
-			memset(block_buffer, 0, BLOCK_SIZE);
+		if(S_ISDIR(victim->type)){
+			dst_parent->link--;
 		}
+		victim->link = 0;
+		release_inode(fs, victim);
 	}
+	writei(fs, dst_parent->ino, dst_parent);
 
-	// Step 4: Update the inode info and write it to disk
-	time(&curr_inode->vstat.st_atime);
-	time(&curr_inode->vstat.st_mtime);
-	writei(curr_inode->ino, curr_inode);
-	// Note: this function should return the amount of bytes you write to disk
-	fi->fh = (uint64_t)curr_inode;
+	if(!same_dir){
+		pthread_mutex_lock(&fs->alloc_lock);
+		memset(&fs->s_block_mem->rename_log, 0, sizeof(struct rename_intent));
+		write_superblock(fs);
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
 
-	free(block_buffer);
-	free(curr_inode);
-	return size;
+out:
+	iunlock_all(fs, locked, nlocked);
+	pthread_mutex_unlock(&fs->rename_lock);
+	return retval;
 }
 
-/*OPTIONAL: SKIP*/
-static int rufs_unlink(const char *path) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-
-	// Step 2: Call get_node_by_path() to get inode of target file
-
-	// Step 3: Clear data block bitmap of target file
-
-	// Step 4: Clear inode bitmap and its data block
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
+int rufs_truncate(struct rufs_fs *fs, const char *path, off_t size) {
+	ARENA_SCOPE;
+	if(snap_path(path)){
+		return -EROFS;
+	}
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, path, curr_inode) == -1){
+		return -ENOENT;
+	}
+	if(S_ISDIR(curr_inode->type)){
+		iunlock(fs, curr_inode->ino);
+		return -EISDIR;
+	}
+	if(size < 0 || size > fs->s_block_mem->max_file_size){
+		iunlock(fs, curr_inode->ino);
+		return -EFBIG;
+	}
 
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+	// Shrinking frees everything past the new end, growing just leaves a hole
+	if((curr_inode->flags & INODE_INLINE) && size > INLINE_MAX && inline_spill(fs, curr_inode) == -1){
+		iunlock(fs, curr_inode->ino);
+		return -ENOSPC;
+	}
+	if(size < curr_inode->size){
+		dalloc_drop(fs, curr_inode->ino, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		dalloc_flush(fs, curr_inode);
+		punch_range(fs, curr_inode, size, (off_t)fs->s_block_mem->max_file_size - size);
+	}
+	curr_inode->size = size;
+	curr_inode->mtime_ns = curr_inode->ctime_ns = now_ns();
+	writei(fs, curr_inode->ino, curr_inode);
+	iunlock(fs, curr_inode->ino);
 
 	return 0;
 }
 
-static int rufs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+int rufs_release(struct rufs_fs *fs, const char *path, struct rufs_file *fi) {
+	// Drop the readahead state set up by rufs_open() or rufs_create()
+	if(fi->fh != 0){
+		ra_state_put(fs, (struct ra_state*)fi->fh);
+		fi->fh = 0;
+	}
+	return 0;
 }
 
-static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+int rufs_flush(struct rufs_fs *fs, const char *path, struct rufs_file *fi) {
+	ARENA_SCOPE;
+	// Write back delayed-allocation pages when the file is closed
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_by_path(fs, path, ROOT_INO, curr_inode) == -1){
+		return -ENOENT;
+	}
+	int retval = (curr_inode->flags & INODE_SNAP) ? 0 : dalloc_sync_ino(fs, curr_inode->ino);
+	return retval;
 }
 
-static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+int rufs_fsync(struct rufs_fs *fs, const char *path, int datasync, struct rufs_file *fi) {
+	// Write back the file, then the block checksums that changed with it
+	int retval = rufs_flush(fs, path, fi);
+	dev_sync(fs->dev);
+	return retval;
 }
 
-static int rufs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+int rufs_utimens(struct rufs_fs *fs, const char *path, const struct timespec tv[2]) {
+	ARENA_SCOPE;
+	if(snap_path(path)){
+		return -EROFS;
+	}
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, path, curr_inode) == -1){
+		return -ENOENT;
+	}
+
+	// tv[0] is atime, tv[1] mtime; UTIME_NOW and UTIME_OMIT are honoured
+	int64_t now = now_ns();
+	int64_t* stamps[2] = {&curr_inode->atime_ns, &curr_inode->mtime_ns};
+	for(int i = 0; i < 2; i++){
+		if(tv == NULL || tv[i].tv_nsec == UTIME_NOW){
+			*stamps[i] = now;
+		}
+		else if(tv[i].tv_nsec != UTIME_OMIT){
+			*stamps[i] = (int64_t)tv[i].tv_sec * 1000000000LL + tv[i].tv_nsec;
+		}
+	}
+	curr_inode->ctime_ns = now;
+	writei(fs, curr_inode->ino, curr_inode);
+	iunlock(fs, curr_inode->ino);
+
+	return 0;
 }
 
 
-static struct fuse_operations rufs_ope = {
-	.init		= rufs_init,
-	.destroy	= rufs_destroy,
+/* 
+ * Preallocate [offset, offset + len) as unwritten blocks. Every hole in the range is
+ * allocated in contiguous runs; data already there is left alone.
+ */
+int prealloc_range(struct rufs_fs *fs, struct inode *inode, off_t offset, off_t len) {
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t last = (offset + len - 1) / BLOCK_SIZE;
+
+	// Step 1: Count the holes so a request that cannot be met fails before allocating anything
+	int holes = 0;
+	for(uint32_t lblk = first; lblk <= last; lblk++){
+		if(bmap(fs, inode, lblk, 0) == 0){
+			holes++;
+		}
+	}
+	if(holes > free_blk_count(fs)){
+		return -ENOSPC;
+	}
 
-	.getattr	= rufs_getattr,
-	.readdir	= rufs_readdir,
-	.opendir	= rufs_opendir,
-	.releasedir	= rufs_releasedir,
-	.mkdir		= rufs_mkdir,
-	.rmdir		= rufs_rmdir,
+	// Step 2: Allocate each run of holes
+	for(uint32_t lblk = first; lblk <= last; lblk++){
+		if(bmap(fs, inode, lblk, 0) != 0){
+			continue;
+		}
+		uint32_t run = 1;
+		while(lblk + run <= last && bmap(fs, inode, lblk + run, 0) == 0){
+			run++;
+		}
+		int got = bmap_alloc_range(fs, inode, lblk, run, PTR_UNWRITTEN);
+		if(got == -1){
+			return -ENOSPC;
+		}
+		lblk += got - 1;
+	}
+	return 0;
+}
 
-	.create		= rufs_create,
-	.open		= rufs_open,
-	.read 		= rufs_read,
-	.write		= rufs_write,
-	.unlink		= rufs_unlink,
+int rufs_fallocate(struct rufs_fs *fs, const char *path, int mode, off_t offset, off_t len, struct rufs_file *fi) {
+	ARENA_SCOPE;
+	if(snap_path(path)){
+		return -EROFS;
+	}
+	if(mode != 0 && mode != FALLOC_FL_KEEP_SIZE && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)){
+		return -EOPNOTSUPP;
+	}
+	if(offset < 0 || len <= 0){
+		return -EINVAL;
+	}
+	if(offset + len > fs->s_block_mem->max_file_size){
+		return -EFBIG;
+	}
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, path, curr_inode) == -1){
+		return -ENOENT;
+	}
+	if(S_ISDIR(curr_inode->type)){
+		iunlock(fs, curr_inode->ino);
+		return -EISDIR;
+	}
 
-	.truncate   = rufs_truncate,
-	.flush      = rufs_flush,
-	.utimens    = rufs_utimens,
-	.release	= rufs_release
-};
+	int retval = 0;
+	if(mode & FALLOC_FL_PUNCH_HOLE){
+		// Punch hole: nothing past the end of file needs freeing
+		dalloc_flush(fs, curr_inode);
+		if(offset < curr_inode->size){
+			if(offset + len > curr_inode->size){
+				len = curr_inode->size - offset;
+			}
+			punch_range(fs, curr_inode, offset, len);
+		}
+	}
+	else{
+		// Preallocate; posix_fallocate (mode 0) also extends the file size. Space inside an
+		// inline inode is already there
+		if((curr_inode->flags & INODE_INLINE) && offset + len > INLINE_MAX && inline_spill(fs, curr_inode) == -1){
+			retval = -ENOSPC;
+		}
+		else if(!(curr_inode->flags & INODE_INLINE)){
+			retval = prealloc_range(fs, curr_inode, offset, len);
+		}
+		if(retval == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > curr_inode->size){
+			curr_inode->size = offset + len;
+		}
+	}
+	curr_inode->mtime_ns = curr_inode->ctime_ns = now_ns();
+	writei(fs, curr_inode->ino, curr_inode);
+	iunlock(fs, curr_inode->ino);
 
+	return retval;
+}
 
-int main(int argc, char *argv[]) {
-	int fuse_stat;
+int rufs_ioctl(struct rufs_fs *fs, const char *path, int cmd, void *data) {
+	ARENA_SCOPE;
+	struct inode* curr_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+	if(get_node_locked(fs, path, curr_inode) == -1){
+		return -ENOENT;
+	}
 
-	getcwd(diskfile_path, PATH_MAX);
-	strcat(diskfile_path, "/DISKFILE");
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	int retval = 0;
+	if(curr_inode->flags & INODE_SNAP){
+		// Snapshot trees can be queried but not changed
+		if((unsigned int)cmd != RUFS_IOC_SEEK_DATA && (unsigned int)cmd != RUFS_IOC_SEEK_HOLE && (unsigned int)cmd != FS_IOC_GETFLAGS){
+			return -EROFS;
+		}
+	}
+	else if(fs->dalloc_pages[curr_inode->ino] > 0){
+		dalloc_flush(fs, curr_inode);
+		writei(fs, curr_inode->ino, curr_inode);
+	}
+	switch((unsigned int)cmd){
+		case RUFS_IOC_SEEK_DATA:
+		case RUFS_IOC_SEEK_HOLE: {
+			int whence = ((unsigned int)cmd == RUFS_IOC_SEEK_DATA) ? SEEK_DATA : SEEK_HOLE;
+			off_t pos = seek_data_hole(fs, curr_inode, *(int64_t*)data, whence);
+			if(pos < 0){
+				retval = pos;
+			}
+			else{
+				*(int64_t*)data = pos;
+			}
+			break;
+		}
+		case RUFS_IOC_DEDUP_MODE:
+			curr_inode->flags = *(int*)data ? (curr_inode->flags | INODE_DEDUP) : (curr_inode->flags & ~INODE_DEDUP);
+			curr_inode->ctime_ns = now_ns();
+			writei(fs, curr_inode->ino, curr_inode);
+			break;
+		case RUFS_IOC_LOG_MODE:
+			curr_inode->flags = *(int*)data ? (curr_inode->flags | INODE_LOG) : (curr_inode->flags & ~INODE_LOG);
+			curr_inode->ctime_ns = now_ns();
+			writei(fs, curr_inode->ino, curr_inode);
+			break;
+		case RUFS_IOC_DEDUP:
+			if(S_ISDIR(curr_inode->type)){
+				retval = -EISDIR;
+				break;
+			}
+			*(int64_t*)data = dedup_inode(fs, curr_inode);
+			writei(fs, curr_inode->ino, curr_inode);
+			break;
+		case RUFS_IOC_CLONE_RANGE: {
+			struct rufs_clone_range* cr = (struct rufs_clone_range*)data;
+			struct inode* src_inode = (struct inode*)arena_zalloc(sizeof(struct inode));
+			cr->src_path[PATH_MAX - 1] = '\0';
+			if(get_node_by_path(fs, cr->src_path, ROOT_INO, src_inode) == -1){
+				retval = -ENOENT;
+			}
+			else if(!S_ISREG(src_inode->type) || !S_ISREG(curr_inode->type)){
+				retval = -EINVAL;
+			}
+			else{
+				int relock = !(src_inode->flags & INODE_SNAP);
+				if(relock && ilock_also(fs, curr_inode->ino, src_inode->ino)){
+					readi(fs, curr_inode->ino, curr_inode);
+				}
+				if(relock){
+					readi(fs, src_inode->ino, src_inode);
+				}
+				retval = clone_range(fs, src_inode, curr_inode, cr->src_off, cr->dst_off, cr->len);
+				if(relock){
+					iunlock(fs, src_inode->ino);
+				}
+			}
+			break;
+		}
+		case RUFS_IOC_DEFRAG: {
+			// A file is defragmented on its own, a directory stands for the whole file system
+			struct defrag_tally t = {0};
+			if(S_ISDIR(curr_inode->type)){
+				iunlock(fs, curr_inode->ino);
+				defrag_all(fs, &t);
+				ilock(fs, curr_inode->ino);
+			}
+			else{
+				defrag_inode(fs, curr_inode->ino, &t);
+				readi(fs, curr_inode->ino, curr_inode);
+			}
+			struct rufs_defrag* df = (struct rufs_defrag*)data;
+			df->frag_before = t.steps == 0 ? 0 : t.before * 1000 / t.steps;
+			df->frag_after = t.steps == 0 ? 0 : t.after * 1000 / t.steps;
+			df->files = t.files;
+			df->blocks = t.blocks;
+			break;
+		}
+		case FS_IOC_GETFLAGS:
+			*(int*)data = (curr_inode->flags & INODE_COMPRESS) ? FS_COMPR_FL : 0;
+			break;
+		case FS_IOC_SETFLAGS: {
+			// chattr +c / -c; existing data is converted when compression is turned off
+			int compress = (*(int*)data & FS_COMPR_FL) ? INODE_COMPRESS : 0;
+			if(compress && !DELALLOC){
+				retval = -EOPNOTSUPP;
+				break;
+			}
+			if(!compress && (curr_inode->flags & INODE_COMPRESS) && !S_ISDIR(curr_inode->type)){
+				uint32_t clusters = (curr_inode->size + CLUSTER_BLKS * BLOCK_SIZE - 1) / (CLUSTER_BLKS * BLOCK_SIZE);
+				for(uint32_t cl = 0; cl < clusters && retval == 0; cl++){
+					retval = cluster_unpack(fs, curr_inode, cl);
+				}
+			}
+			if(retval == 0){
+				curr_inode->flags = (curr_inode->flags & ~INODE_COMPRESS) | compress;
+				curr_inode->ctime_ns = now_ns();
+			}
+			writei(fs, curr_inode->ino, curr_inode);
+			break;
+		}
+		default:
+			retval = -ENOTTY;
+	}
 
-	return fuse_stat;
+	if(!(curr_inode->flags & INODE_SNAP)){
+		iunlock(fs, curr_inode->ino);
+	}
+	return retval;
 }
 
+void rufs_dev_stats(struct rufs_fs *fs, struct dev_stats *stats) {
+	dev_get_stats(fs->dev, stats);
+}
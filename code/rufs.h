@@ -8,6 +8,8 @@
 
 #include <linux/limits.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #ifndef _TFS_H
@@ -16,34 +18,135 @@
 #define MAGIC_NUM 0x5C3A
 #define MAX_INUM 1024 //Max inode data structures (not blocks)
 #define MAX_DNUM 16384 //16384 //8192 //Max data blocks
-#define NUM_DPTRS 16
+#define NUM_DPTRS 12
+#define NUM_IPTRS 2
+#define INODE_SIZE 128 //On-disk inode size in bytes
+#define INODE_VERSION 1 //Bumped whenever struct inode changes layout
+#define PTRS_PER_BLK (BLOCK_SIZE / sizeof(int)) //Block pointers held by one indirect block
+#define PTR_UNWRITTEN 0x40000000 //Block pointer flag: allocated by fallocate, reads as zeros until written
+#define PTR_COMPRESSED 0x20000000 //Block pointer flag: slot of a compressed cluster, block number may be 0
+#define PTR_BLKNO(p) ((p) & ~(PTR_UNWRITTEN | PTR_COMPRESSED))
+#define INLINE_MAX (sizeof(int) * (NUM_DPTRS + NUM_IPTRS + 1)) //Bytes of file data the inode can hold itself
+#define INODE_INLINE 0x1 //Inode flag: data lives in inline_data instead of blocks
+#define INODE_COMPRESS 0x2 //Inode flag: data is written as compressed clusters, new children inherit it
+#define INODE_DEDUP 0x4 //Inode flag: blocks are shared with identical indexed blocks at writeback
+#define INODE_SNAP 0x8 //In-memory only: inode was read from a snapshot and is never written back
+#define INODE_LOG 0x10 //Inode flag: data is never overwritten in place but appended at the log head; metadata still is
+#define INODE_INHERIT (INODE_COMPRESS | INODE_DEDUP | INODE_LOG) //Flags a new file or directory takes from its parent
+#define CLUSTER_BLKS 4 //Logical blocks compressed as one unit
+#define CLUSTER_MAGIC 0x4C5A4331
+#define BCACHE_SLOTS 1024 //Clean file blocks held by the block cache
+#define BCACHE_RAW CLUSTER_BLKS //Block cache slot tag of a plain, uncompressed block
+#define RA_MIN_BLKS 4 //Readahead window a sequential reader starts with
+#define RA_MAX_BLKS 64 //Largest readahead window, well below BCACHE_SLOTS
+#define RA_QUEUE 32 //Pending prefetch requests; more are dropped
+#define RA_STATES 256 //Open files given readahead state; files opened beyond that read without it
+#define DCACHE_SLOTS 1024 //Directory entries held by the dentry cache
+#define CT_SHARDS 64 //Writer locks and sequence counts each cache table is split over
+#define ARENA_CHUNK (64 * 1024) //Bytes of a thread's request arena; larger requests chain more chunks
+#define BLK_POOL 16 //Free block buffers each thread keeps for reuse
+#define DELALLOC 1 //Buffer writes into unallocated blocks and pick physical blocks at writeback
+#define DALLOC_MAX_PAGES 1024 //Dirty delayed-allocation pages held before a writer is made to flush
+#define DALLOC_HASH 1024 //Buckets in the delayed-allocation page hash
+#define FP_HASH 4096 //Buckets in the in-memory view of the fingerprint index
+#define MAX_ORPHANS 256 //Max unlinked inodes awaiting reclamation
+#define RECLAIM_SYNC_BLKS 4 //Files with at most this many blocks are freed inline on unlink
+#define SEG_BLKS 256 //Data blocks per log segment
+#define LOG_MIN_CLEAN 4 //Clean segments the segment cleaner tries to keep in reserve
+#define LOG_CLEAN_LIVE (SEG_BLKS / 4) //Only segments with at most this many live blocks are cleaned
+#define ILOCKS 64 //Stripes of the per-inode locks
+#define IO_WORKERS 4 //Threads in the I/O pool
+#define IO_QUEUE 64 //Tasks each I/O worker's deque holds
+#define IO_TASK_BLKS 16 //Blocks per task when a large transfer is split across the pool
+#define DEFRAG_BATCH 64 //Blocks the defragmenter copies per round of pool I/O
+#define TIER_SCAN_SECS 5 //Seconds between tier migrator passes
+#define TIER_FREE_PCT 25 //Share of the fast tier the migrator keeps free by demoting cold blocks
+#define TIER_HOT 4 //Heat at which a slow block is promoted; new blocks start this hot
+#define TIER_HEAT_MAX 16 //Heat stops rising here, so hits on a hot block stop dirtying its counter
+#define ITABLE_BLKS (MAX_INUM * INODE_SIZE / BLOCK_SIZE) //Blocks of the inode table
+#define GROUPS ITABLE_BLKS //Placement groups: the inodes of one inode table block and a slice of the data region
+#define MAX_SNAPS 16 //Max snapshots kept at once
 
 
+struct rename_intent {
+	uint16_t	active;				/* nonzero while a cross-directory rename is in flight */
+	uint16_t	ino;				/* inode being moved */
+	uint16_t	src_dir;			/* inode number of source parent directory */
+	uint16_t	dst_dir;			/* inode number of destination parent directory */
+	uint16_t	victim_ino;			/* inode replaced at the destination, 0 if none */
+	char		src_name[208];		/* source name */
+	char		dst_name[208];		/* destination name */
+};
+
+/*
+ * A snapshot shares the live inode table until a block of it is about to change; the old
+ * contents are then saved to the snapshot's reserved block first
+ */
+struct snapshot {
+	char		name[24];			/* entry under SNAP_DIR, NUL terminated */
+	uint32_t	gen;				/* snap_gen assigned when it was taken */
+	uint32_t	copied;				/* bit b set once inode table block b lives in itab[b] */
+	int64_t		ctime_ns;			/* creation time */
+	uint32_t	itab[ITABLE_BLKS];	/* blocks reserved for the inode table as it was */
+};
+
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
 	uint16_t	max_inum;			/* maximum inode number */
 	uint16_t	max_dnum;			/* maximum data block number */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
+	uint32_t	d_refcnt_blk;		/* start block of data block reference counts (0 = free) */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
 	uint32_t    inodes_per_blk;     /* number of inodes that can fit in one block */
 	uint32_t    dirents_per_blk;    /* number of dirents that can fit in one block */
-	uint32_t    max_file_size;      /* maximum file size based on NUM_DPTRS */
+	uint32_t    inode_size;         /* size of an on-disk inode, INODE_SIZE */
+	uint32_t    inode_version;      /* inode layout version, INODE_VERSION */
+	uint64_t    max_file_size;      /* maximum file size based on the block map */
 	uint32_t    total_blocks_alloc; /* tracker for how many blocks (metadata, userdata) have been allocated so far*/
+	uint32_t    orphan_cnt;         /* number of unlinked inodes waiting to be reclaimed */
+	uint16_t    orphans[MAX_ORPHANS]; /* orphan list: inode numbers whose blocks are not yet freed */
+	struct rename_intent rename_log; /* one-record journal for cross-directory rename */
+	uint32_t    d_refcnt_blks;      /* blocks of reference counts, one uint16_t per data block */
+	uint32_t    fp_blk;             /* start block of the dedup fingerprint index */
+	uint32_t    fp_blks;            /* blocks of fingerprints, one uint32_t per data block */
+	uint32_t    snap_gen;           /* generation of the newest snapshot, 0 before the first */
+	uint32_t    snap_cnt;           /* number of snapshots in snaps */
+	struct snapshot snaps[MAX_SNAPS]; /* snapshots, oldest first */
+	uint32_t    log_head;           /* data block index the log appends at next, checkpointed */
 };
 
+/*
+ * On-disk inode: fixed width, 128 bytes, independent of the host struct stat
+ */
 struct inode {
 	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
-	uint32_t	link;				/* link count */
-	int			direct_ptr[NUM_DPTRS]; /* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		version;			/* on-disk layout version, INODE_VERSION */
+	uint32_t	type;				/* type and permission bits of the file (st_mode) */
+	uint16_t	link;				/* link count */
+	uint16_t	flags;				/* INODE_* flags */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint32_t	blocks;				/* blocks allocated, including indirect blocks */
+	uint64_t	size;				/* size of the file */
+	int64_t		atime_ns;			/* last access, ns since the epoch */
+	int64_t		mtime_ns;			/* last modification */
+	int64_t		ctime_ns;			/* last status change */
+	union {
+		struct {
+			int		direct_ptr[NUM_DPTRS]; /* direct pointer to data block */
+			int		indirect_ptr[NUM_IPTRS]; /* indirect pointer to data block */
+			int		dindirect_ptr;	/* double indirect pointer */
+		};
+		char		inline_data[sizeof(int) * (NUM_DPTRS + NUM_IPTRS + 1)]; /* file data when INODE_INLINE is set */
+	};
+	uint32_t	snap_gen;			/* snapshot generation its block references were last charged at */
+	uint32_t	reserved[2];		/* zero, room for later versions */
 };
 
+_Static_assert(sizeof(struct inode) == INODE_SIZE, "on-disk inode must stay INODE_SIZE bytes");
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
@@ -51,6 +154,54 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * Start of the first block of a compressed cluster. The payload continues through the
+ * cluster's remaining blocks in slot order.
+ */
+struct cluster_hdr {
+	uint32_t magic;
+	uint32_t clen;					/* compressed bytes following the header */
+};
+
+/*
+ * ioctl commands; for SEEK_DATA/SEEK_HOLE the int64_t argument carries the offset in and the result out
+ */
+#define RUFS_IOC_SEEK_DATA _IOWR('R', 1, int64_t) /* lseek(SEEK_DATA), FUSE 2 has no lseek hook */
+#define RUFS_IOC_SEEK_HOLE _IOWR('R', 2, int64_t) /* lseek(SEEK_HOLE) */
+#define RUFS_IOC_DEDUP_MODE _IOW('R', 3, int) /* nonzero turns inline dedup on for the file or directory */
+#define RUFS_IOC_DEDUP _IOR('R', 4, int64_t) /* dedup the file's blocks now, returns blocks merged */
+
+/* Argument of RUFS_IOC_CLONE_RANGE, issued on the destination file. Offsets are block
+ * aligned; len is too unless the range ends at the source's end of file. */
+struct rufs_clone_range {
+	int64_t src_off;
+	int64_t dst_off;
+	int64_t len;					/* 0 clones through the end of the source */
+	char src_path[PATH_MAX];		/* source path inside the file system, e.g. "/dir/file" */
+};
+#define RUFS_IOC_CLONE_RANGE _IOW('R', 5, struct rufs_clone_range) /* share blocks instead of copying */
+#define RUFS_IOC_LOG_MODE _IOW('R', 6, int) /* nonzero turns log-structured writes on for the file or directory */
+
+/* Result of RUFS_IOC_DEFRAG. Scores are the permille of consecutive mapped blocks that are
+ * not adjacent on disk, over the files looked at; 0 means every file is one extent. */
+struct rufs_defrag {
+	int64_t frag_before;
+	int64_t frag_after;
+	int64_t files;					/* files rewritten into one extent */
+	int64_t blocks;					/* blocks moved */
+};
+#define RUFS_IOC_DEFRAG _IOR('R', 7, struct rufs_defrag) /* on a file: defragment it; on a directory: the whole file system */
+
+/* Inode attribute flags as used by chattr/lsattr; <linux/fs.h> would clash with BLOCK_SIZE */
+#ifndef FS_IOC_GETFLAGS
+#define FS_IOC_GETFLAGS _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS _IOW('f', 2, long)
+#define FS_COMPR_FL 0x00000004 /* compress file data */
+#endif
+
+
+/* Declares a scope whose arena allocations are all handed back when the enclosing function returns */
+#define ARENA_SCOPE size_t arena_mark_ __attribute__((cleanup(arena_release))) = arena_used
 
 /*
  * bitmap operations
@@ -0,0 +1,237 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	rufs_fuse.c
+ *
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "block.h"
+#include "librufs.h"
+
+/*
+ * FUSE frontend: each operation passes through to librufs with the handle rufs_mount()
+ * returned as the FUSE private data
+ */
+static struct rufs_fs* fs() {
+	return (struct rufs_fs*)fuse_get_context()->private_data;
+}
+
+/*
+ * Carry the fields librufs looks at from FUSE's open file into its own and back
+ */
+static struct rufs_file* file_in(struct fuse_file_info *fi, struct rufs_file *f) {
+	if(fi == NULL){
+		return NULL;
+	}
+	f->flags = fi->flags;
+	f->direct_io = fi->direct_io;
+	f->fh = fi->fh;
+	return f;
+}
+
+static int file_out(struct fuse_file_info *fi, struct rufs_file *f, int retval) {
+	if(fi != NULL){
+		fi->direct_io = f->direct_io;
+		fi->fh = f->fh;
+	}
+	return retval;
+}
+
+static void *op_init(struct fuse_conn_info *conn) {
+	struct rufs_fs* mnt = rufs_mount((const char*)fuse_get_context()->private_data);
+	if(mnt == NULL){
+		exit(EXIT_FAILURE);
+	}
+	return mnt;
+}
+
+static void op_destroy(void *userdata) {
+	rufs_unmount((struct rufs_fs*)userdata);
+}
+
+static int op_getattr(const char *path, struct stat *stbuf) {
+	return rufs_getattr(fs(), path, stbuf);
+}
+
+static int op_opendir(const char *path, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_opendir(fs(), path, file_in(fi, &f)));
+}
+
+static int op_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_readdir(fs(), path, buffer, filler, offset, file_in(fi, &f)));
+}
+
+static int op_releasedir(const char *path, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_releasedir(fs(), path, file_in(fi, &f)));
+}
+
+static int op_mkdir(const char *path, mode_t mode) {
+	return rufs_mkdir(fs(), path, mode);
+}
+
+static int op_rmdir(const char *path) {
+	return rufs_rmdir(fs(), path);
+}
+
+static int op_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_create(fs(), path, mode, file_in(fi, &f)));
+}
+
+static int op_symlink(const char *target, const char *path) {
+	return rufs_symlink(fs(), target, path);
+}
+
+static int op_readlink(const char *path, char *buf, size_t size) {
+	return rufs_readlink(fs(), path, buf, size);
+}
+
+static int op_open(const char *path, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_open(fs(), path, file_in(fi, &f)));
+}
+
+static int op_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_read(fs(), path, buffer, size, offset, file_in(fi, &f)));
+}
+
+static int op_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_write(fs(), path, buffer, size, offset, file_in(fi, &f)));
+}
+
+static int op_unlink(const char *path) {
+	return rufs_unlink(fs(), path);
+}
+
+static int op_rename(const char *from, const char *to) {
+	return rufs_rename(fs(), from, to);
+}
+
+static int op_truncate(const char *path, off_t size) {
+	return rufs_truncate(fs(), path, size);
+}
+
+static int op_release(const char *path, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_release(fs(), path, file_in(fi, &f)));
+}
+
+static int op_flush(const char *path, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_flush(fs(), path, file_in(fi, &f)));
+}
+
+static int op_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_fsync(fs(), path, datasync, file_in(fi, &f)));
+}
+
+static int op_utimens(const char *path, const struct timespec tv[2]) {
+	return rufs_utimens(fs(), path, tv);
+}
+
+static int op_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	struct rufs_file f;
+	return file_out(fi, &f, rufs_fallocate(fs(), path, mode, offset, len, file_in(fi, &f)));
+}
+
+static int op_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	return rufs_ioctl(fs(), path, cmd, data);
+}
+
+
+static struct fuse_operations rufs_ope = {
+	.init		= op_init,
+	.destroy	= op_destroy,
+
+	.getattr	= op_getattr,
+	.readlink	= op_readlink,
+	.symlink	= op_symlink,
+	.readdir	= op_readdir,
+	.opendir	= op_opendir,
+	.releasedir	= op_releasedir,
+	.mkdir		= op_mkdir,
+	.rmdir		= op_rmdir,
+
+	.create		= op_create,
+	.open		= op_open,
+	.read 		= op_read,
+	.write		= op_write,
+	.unlink		= op_unlink,
+	.rename		= op_rename,
+
+	.truncate   = op_truncate,
+	.flush      = op_flush,
+	.fsync      = op_fsync,
+	.utimens    = op_utimens,
+	.release	= op_release,
+	.fallocate	= op_fallocate,
+	.ioctl		= op_ioctl
+};
+
+
+int main(int argc, char *argv[]) {
+	int fuse_stat;
+
+	// --ram keeps the disk image in memory; --stripe=FILE (repeatable) and --stripe-unit=BLKS
+	// stripe it over DISKFILE and more member files; --tier=FILE and --tier-fast=BLKS keep all
+	// but the first blocks in a slow FILE. Take them out before FUSE parses the rest
+	const char* members[MAX_STRIPES];
+	const char* slow = NULL;
+	int nmembers = 0, unit = STRIPE_UNIT, fast = TIER_FAST_BLKS;
+	int nargc = 0;
+	for (int i = 0; i < argc; i++) {
+		if (i > 0 && strcmp(argv[i], "--ram") == 0) {
+			dev_set_backend(DEV_RAM);
+			continue;
+		}
+		if (i > 0 && strncmp(argv[i], "--stripe=", 9) == 0 && nmembers < MAX_STRIPES - 1) {
+			members[nmembers++] = argv[i] + 9;
+			continue;
+		}
+		if (i > 0 && strncmp(argv[i], "--stripe-unit=", 14) == 0) {
+			unit = atoi(argv[i] + 14);
+			continue;
+		}
+		if (i > 0 && strncmp(argv[i], "--tier=", 7) == 0) {
+			slow = argv[i] + 7;
+			continue;
+		}
+		if (i > 0 && strncmp(argv[i], "--tier-fast=", 12) == 0) {
+			fast = atoi(argv[i] + 12);
+			continue;
+		}
+		argv[nargc++] = argv[i];
+	}
+	argc = nargc;
+	if (nmembers > 0 && dev_set_stripe(members, nmembers, unit) < 0) {
+		fprintf(stderr, "bad stripe configuration\n");
+		return 1;
+	}
+	if (slow != NULL && (nmembers > 0 || dev_set_tier(slow, fast) < 0)) {
+		fprintf(stderr, "bad tier configuration\n");
+		return 1;
+	}
+
+	static char image[PATH_MAX];
+	getcwd(image, PATH_MAX - 16);
+	strcat(image, "/DISKFILE");
+	fuse_stat = fuse_main(argc, argv, &rufs_ope, image);
+
+	return fuse_stat;
+}
+